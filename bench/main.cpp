@@ -0,0 +1,311 @@
+#include <ChatMessagesModel.h>
+#include <UdpConnection.h>
+#include <UdpMessage.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QTimer>
+
+#include <functional>
+
+using namespace dtls_pair_chat;
+
+namespace {
+// Results are written here so the compiler cannot drop the measured work.
+volatile qsizetype g_sink{0};
+
+/* Minimal benchmark runner. Every benchmark is repeated with a doubling iteration count
+ * until it runs for at least the minimum time, then the last run is reported. */
+class BenchmarkRunner
+{
+public:
+    BenchmarkRunner(QString filter, qint64 minTimeMs)
+        : m_filter{std::move(filter)}
+        , m_minTimeNs{minTimeMs * 1000000}
+    {}
+
+    void run(const QString &name, const std::function<void(qint64 iterations)> &body,
+             qint64 bytesPerOp = 0)
+    {
+        if (!wanted(name))
+            return;
+        qint64 iterations{1};
+        qint64 elapsedNs{0};
+        QElapsedTimer timer;
+        forever {
+            timer.start();
+            body(iterations);
+            elapsedNs = timer.nsecsElapsed();
+            if (elapsedNs >= m_minTimeNs || iterations >= s_maxIterations)
+                break;
+            iterations *= 2;
+        }
+        report(name, iterations, elapsedNs, bytesPerOp);
+    }
+
+    /* For benchmarks that measure themselves, e.g. network round trips */
+    void report(const QString &name, qint64 iterations, qint64 elapsedNs, qint64 bytesPerOp = 0)
+    {
+        if (!wanted(name))
+            return;
+        const double nsPerOp = static_cast<double>(elapsedNs) / static_cast<double>(iterations);
+        QJsonObject result{{QStringLiteral("name"), name},
+                           {QStringLiteral("iterations"), iterations},
+                           {QStringLiteral("real_time_ns"), elapsedNs},
+                           {QStringLiteral("ns_per_op"), nsPerOp},
+                           {QStringLiteral("ops_per_second"), 1.0e9 / nsPerOp}};
+        if (bytesPerOp > 0)
+            result.insert(QStringLiteral("bytes_per_op"), bytesPerOp);
+        m_results.append(result);
+        qInfo().noquote() << name << QString::number(nsPerOp, 'f', 1) << "ns/op";
+    }
+
+    void skip(const QString &name, const QString &reason)
+    {
+        if (!wanted(name))
+            return;
+        m_results.append(QJsonObject{{QStringLiteral("name"), name},
+                                     {QStringLiteral("skipped"), reason}});
+        qWarning().noquote() << name << "skipped:" << reason;
+    }
+
+    bool wanted(const QString &name) const { return name.contains(m_filter); }
+
+    QJsonDocument toJson() const
+    {
+        const QJsonObject context{{QStringLiteral("date"),
+                                   QDateTime::currentDateTimeUtc().toString(Qt::ISODate)},
+                                  {QStringLiteral("qt_version"), QString::fromLatin1(qVersion())},
+                                  {QStringLiteral("protocol_version"),
+                                   UdpMessage::localVersion().toString()}};
+        return QJsonDocument{QJsonObject{{QStringLiteral("context"), context},
+                                         {QStringLiteral("benchmarks"), m_results}}};
+    }
+
+private:
+    static constexpr qint64 s_maxIterations{1 << 24};
+    QString m_filter;
+    qint64 m_minTimeNs;
+    QJsonArray m_results;
+};
+
+QString encodingName(UdpMessage::Encoding encoding)
+{
+    return encoding == UdpMessage::Encoding::Binary ? QStringLiteral("Binary")
+                                                    : QStringLiteral("Xml");
+}
+
+QList<UdpMessage> sampleMessages()
+{
+    const QUuid sender{QUuid::createUuid()};
+    return {UdpMessage{sender},
+            UdpMessage{sender, QUuid::createUuid()},
+            UdpMessage{QStringLiteral("correct horse battery staple"),
+                       UdpMessage::Type::SendPassword},
+            UdpMessage{UdpMessage::PasswordState::Accepted},
+            UdpMessage{QStringLiteral("Short one-liner, as they usually are.")},
+            UdpMessage{QString{QStringLiteral("A pasted log line that goes on for a while. ")}
+                           .repeated(24)}};
+}
+
+void benchmarkMessages(BenchmarkRunner &runner)
+{
+    for (const auto encoding : {UdpMessage::Encoding::Xml, UdpMessage::Encoding::Binary}) {
+        for (const auto &message : sampleMessages()) {
+            QString type = message.typeAsString();
+            if (message.type() == UdpMessage::Type::Chat && message.chatText().size() > 100)
+                type += QStringLiteral("Long");
+            const QByteArray encoded = message.toByteArray(encoding);
+            const QString suffix = QStringLiteral("/%1/%2").arg(type, encodingName(encoding));
+            runner.run(
+                QStringLiteral("UdpMessage/encode") + suffix,
+                [&](qint64 iterations) {
+                    for (qint64 i = 0; i < iterations; ++i)
+                        g_sink = message.toByteArray(encoding).size();
+                },
+                encoded.size());
+            runner.run(
+                QStringLiteral("UdpMessage/decode") + suffix,
+                [&](qint64 iterations) {
+                    for (qint64 i = 0; i < iterations; ++i)
+                        g_sink = static_cast<qsizetype>(UdpMessage{encoded}.type());
+                },
+                encoded.size());
+        }
+    }
+}
+
+void benchmarkModel(BenchmarkRunner &runner)
+{
+    const UdpMessage message{QStringLiteral("Short one-liner, as they usually are.")};
+    for (const int rows : {10000, 100000}) {
+        for (const int batchSize : {1, 64}) {
+            const QString name = QStringLiteral("ChatMessagesModel/appendReceived/%1/batch%2")
+                                     .arg(rows)
+                                     .arg(batchSize);
+            if (!runner.wanted(name))
+                continue;
+            ChatMessagesModel model;
+            model.setMaximumMessages(rows); // full history, every insert also evicts the oldest
+            const QList<UdpMessage> batch(batchSize, message);
+            while (model.rowCount() < rows)
+                model.appendReceivedMessages(batch);
+            // Measure inserts into a model that already holds the given number of rows.
+            constexpr qint64 inserts{64000};
+            QElapsedTimer timer;
+            timer.start();
+            for (qint64 i = 0; i < inserts; i += batchSize)
+                model.appendReceivedMessages(batch);
+            runner.report(name, inserts, timer.nsecsElapsed());
+        }
+    }
+}
+
+/* Ping-pong between two UdpConnections on loopback addresses. Returns elapsed nanoseconds,
+ * or -1 if the round trips did not complete in time. Messages are handled in this thread, so
+ * every round trip crosses to the network thread and back twice, like the application does. */
+qint64 pingPong(UdpConnection &sender, UdpConnection &echo, const UdpMessage &message,
+                qint64 roundTrips)
+{
+    QEventLoop loop;
+    qint64 received{0};
+    auto echoConnection = QObject::connect(&echo,
+                                           &UdpConnection::messageReceived,
+                                           &loop,
+                                           [&echo](const UdpMessage &receivedMessage) {
+                                               echo.sendMessageToRemote(receivedMessage);
+                                           });
+    auto senderConnection = QObject::connect(&sender,
+                                             &UdpConnection::messageReceived,
+                                             &loop,
+                                             [&](const UdpMessage &) {
+                                                 if (++received < roundTrips)
+                                                     sender.sendMessageToRemote(message);
+                                                 else
+                                                     loop.quit();
+                                             });
+    QTimer::singleShot(std::chrono::seconds{10}, &loop, [&loop] { loop.exit(1); });
+    QElapsedTimer timer;
+    timer.start();
+    sender.sendMessageToRemote(message);
+    const bool timedOut = loop.exec() != 0;
+    const qint64 elapsedNs = timer.nsecsElapsed();
+    QObject::disconnect(echoConnection);
+    QObject::disconnect(senderConnection);
+    return timedOut ? -1 : elapsedNs;
+}
+
+bool waitSecure(UdpConnection &server, UdpConnection &client)
+{
+    QEventLoop loop;
+    int secureCount{0};
+    bool failed{false};
+    const auto onSecureModeChanged = [&](bool isSecure) {
+        failed = failed || !isSecure;
+        if (failed || ++secureCount == 2)
+            loop.quit();
+    };
+    QObject::connect(&server, &UdpConnection::secureModeChanged, &loop, onSecureModeChanged);
+    QObject::connect(&client, &UdpConnection::secureModeChanged, &loop, onSecureModeChanged);
+    QTimer::singleShot(std::chrono::seconds{5}, &loop, [&] {
+        failed = true;
+        loop.quit();
+    });
+    const QUuid clientUuid{QUuid::createUuid()};
+    server.switchToSecureConnection(clientUuid, true);
+    client.switchToSecureConnection(clientUuid, false);
+    loop.exec();
+    return !failed;
+}
+
+void benchmarkLoopback(BenchmarkRunner &runner, UdpMessage::Encoding encoding)
+{
+    constexpr qint64 roundTrips{1000};
+    const QString suffix = QStringLiteral("/%1").arg(encodingName(encoding));
+    const QString plainName = QStringLiteral("UdpConnection/roundTrip/Plain") + suffix;
+    const QString dtlsName = QStringLiteral("UdpConnection/roundTrip/Dtls") + suffix;
+    if (!runner.wanted(plainName) && !runner.wanted(dtlsName))
+        return;
+    const QHostAddress first{QStringLiteral("127.0.0.1")};
+    const QHostAddress second{QStringLiteral("127.0.0.2")};
+    const auto a = UdpConnection::create(first, second);
+    const auto b = UdpConnection::create(second, first);
+    // 1.0 is the last version without binary encoding.
+    const QVersionNumber version = encoding == UdpMessage::Encoding::Binary
+                                       ? UdpMessage::localVersion()
+                                       : QVersionNumber{1, 0, 0};
+    a->setSupportedVersion(version);
+    b->setSupportedVersion(version);
+
+    // Chat messages are dropped on an unsecured connection, use a password message.
+    const UdpMessage plainMessage{QStringLiteral("Short one-liner, as they usually are."),
+                                  UdpMessage::Type::SendPassword};
+    const qint64 plainNs = pingPong(*a, *b, plainMessage, roundTrips);
+    if (plainNs < 0)
+        runner.skip(plainName, QStringLiteral("round trips timed out"));
+    else
+        runner.report(plainName, roundTrips, plainNs, plainMessage.toByteArray(encoding).size());
+
+    if (!waitSecure(*a, *b)) {
+        runner.skip(dtlsName, QStringLiteral("DTLS handshake did not complete"));
+        return;
+    }
+    const UdpMessage chatMessage{QStringLiteral("Short one-liner, as they usually are.")};
+    const qint64 dtlsNs = pingPong(*a, *b, chatMessage, roundTrips);
+    if (dtlsNs < 0)
+        runner.skip(dtlsName, QStringLiteral("round trips timed out"));
+    else
+        runner.report(dtlsName, roundTrips, dtlsNs, chatMessage.toByteArray(encoding).size());
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        QStringLiteral("Microbenchmarks for the dtls_pair_chat messaging hot paths"));
+    parser.addHelpOption();
+    const QCommandLineOption outputOption{{QStringLiteral("o"), QStringLiteral("output")},
+                                          QStringLiteral("Write JSON results to <file>."),
+                                          QStringLiteral("file")};
+    const QCommandLineOption filterOption{{QStringLiteral("f"), QStringLiteral("filter")},
+                                          QStringLiteral("Only run benchmarks containing <text>."),
+                                          QStringLiteral("text")};
+    const QCommandLineOption minTimeOption{QStringLiteral("min-time"),
+                                           QStringLiteral("Minimum run time per benchmark."),
+                                           QStringLiteral("ms"),
+                                           QStringLiteral("200")};
+    parser.addOptions({outputOption, filterOption, minTimeOption});
+    parser.process(app);
+
+    BenchmarkRunner runner{parser.value(filterOption), parser.value(minTimeOption).toLongLong()};
+    benchmarkMessages(runner);
+    benchmarkModel(runner);
+    // Sockets are released with deleteLater() in the network thread, before it gets to create
+    // the connections of the next round.
+    for (const auto encoding : {UdpMessage::Encoding::Xml, UdpMessage::Encoding::Binary})
+        benchmarkLoopback(runner, encoding);
+
+    const QByteArray json = runner.toJson().toJson(QJsonDocument::Indented);
+    if (parser.isSet(outputOption)) {
+        QFile output{parser.value(outputOption)};
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qCritical() << "Cannot write" << output.fileName();
+            return 1;
+        }
+        output.write(json);
+    } else {
+        QTextStream{stdout} << json;
+    }
+    return 0;
+}
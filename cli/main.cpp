@@ -0,0 +1,256 @@
+#include <ConnectionHandler.h>
+#include <MetricsServer.h>
+#include <UdpConnection.h>
+#include <UdpMessage.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QHostAddress>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+
+#include <iostream>
+#include <string>
+
+using namespace dtls_pair_chat;
+
+namespace {
+/* Headless chat client. Connects like the GUI does, sends every line read from stdin as a
+ * chat message and prints received messages to stdout. Progress and errors go to stderr. */
+class CliClient : public QObject
+{
+public:
+    CliClient(ConnectionHandler &handler, bool daemon)
+        : m_handler{handler}
+        , m_daemon{daemon}
+    {
+        m_quitTimer.setSingleShot(true);
+        m_quitTimer.setInterval(s_quitTimeout);
+        connect(&m_quitTimer, &QTimer::timeout, qApp, &QCoreApplication::quit);
+        connect(&m_handler, &ConnectionHandler::stateChanged, this, &CliClient::stateChanged);
+        connect(&m_handler, &ConnectionHandler::progressUpdated, this, [this] {
+            const QString step = m_handler.currentStep();
+            if (step != m_lastStep) {
+                m_lastStep = step;
+                QTextStream{stderr} << step << Qt::endl;
+            }
+        });
+    }
+
+    void lineRead(const QString &line)
+    {
+        if (line.isEmpty())
+            return;
+        if (line.toUtf8().size() > UdpMessage::maxChatTextSize()) {
+            QTextStream{stderr} << "Line too long to send, skipped" << Qt::endl;
+            return;
+        }
+        if (m_handler.state() == ConnectionHandler::State::Connected
+            || m_handler.state() == ConnectionHandler::State::Reconnecting)
+            m_handler.udpConnection()->sendMessageToRemote(UdpMessage{line});
+        else
+            m_unsent.append(line); // sent once connected
+    }
+
+    void inputClosed()
+    {
+        m_inputClosed = true;
+        quitWhenDelivered();
+    }
+
+private:
+    void stateChanged()
+    {
+        switch (m_handler.state()) {
+        case ConnectionHandler::State::Connected: {
+            if (std::exchange(m_reconnecting, false)) {
+                // Same connection as before, everything is still hooked up.
+                QTextStream{stderr} << "Reconnected" << Qt::endl;
+                quitWhenDelivered();
+                break;
+            }
+            QTextStream{stderr} << "Connected to " << m_handler.remoteIpAddress() << Qt::endl;
+            const auto udpConnection = m_handler.udpConnection();
+            connect(udpConnection.get(),
+                    &UdpConnection::messagesReceived,
+                    this,
+                    [](const QList<UdpMessage> &messages) {
+                        // One flush per batch
+                        QTextStream out{stdout};
+                        for (const auto &message : messages) {
+                            if (message.type() == UdpMessage::Type::Chat)
+                                out << message.chatMsg() << '\n';
+                        }
+                        out.flush();
+                    });
+            connect(udpConnection.get(),
+                    &UdpConnection::deliveryStatisticsChanged,
+                    this,
+                    &CliClient::quitWhenDelivered);
+            for (const auto &line : std::as_const(m_unsent))
+                udpConnection->sendMessageToRemote(UdpMessage{line});
+            m_unsent.clear();
+            quitWhenDelivered();
+        } break;
+        case ConnectionHandler::State::Reconnecting:
+            m_reconnecting = true;
+            break;
+        case ConnectionHandler::State::Failed:
+            QTextStream{stderr} << m_handler.errorDescription() << Qt::endl;
+            QCoreApplication::exit(1);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void quitWhenDelivered()
+    {
+        if (!m_inputClosed || m_daemon)
+            return;
+        if (m_handler.state() == ConnectionHandler::State::Reconnecting)
+            return; // unacknowledged messages go out once connected again
+        if (m_handler.state() != ConnectionHandler::State::Connected) {
+            if (m_unsent.isEmpty())
+                QCoreApplication::quit();
+            return;
+        }
+        // Give retransmissions a chance before closing, but do not wait forever.
+        if (m_handler.udpConnection()->deliveryStatistics().unacknowledged == 0)
+            QCoreApplication::quit();
+        else if (!m_quitTimer.isActive())
+            m_quitTimer.start();
+    }
+
+    static constexpr std::chrono::seconds s_quitTimeout{5};
+    ConnectionHandler &m_handler;
+    bool m_daemon;
+    bool m_inputClosed{false};
+    bool m_reconnecting{false};
+    QString m_lastStep;
+    QStringList m_unsent;
+    QTimer m_quitTimer;
+};
+
+// Chat port if the option is not given, zero if it is invalid.
+quint16 portValue(const QCommandLineParser &parser, const QCommandLineOption &option)
+{
+    if (!parser.isSet(option))
+        return UdpConnection::s_chatPort;
+    return parser.value(option).toUShort();
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("dtls_pair_chat_cli"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        QStringLiteral("Headless dtls_pair_chat client. Lines read from stdin are sent as chat "
+                       "messages, received messages are written to stdout."));
+    parser.addHelpOption();
+    const QCommandLineOption localOption{{QStringLiteral("l"), QStringLiteral("local")},
+                                         QStringLiteral("Local IP address to use."),
+                                         QStringLiteral("address")};
+    const QCommandLineOption remoteOption{{QStringLiteral("r"), QStringLiteral("remote")},
+                                          QStringLiteral("IP address of the other party."),
+                                          QStringLiteral("address")};
+    const QCommandLineOption localPortOption{
+        QStringLiteral("local-port"),
+        QStringLiteral("Local UDP port to use, 49152 by default."),
+        QStringLiteral("port")};
+    const QCommandLineOption remotePortOption{
+        QStringLiteral("remote-port"),
+        QStringLiteral("UDP port of the other party, 49152 by default."),
+        QStringLiteral("port")};
+    const QCommandLineOption localPasswordOption{
+        QStringLiteral("local-password"),
+        QStringLiteral("Password you gave to the other party."),
+        QStringLiteral("password")};
+    const QCommandLineOption remotePasswordOption{
+        QStringLiteral("remote-password"),
+        QStringLiteral("Password the other party gave to you."),
+        QStringLiteral("password")};
+    const QCommandLineOption daemonOption{
+        {QStringLiteral("d"), QStringLiteral("daemon")},
+        QStringLiteral("Do not read stdin, keep printing received messages until killed.")};
+    const QCommandLineOption metricsPortOption{
+        QStringLiteral("metrics-port"),
+        QStringLiteral("Serve metrics on localhost, /metrics for Prometheus, /metrics.json."),
+        QStringLiteral("port")};
+    parser.addOptions({localOption,
+                       remoteOption,
+                       localPortOption,
+                       remotePortOption,
+                       localPasswordOption,
+                       remotePasswordOption,
+                       daemonOption,
+                       metricsPortOption});
+    parser.process(app);
+
+    const QHostAddress localAddress{parser.value(localOption)};
+    if (localAddress.isNull()) {
+        QTextStream{stderr} << "Local address missing or invalid." << Qt::endl;
+        return 2;
+    }
+    MetricsServer metricsServer;
+    if (parser.isSet(metricsPortOption)) {
+        bool portValid{false};
+        const quint16 port = parser.value(metricsPortOption).toUShort(&portValid);
+        if (!portValid || !metricsServer.listen(port)) {
+            QTextStream{stderr} << "Metrics port invalid or in use." << Qt::endl;
+            return 2;
+        }
+    }
+    const quint16 localPort = portValue(parser, localPortOption);
+    const quint16 remotePort = portValue(parser, remotePortOption);
+    if (localPort == 0 || remotePort == 0) {
+        QTextStream{stderr} << "Local or remote port invalid." << Qt::endl;
+        return 2;
+    }
+    ConnectionHandler handler;
+    handler.localPort(localPort);
+    handler.remotePort(remotePort);
+    handler.localIpAddress(localAddress);
+    handler.remoteIpAddress(parser.value(remoteOption));
+    handler.localPassword(parser.value(localPasswordOption));
+    handler.remotePassword(parser.value(remotePasswordOption));
+    if (!handler.loginInfoSet()) {
+        QTextStream{stderr} << "Remote address and two different passwords are required."
+                            << Qt::endl;
+        return 2;
+    }
+
+    const bool daemon{parser.isSet(daemonOption)};
+    CliClient client{handler, daemon};
+    QThread *stdinReader{nullptr};
+    if (!daemon) {
+        /* Blocking reads in a thread of their own, lines are handed to the main thread.
+         * Works the same for terminals, pipes and Windows consoles. */
+        stdinReader = QThread::create([&client] {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                QMetaObject::invokeMethod(&client,
+                                          [&client, text = QString::fromStdString(line)] {
+                                              client.lineRead(text);
+                                          },
+                                          Qt::QueuedConnection);
+            }
+            QMetaObject::invokeMethod(&client, [&client] { client.inputClosed(); },
+                                      Qt::QueuedConnection);
+        });
+        stdinReader->start();
+    }
+    handler.connectToRemote();
+    const int result = app.exec();
+    if (stdinReader) {
+        // A blocking read can not be interrupted, leave the thread to process exit.
+        if (stdinReader->wait(QDeadlineTimer{100}))
+            delete stdinReader;
+    }
+    return result;
+}
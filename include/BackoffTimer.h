@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QObject>
+#include <QTimer>
+
+#include <chrono>
+
+namespace dtls_pair_chat {
+/* Repeating timer whose interval doubles after every timeout, up to a maximum.
+ * Used to retransmit connection setup messages until the remote answers. */
+class BackoffTimer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BackoffTimer(std::chrono::milliseconds initialInterval,
+                          std::chrono::milliseconds maximumInterval);
+    void start(); // (re)starts from the initial interval
+    void stop();
+    bool isActive() const;
+
+signals:
+    void timeout();
+
+private slots:
+    void expired();
+
+private:
+    std::chrono::milliseconds m_initialInterval;
+    std::chrono::milliseconds m_maximumInterval;
+    std::chrono::milliseconds m_currentInterval;
+    QTimer m_timer;
+};
+} // namespace dtls_pair_chat
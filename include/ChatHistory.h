@@ -0,0 +1,65 @@
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+#include <optional>
+
+namespace dtls_pair_chat {
+struct ChatRecord
+{
+    enum class Direction : quint8 { Incoming, Outgoing };
+    QByteArray text;     // raw UTF-8 text
+    qint64 timestamp{0}; // milliseconds since epoch
+    Direction direction{Direction::Incoming};
+};
+
+/* Append-only chat history of one peer, stored in a directory of its own.
+ * Records are appended to segment files of limited size. A fixed size entry per record in a
+ * separate index file locates it by id (0 is the oldest). The index is memory mapped, so opening
+ * takes the same time regardless of history length and any record is found without a scan.
+ * There is one writer per directory. Other threads read through read-only instances of their own. */
+class ChatHistory
+{
+public:
+    enum class Mode { ReadWrite, ReadOnly };
+    explicit ChatHistory(const QString &directory, Mode mode = Mode::ReadWrite);
+    ~ChatHistory();
+    bool isValid() const;
+    QString directory() const;
+    quint64 count() const;
+    void refresh(); // read-only view: pick up records appended by the writer
+    bool append(const ChatRecord &record);
+    bool append(const QList<ChatRecord> &records); // written with one flush
+    std::optional<ChatRecord> read(quint64 id) const;
+
+private:
+    struct Location
+    {
+        quint32 segment{0};
+        quint32 offset{0};
+    };
+    std::optional<Location> location(quint64 id) const;
+    bool writeRecord(const ChatRecord &record, QByteArray &indexEntries);
+    bool openSegmentForAppend(quint32 segment);
+    QString segmentFileName(quint32 segment) const;
+    static constexpr qint64 s_indexEntrySize{8};   // segment and offset, quint32 each
+    static constexpr qint64 s_recordHeaderSize{13}; // text size, timestamp and direction
+    static constexpr qint64 s_maxSegmentSize{64 * 1024 * 1024};
+    QString m_directory;
+    Mode m_mode;
+    bool m_valid{false};
+    quint64 m_count{0};
+    mutable QFile m_index; // mapped from const readers
+    QFile m_segment; // current segment, opened for appending
+    qint64 m_segmentSize{0}; // including writes not flushed yet
+    quint32 m_segmentNumber{0};
+    // Reading. Index mapping grows with the index, one segment is kept open at a time.
+    mutable uchar *m_mappedIndex{nullptr};
+    mutable quint64 m_mappedEntries{0};
+    mutable QFile m_reader;
+    mutable std::optional<quint32> m_readerSegment;
+};
+} // namespace dtls_pair_chat
@@ -1,32 +1,83 @@
 #pragma once
+#include <ChatHistory.h>
+#include <RingBuffer.h>
+#include <SearchIndex.h>
 #include <UdpMessage.h>
 
 #include <QAbstractListModel>
+#include <QThread>
+#include <QTimer>
 
 namespace dtls_pair_chat {
 class UdpConnection;
 
+/* Chat history shown in a ListView with BottomToTop layout, so row 0 is the newest message.
+ * Messages are stored oldest first in a bounded ring buffer, the oldest ones are dropped when
+ * the maximum is reached.
+ * With a persistent history set, every message is also appended to it and nothing is dropped:
+ * the ring buffer only keeps the newest messages in memory. Older rows are paged in from disk
+ * with fetchMore() as the view scrolls towards them.
+ * Received chat messages are taken from the lock-free queue of the connection once per frame
+ * and inserted as one row range.
+ * The history is also indexed for full-text search in a worker thread, search() answers with
+ * searchFinished() without blocking the GUI. */
 class ChatMessagesModel : public QAbstractListModel
 {
     Q_OBJECT
+    Q_PROPERTY(int maximumMessages READ maximumMessages WRITE setMaximumMessages NOTIFY maximumMessagesChanged FINAL)
 public:
     explicit ChatMessagesModel();
+    ~ChatMessagesModel() override;
     Q_INVOKABLE int rowCount(const QModelIndex &parent = QModelIndex()) const override;
     Q_INVOKABLE QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
     QHash<int, QByteArray> roleNames() const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
     void setUdpConnection(std::shared_ptr<UdpConnection> udpConnection);
+    void appendReceivedMessages(const QList<UdpMessage> &messages); // chat ones, oldest first
+    void setHistory(std::unique_ptr<ChatHistory> history);
+    int maximumMessages() const;
+    void setMaximumMessages(int maximum);
+    // Returns the request id given in searchFinished().
+    Q_INVOKABLE int search(const QString &query);
+    // Loads older pages until the row exists, e.g. to show a search result.
+    Q_INVOKABLE bool loadRow(int row);
 
 public slots:
-    void sendMessage(const QString &message);
+    bool sendMessage(const QString &message); // false if too long to send
+
+signals:
+    void maximumMessagesChanged();
+    // Each match is a map with row, text (HTML, matching words highlighted), timestamp and incoming.
+    // Complete is false while the history is still being indexed.
+    void searchFinished(int requestId, const QVariantList &matches, bool complete);
 
 private slots:
-    void messageReceived(const UdpMessage &message);
+    void takeQueuedMessages();
+    void searchIndexFinished(quint64 requestId,
+                             const QList<dtls_pair_chat::SearchIndex::Match> &matches,
+                             bool complete);
 
 private:
-    enum class Role { MsgText = Qt::ItemDataRole::UserRole };
-    enum class Direction { Incoming, Outgoing };
-    void insertNewMessage(QStringView message, Direction direction);
-    QStringList m_messages;
+    enum class Role { MsgText = Qt::ItemDataRole::UserRole, Timestamp, Incoming };
+    using Direction = ChatRecord::Direction;
+    void insertNewMessages(QList<ChatRecord> records); // oldest first, one row range
+    const ChatRecord &recordAt(int row) const;
+    const ChatRecord &storedRecord(quint64 id) const;
+    static QString formatted(const ChatRecord &record);
+    static constexpr int s_defaultMaximumMessages{10000};
+    static constexpr int s_pageSize{100};
+    static constexpr int s_cachedPages{8};
+    static constexpr std::chrono::milliseconds s_frameInterval{16};
+    RingBuffer<ChatRecord> m_messages{s_defaultMaximumMessages};
+    std::unique_ptr<ChatHistory> m_history;
+    int m_rowCount{0};
+    // Pages of older messages read from the history, oldest page dropped first.
+    mutable QHash<quint64, QList<ChatRecord>> m_pages;
+    mutable QList<quint64> m_pageOrder;
     std::shared_ptr<UdpConnection> m_udpConnection;
+    QTimer m_frameTimer; // takes queued messages once per frame
+    QThread m_searchThread;
+    SearchIndex *m_searchIndex; // lives in m_searchThread, deleted when it finishes
 };
 } // namespace dtls_pair_chat
@@ -1,39 +1,52 @@
 #pragma once
 
+#include <BackoffTimer.h>
 #include <Handshake.h>
 #include <PasswordVerifier.h>
 #include <UdpConnection.h>
 
+#include <QElapsedTimer>
+#include <QFuture>
 #include <QHostAddress>
 #include <QObject>
 #include <QTimer>
 
 namespace dtls_pair_chat {
+/* Takes the user from login data to a verified secure connection. Remotes of version 1.6 and
+ * later prove their password with the DTLS handshake, older ones exchange passwords inside
+ * the secure channel afterwards. Once connected, a lost path is reconnected on the same
+ * UdpConnection: only the DTLS handshake and password verification are repeated, so
+ * messages and chat history are kept. */
 class ConnectionHandler : public QObject
 {
     Q_OBJECT
 public:
-    enum class State { Idle, Connecting, Connected, Failed };
+    enum class State { Idle, Connecting, Connected, Reconnecting, Failed };
     enum class AbortReason {
         Timeout,
         User,
         VersionMismatch,
         NoVersionFromRemote,
         SecureConnectFail,
-        PasswordMismatch
+        PasswordMismatch,
+        RemoteClosed
     };
     explicit ConnectionHandler();
 
     // Getters
     QString localPassword();
+    quint16 localPort() const;
     QString remoteIpAddress();
     QString remotePassword();
+    quint16 remotePort() const;
 
     // Setters
     void localIpAddress(const QHostAddress &address);
     void localPassword(QStringView password);
+    void localPort(quint16 port);
     void remoteIpAddress(QStringView address);
     void remotePassword(QStringView password);
+    void remotePort(quint16 port);
 
     // Control
     void connectToRemote();
@@ -52,6 +65,8 @@ signals:
     void progressUpdated();
     void remoteIpInvalid();
     void errorDescriptionChanged();
+    // Step names as in the setup step metrics
+    void stepDurationMeasured(const QByteArray &step, std::chrono::nanoseconds duration);
 
 private slots:
     void remoteVersionReceived(const QVersionNumber &version);
@@ -60,6 +75,11 @@ private slots:
     void secureChannelOpened(bool isSecure);
     void passwordVerificationDone(bool success);
     void timeoutTick();
+    void connectionLost();
+    void connectionRestored();
+    void secureChannelReopened(bool isSecure);
+    void connectedDtlsError(QDtlsError error);
+    void retryReconnect();
 
 private:
     enum class Step {
@@ -69,17 +89,34 @@ private:
         ExchangingPasswords
     };
     static QString toString(QDtlsError error);
+    static QByteArray stepName(Step step);
+    bool passwordsInHandshake() const; // pre-shared key, no separate password exchange
+    void openPreSharedKeyChannel(const QByteArray &passwordKey,
+                                 const QUuid &clientUuid,
+                                 bool isServer);
+    void connectionEstablished();
+    void stepCompleted(); // records how long the current step took
     static constexpr int s_defaultTimeout{60};
+    static constexpr std::chrono::milliseconds s_initialReconnectInterval{250};
+    static constexpr std::chrono::milliseconds s_maximumReconnectInterval{4000};
     Step m_step{Step::WaitingLoginData};
     State m_state{State::Idle};
     QDtlsError m_secureChannelError{QDtlsError::NoError};
     int m_remainingSeconds{s_defaultTimeout};
     QHostAddress m_localIp;
     QHostAddress m_remoteIp;
+    quint16 m_localPort{UdpConnection::s_chatPort};
+    quint16 m_remotePort{UdpConnection::s_chatPort};
     QString m_localPassword;
     QString m_remotePassword;
     QString m_errorDescription;
+    // Password keys for both roles, derived ahead of the handshake for these passwords.
+    std::pair<QString, QString> m_passwordKeyPasswords;
+    QFuture<QByteArray> m_localFirstPasswordKey;  // used as server
+    QFuture<QByteArray> m_remoteFirstPasswordKey; // used as client
     QTimer m_timeoutTimer;
+    QElapsedTimer m_stepTimer;
+    BackoffTimer m_reconnectTimer{s_initialReconnectInterval, s_maximumReconnectInterval};
     std::unique_ptr<Handshake> m_handshaker;
     std::unique_ptr<PasswordVerifier> m_passwordVerifier;
     std::shared_ptr<UdpConnection> m_udpConnection;
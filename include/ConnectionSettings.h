@@ -1,14 +1,18 @@
 #pragma once
 
+#include <LinkMonitor.h>
+
 #include <QAbstractItemModel>
 #include <QHostAddress>
 #include <QObject>
 #include <QQmlEngine>
+#include <QUrl>
 
 namespace dtls_pair_chat {
 class ConnectionHandler;
 class HostInfo;
 class ChatMessagesModel;
+class FileTransfer;
 
 class ConnectionSettings : public QObject
 {
@@ -19,9 +23,19 @@ class ConnectionSettings : public QObject
     Q_PROPERTY(int localAddressIdx READ localAddressIdx WRITE setLocalAddressIdx NOTIFY localAddressIdxChanged FINAL)
     Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged FINAL)
     Q_PROPERTY(QString progressState READ progressState NOTIFY progressChanged FINAL)
+    Q_PROPERTY(bool reconnecting READ reconnecting NOTIFY reconnectingChanged FINAL)
     Q_PROPERTY(bool requiredFieldsFilled READ requiredFieldsFilled NOTIFY requiredFieldsFilledChanged FINAL)
     Q_PROPERTY(QStringList thisMachineIpAddresses READ thisMachineIpAddresses NOTIFY ipAddressesChanged FINAL)
     Q_PROPERTY(QAbstractItemModel *chatModel READ chatModel NOTIFY chatModelChanged FINAL)
+    Q_PROPERTY(bool fileTransferActive READ fileTransferActive NOTIFY fileTransferChanged FINAL)
+    Q_PROPERTY(bool fileOfferPending READ fileOfferPending NOTIFY fileTransferChanged FINAL)
+    Q_PROPERTY(QString fileTransferState READ fileTransferState NOTIFY fileTransferProgressChanged FINAL)
+    Q_PROPERTY(qreal fileTransferProgress READ fileTransferProgress NOTIFY fileTransferProgressChanged FINAL)
+    Q_PROPERTY(qreal fileTransferRate READ fileTransferRate NOTIFY fileTransferProgressChanged FINAL)
+    Q_PROPERTY(int roundTripTime READ roundTripTime NOTIFY linkQualityChanged FINAL)
+    Q_PROPERTY(int jitter READ jitter NOTIFY linkQualityChanged FINAL)
+    Q_PROPERTY(qreal lossRate READ lossRate NOTIFY linkQualityChanged FINAL)
+    Q_PROPERTY(int deadPeerTimeout READ deadPeerTimeout WRITE setDeadPeerTimeout NOTIFY deadPeerTimeoutChanged FINAL)
 
 public:
     explicit ConnectionSettings(QObject *parent = nullptr);
@@ -29,6 +43,9 @@ public:
     Q_INVOKABLE void abortConnection();
     Q_INVOKABLE void createConnection();
     Q_INVOKABLE void copyToClipboard(const QString &text);
+    Q_INVOKABLE void sendFile(const QUrl &fileUrl);
+    Q_INVOKABLE void acceptFileOffer();
+    Q_INVOKABLE void cancelFileTransfer(); // also rejects an offer
 
     // User input fields
     Q_INVOKABLE void setRemoteIp(const QString &newIp);
@@ -44,9 +61,20 @@ public:
     void setLocalAddressIdx(int value);
     qreal progress() const;
     QString progressState() const;
+    bool reconnecting() const;
     bool requiredFieldsFilled() const;
     QStringList thisMachineIpAddresses() const;
     QAbstractItemModel *chatModel() const;
+    bool fileTransferActive() const;
+    bool fileOfferPending() const; // remote offers a file, waiting for accept or cancel
+    QString fileTransferState() const;
+    qreal fileTransferProgress() const;
+    qreal fileTransferRate() const; // bytes per second
+    int roundTripTime() const; // milliseconds, -1 until measured
+    int jitter() const;        // milliseconds
+    qreal lossRate() const;    // share of heartbeats lost, 0 to 1
+    int deadPeerTimeout() const; // seconds
+    void setDeadPeerTimeout(int seconds);
 
 signals:
     // property signals
@@ -54,8 +82,13 @@ signals:
     void localAddressIdxChanged();
     void ipAddressesChanged();
     void progressChanged();
+    void reconnectingChanged();
     void requiredFieldsFilledChanged();
     void chatModelChanged();
+    void fileTransferChanged();
+    void fileTransferProgressChanged();
+    void linkQualityChanged();
+    void deadPeerTimeoutChanged();
 
     // connection status
     void connectionStarted();
@@ -68,11 +101,17 @@ signals:
 private slots:
     void setThisMachineIpAddresses(const QList<QHostAddress> &newAddresses);
     void connectionStateChanged();
+    void updateLinkQuality();
 
 private:
+    static QString historyDirectory(const QHostAddress &remoteAddress);
     int m_localAddressIdx{-1};
+    bool m_reconnecting{false};
+    int m_deadPeerTimeout{5}; // seconds
+    LinkMonitor::Quality m_linkQuality;
     QList<QHostAddress> m_thisMachineIpAddresses;
     std::unique_ptr<ChatMessagesModel> m_chatModel;
+    std::unique_ptr<FileTransfer> m_fileTransfer;
     std::unique_ptr<ConnectionHandler> m_connectionHandler;
     std::unique_ptr<HostInfo> m_hostInfo;
 };
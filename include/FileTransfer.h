@@ -0,0 +1,129 @@
+#pragma once
+
+#include <BackoffTimer.h>
+#include <RttEstimator.h>
+#include <UdpMessage.h>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMap>
+#include <QObject>
+#include <QTimer>
+
+namespace dtls_pair_chat {
+class UdpConnection;
+
+/* Transfers one file at a time, in either direction, over the secure channel.
+ * The file is cut into fixed size chunks that each fit a single datagram. The sender keeps
+ * a window of chunks in flight and reads them from a memory mapped segment of the file,
+ * the receiver appends them to disk in order. Neither end holds more than a window of the
+ * file in memory, so file size is only limited by the 32 bit chunk index.
+ * Nothing is written for an offer from the remote until it is accepted with acceptOffer(). */
+class FileTransfer : public QObject
+{
+    Q_OBJECT
+public:
+    // Offering waits for the remote to accept our file, Offered for the user to accept theirs.
+    enum class State { Idle, Offering, Offered, Sending, Receiving, Complete, Failed };
+    enum class Direction { Outgoing, Incoming };
+    explicit FileTransfer();
+    ~FileTransfer();
+    void setUdpConnection(std::shared_ptr<UdpConnection> udpConnection);
+    void setDownloadDirectory(const QString &directory); // where received files are saved
+
+    // Control
+    bool sendFile(const QString &filePath);
+    void acceptOffer();
+    void cancel(); // also rejects an offer
+
+    // Status
+    State state() const;
+    bool isActive() const;
+    Direction direction() const;
+    QString fileName() const;
+    quint64 fileSize() const;
+    quint64 transferredBytes() const;
+    qreal progress() const;       // 0.0 to 1.0
+    qreal bytesPerSecond() const; // smoothed throughput
+
+signals:
+    void stateChanged();
+    void progressChanged(); // throttled, a few times per second at most
+
+private slots:
+    void messageReceived(const UdpMessage &message);
+    void retransmissionTimeout();
+    void retransmitOffer();
+    void sendAcknowledgement();
+    void updateThroughput();
+
+private:
+    struct PendingChunk
+    {
+        QElapsedTimer sentAt;
+        int transmissions{1};
+    };
+    // Sending
+    void offerReceived(const UdpMessage &message);
+    void acknowledgementReceived(const UdpMessage::Acknowledgement &acknowledgement);
+    void sendWindow();
+    void sendChunk(quint32 chunkIndex);
+    QByteArray chunkData(quint32 chunkIndex);
+    void restartRetransmissionTimer();
+    // Receiving
+    void chunkReceived(const UdpMessage &message);
+    bool writeChunk(QByteArrayView data);
+    void finishReceiving();
+    // Both
+    void start(State state, Direction direction);
+    void finish(State state);
+    void sendToRemote(const UdpMessage &message);
+    quint32 chunkCount() const;
+    qint64 chunkDataSize(quint32 chunkIndex) const;
+    static constexpr quint32 s_chunkSize{1024}; // fits the minimum path MTU with all overhead
+    static constexpr quint32 s_maxChunkSize{64 * 1024};
+    static constexpr quint32 s_windowSize{128};          // chunks in flight
+    static constexpr quint32 s_maxOutOfOrderChunks{512}; // buffered by the receiver
+    static constexpr int s_chunksPerAcknowledgement{8};
+    static constexpr int s_duplicateAcknowledgementsToRetransmit{3};
+    static constexpr int s_maxTimeoutsWithoutProgress{8};
+    static constexpr int s_maxOfferRetransmissions{20};
+    static constexpr qint64 s_mappedSegmentSize{64 * 1024 * 1024}; // multiple of chunk sizes
+    static constexpr std::chrono::milliseconds s_acknowledgementDelay{10};
+    static constexpr std::chrono::milliseconds s_progressInterval{250};
+    std::shared_ptr<UdpConnection> m_udpConnection;
+    QString m_downloadDirectory;
+    State m_state{State::Idle};
+    Direction m_direction{Direction::Outgoing};
+    quint32 m_transferId{0};
+    QString m_fileName;
+    quint64 m_fileSize{0};
+    quint32 m_chunkSize{s_chunkSize};
+    QFile m_file;
+    quint64 m_transferredBytes{0};
+    // Sending
+    uchar *m_mapped{nullptr};
+    qint64 m_mappedOffset{0};
+    qint64 m_mappedSize{0};
+    quint32 m_nextChunk{0};      // next chunk never sent before
+    quint32 m_acknowledged{0};   // every chunk before this has been acknowledged
+    QMap<quint32, PendingChunk> m_inFlight;
+    RttEstimator m_rttEstimator;
+    QTimer m_retransmissionTimer;
+    BackoffTimer m_offerTimer{std::chrono::milliseconds{250}, std::chrono::milliseconds{4000}};
+    int m_offerRetransmissions{0};
+    int m_timeoutsWithoutProgress{0};
+    int m_duplicateAcknowledgements{0};
+    // Receiving
+    QString m_targetPath;
+    quint32 m_nextExpected{0};
+    QMap<quint32, QByteArray> m_outOfOrder;
+    int m_unacknowledgedChunks{0};
+    QTimer m_acknowledgementTimer;
+    // Throughput
+    QTimer m_progressTimer;
+    QElapsedTimer m_rateClock;
+    quint64 m_rateBytes{0};
+    qreal m_bytesPerSecond{0.0};
+};
+} // namespace dtls_pair_chat
@@ -1,13 +1,14 @@
 #pragma once
 
+#include <BackoffTimer.h>
 #include <UdpConnection.h>
+#include <UdpMessage.h>
 
 #include <QObject>
 #include <QUuid>
 #include <QVersionNumber>
 
 namespace dtls_pair_chat {
-class UdpMessage;
 
 class Handshake : public QObject
 {
@@ -22,13 +23,21 @@ signals:
 
 private slots:
     void messageReceived(const UdpMessage &receivedMessage);
+    void retransmit();
 
 private:
     enum class State { Idle, WaitingAckForSentUuid, WaitingAckForAck, Complete };
+    void sendToRemote(const UdpMessage &message, bool retransmitUntilAnswered);
     void finalize(const QUuid &remoteUuid);
+    static constexpr std::chrono::milliseconds s_initialRetransmitInterval{250};
+    static constexpr std::chrono::milliseconds s_maximumRetransmitInterval{4000};
     QUuid m_myId{QUuid::createUuid()};
+    QUuid m_remoteId;
     std::shared_ptr<UdpConnection> m_udpConnection;
     State m_state{State::Idle};
+    bool m_isServer{false};
     std::optional<QVersionNumber> m_remoteVersion;
+    std::optional<UdpMessage> m_lastSent; // resent on timeout and when remote repeats itself
+    BackoffTimer m_retransmitTimer{s_initialRetransmitInterval, s_maximumRetransmitInterval};
 };
 }; // namespace dtls_pair_chat
@@ -1,14 +1,20 @@
 #pragma once
 #include <QHostAddress>
-#include <QHostInfo>
 #include <QObject>
 
+class QSocketNotifier;
+
 namespace dtls_pair_chat {
+/* Addresses this machine can be reached at, read from the network interfaces without any
+ * name resolution. On Linux rtnetlink reports address and link changes as they happen, e.g.
+ * a DHCP renew or a VPN coming up. Elsewhere the network information backend of the
+ * platform tells when reachability changes. Nothing is polled. */
 class HostInfo : public QObject
 {
     Q_OBJECT
 public:
     explicit HostInfo();
+    ~HostInfo();
     QList<QHostAddress> currentAddresses() const;
     QString currentError() const;
 
@@ -16,14 +22,16 @@ signals:
     void addressesChanged(const QList<QHostAddress>& newAddresses);
 
 private slots:
-    void handleHostInfo(const QHostInfo newInfo);
+    void refresh();
+    void readNetlinkEvents();
 
 private:
-    void timerEvent(QTimerEvent *event) override;
-    enum class Error { None, NoAddress, HostNotFound, Unknown };
+    void subscribeToChanges();
+    enum class Error { None, NoAddress, NoNetwork };
     QList<QHostAddress> m_currentAddresses;
-    HostInfo::Error m_currentError{Error::NoAddress};
+    HostInfo::Error m_currentError{Error::NoNetwork};
     QString m_currentErrorString{tr("No network connection")};
-    int m_lookUpId{-1};
+    int m_netlinkSocket{-1};
+    QSocketNotifier *m_netlinkNotifier{nullptr}; // child, Linux only
 };
 } // namespace dtls_pair_chat
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <RttEstimator.h>
+#include <UdpMessage.h>
+
+#include <QElapsedTimer>
+#include <QMap>
+#include <QObject>
+#include <QTimer>
+
+namespace dtls_pair_chat {
+/* Keepalive and link quality of a secure session.
+ * A heartbeat goes out every interval and the remote answers it right away. Answers give the
+ * round trip time, its jitter and the share of heartbeats lost, the traffic keeps NAT and
+ * firewall state of the path alive. If nothing at all is received for the dead peer timeout,
+ * the remote is gone or the path is broken. */
+class LinkMonitor : public QObject
+{
+    Q_OBJECT
+public:
+    struct Quality
+    {
+        std::optional<std::chrono::milliseconds> smoothedRtt; // none until the first answer
+        std::chrono::milliseconds jitter{0}; // mean difference of consecutive round trips
+        qreal lossRate{0.0};                 // of the last heartbeats, 0 to 1
+        quint64 sent{0};                     // heartbeats
+        quint64 answered{0};                 // in time, late answers are counted lost
+    };
+    explicit LinkMonitor();
+
+    void start(); // also restarts the dead peer timeout
+    void stop();
+    bool isActive() const;
+    void setInterval(std::chrono::milliseconds interval);
+    void setDeadPeerTimeout(std::chrono::milliseconds timeout);
+
+    // Anything received from the remote proves it alive.
+    void remoteActive();
+    void answerReceived(quint32 heartbeatNumber);
+
+    Quality quality() const;
+
+signals:
+    void transmit(const UdpMessage &message);
+    void qualityChanged();
+    void peerDead(); // once, until the remote is heard of again
+
+private slots:
+    void sendHeartbeat();
+
+private:
+    void recordResult(bool answered);
+    static constexpr std::chrono::milliseconds s_defaultInterval{1000};
+    static constexpr std::chrono::milliseconds s_defaultDeadPeerTimeout{5000};
+    static constexpr int s_lossWindow{32};          // heartbeats the loss rate is computed over
+    static constexpr int s_answerTimeoutIntervals{3}; // unanswered this long counts as lost
+    QTimer m_timer;
+    std::chrono::milliseconds m_deadPeerTimeout{s_defaultDeadPeerTimeout};
+    QElapsedTimer m_sinceReceived;
+    bool m_peerDead{false};
+    quint32 m_nextHeartbeat{0};
+    QMap<quint32, QElapsedTimer> m_outstanding; // sent heartbeats waiting for an answer
+    RttEstimator m_rttEstimator;
+    std::optional<qint64> m_previousRttMs;
+    double m_jitterMs{0.0};
+    quint32 m_results{0}; // bit set for every answered heartbeat, newest in bit 0
+    int m_resultCount{0};
+    quint64 m_sent{0};
+    quint64 m_answered{0};
+};
+} // namespace dtls_pair_chat
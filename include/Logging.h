@@ -0,0 +1,11 @@
+#pragma once
+
+#include <QLoggingCategory>
+
+namespace dtls_pair_chat {
+/* Categories of the per-datagram and per-session debug output.
+ * Release builds define QT_NO_DEBUG_OUTPUT, so qCDebug to them compiles to nothing. In debug
+ * builds they are filtered at runtime, e.g. QT_LOGGING_RULES="dtls_pair_chat.datagram=false". */
+Q_DECLARE_LOGGING_CATEGORY(lcDatagram) // every message received, ignored or dropped
+Q_DECLARE_LOGGING_CATEGORY(lcSession)  // DTLS handshakes, resumption and loss of a session
+} // namespace dtls_pair_chat
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+
+namespace dtls_pair_chat {
+/* Packs encoded messages sent in quick succession into one envelope record, so a burst of
+ * small messages costs one DTLS record and datagram instead of one each. The receiving side
+ * unpacks the envelope into the original encoded messages. */
+class MessageCoalescer
+{
+public:
+    static bool isEnvelope(QByteArrayView record);
+    /* For reading. Returns the encoded messages, none if the envelope is malformed. */
+    static QList<QByteArray> unpack(QByteArrayView envelope);
+
+    /* For sending. Adds the message if the envelope stays within maxRecordSize. */
+    bool add(const QByteArray &message, qsizetype maxRecordSize);
+    /* Whether the message could be packed at all, even into an empty envelope */
+    static bool fits(const QByteArray &message, qsizetype maxRecordSize);
+    bool isEmpty() const;
+    /* The single message as is, or an envelope of all of them. Leaves the coalescer empty. */
+    QByteArray take();
+
+private:
+    static constexpr qsizetype s_headerSize{1};
+    static constexpr qsizetype s_lengthSize{2};
+    QList<QByteArray> m_messages;
+    qsizetype m_envelopeSize{s_headerSize};
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QList>
+
+namespace dtls_pair_chat {
+/* Splits encoded messages that do not fit into one datagram into fragment records and
+ * reassembles them on the receiving side. Reassembly is bounded both in memory and time,
+ * so fragments of lost or spoofed messages can not pile up. */
+class MessageFragmenter
+{
+public:
+    static bool isFragment(QByteArrayView datagram);
+    /* Size of a fragment record without any data */
+    static constexpr qsizetype headerSize() { return s_headerSize; }
+    /* Largest message that is reassembled */
+    static constexpr qsizetype maxMessageSize() { return s_maxPendingBytes; }
+
+    /* For sending. Every returned record is at most maxRecordSize bytes. */
+    QList<QByteArray> split(const QByteArray &message, qsizetype maxRecordSize);
+
+    /* For reading. Returns the message when its last missing fragment arrives. */
+    std::optional<QByteArray> reassemble(QByteArrayView fragment);
+
+private:
+    struct PendingMessage
+    {
+        QList<QByteArray> fragments;
+        int receivedCount{0};
+        qsizetype receivedBytes{0};
+        QDeadlineTimer deadline;
+    };
+    static constexpr qsizetype s_headerSize{10};
+    static constexpr qsizetype s_maxPendingBytes{4 * 1024 * 1024};
+    // Fragments of a legitimate message are far larger, this only limits the fragment count.
+    static constexpr qsizetype s_minFragmentSize{512};
+    static constexpr int s_maxFragmentCount{s_maxPendingBytes / s_minFragmentSize};
+    static constexpr int s_maxPendingMessages{64};
+    static constexpr std::chrono::seconds s_reassemblyTimeout{10};
+    static qsizetype footprint(const PendingMessage &message);
+    void dropExpired();
+    void dropOldest();
+    QHash<quint32, PendingMessage> m_pending;
+    qsizetype m_pendingBytes{0}; // fragment data and the slots waiting for it
+    quint32 m_nextMessageId{0};
+};
+} // namespace dtls_pair_chat
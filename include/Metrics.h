@@ -0,0 +1,60 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+
+#include <atomic>
+#include <memory>
+
+namespace dtls_pair_chat {
+/* Process wide registry of counters and histograms for monitoring.
+ * Instruments are registered once, usually into a static reference, and live as long as the
+ * process. Updating one is a relaxed atomic add from any thread, cheap enough for the path of
+ * every datagram. Names and labels follow Prometheus conventions; snapshots of everything
+ * are rendered in its text exposition format or as JSON. */
+class Metrics
+{
+public:
+    class Counter
+    {
+    public:
+        void add(quint64 value = 1) { m_value.fetch_add(value, std::memory_order_relaxed); }
+        quint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<quint64> m_value{0};
+    };
+
+    class Histogram
+    {
+    public:
+        explicit Histogram(const QList<double> &upperBounds); // ascending, +Inf is implicit
+        void observe(double value);
+        const QList<double> &upperBounds() const;
+        QList<quint64> bucketCounts() const; // not cumulative, last one is +Inf
+        quint64 count() const;
+        double sum() const;
+
+    private:
+        QList<double> m_upperBounds;
+        std::unique_ptr<std::atomic<quint64>[]> m_bucketCounts;
+        std::atomic<quint64> m_count{0};
+        std::atomic<double> m_sum{0.0};
+    };
+
+    /* Labels are given in Prometheus syntax, e.g. step="ExchangingPasswords". Asking again
+     * for the same name and labels returns the same instrument. */
+    static Counter &counter(const QByteArray &name,
+                            const QByteArray &help,
+                            const QByteArray &labels = {});
+    static Histogram &histogram(const QByteArray &name,
+                                const QByteArray &help,
+                                const QList<double> &upperBounds,
+                                const QByteArray &labels = {});
+    // Bucket bounds in seconds, from a few milliseconds to a minute
+    static const QList<double> &durationBuckets();
+
+    static QByteArray toPrometheusText();
+    static QByteArray toJson();
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QObject>
+#include <QTcpServer>
+
+namespace dtls_pair_chat {
+/* Minimal HTTP endpoint on localhost for scraping the metrics registry.
+ * GET /metrics answers in Prometheus text format, GET /metrics.json with the JSON dump and
+ * GET /trace.json with the receive path trace. One request per connection, anything else
+ * gets 404. */
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetricsServer(QObject *parent = nullptr);
+    bool listen(quint16 port);
+    quint16 port() const;
+
+private slots:
+    void acceptConnections();
+
+private:
+    static constexpr qsizetype s_maxRequestSize{8192};
+    QTcpServer m_server;
+};
+} // namespace dtls_pair_chat
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <BackoffTimer.h>
 #include <UdpConnection.h>
 
 #include <QFlags>
+#include <QFuture>
 #include <QObject>
+#include <QUuid>
 
 namespace dtls_pair_chat {
 class UdpMessage;
 
+/* Exchanges the passwords inside the secure channel, for remotes older than version 1.6.
+ * Newer ones prove them with a pre-shared key in the DTLS handshake instead. */
 class PasswordVerifier : public QObject
 {
     Q_OBJECT
@@ -16,15 +21,30 @@ public:
                               QStringView localPassword,
                               QStringView remotePassword);
     void start();
+    /* Slow part of the DTLS pre-shared key, PBKDF2 over both passwords with the server's
+     * first. Runs in the thread pool. Roles are only known once the initial handshake is
+     * done, so an end starts it for both orders before that and uses one of them. */
+    static QFuture<QByteArray> derivePasswordKey(QStringView serverPassword,
+                                                 QStringView clientPassword);
+    /* Key of one pairing, the password key expanded with HKDF salted with the client UUID of
+     * the initial handshake. The ends only get the same key if each has the password the
+     * other gave, and every pairing has a key of its own. */
+    static QByteArray preSharedKey(const QByteArray &passwordKey, const QUuid &clientUuid);
 
 signals:
     void complete(bool passwordsMatch);
 
 private slots:
     void messageReceived(const UdpMessage &receivedMessage);
+    void retransmit();
 
 private:
+    void sendPassword();
     void tryFinalize();
+    static constexpr std::chrono::milliseconds s_initialRetransmitInterval{250};
+    static constexpr std::chrono::milliseconds s_maximumRetransmitInterval{4000};
+    static constexpr int s_keyDerivationIterations{100000};
+    static constexpr int s_preSharedKeySize{32};
     enum class ReceivedMessage { None = 0x00, Password = 0x01, Ack = 0x02, Both = 0x03 };
     Q_DECLARE_FLAGS(ReceivedMessages, ReceivedMessage)
     QString m_localPassword;
@@ -32,6 +52,8 @@ private:
     ReceivedMessages m_received{ReceivedMessage::None};
     bool m_passwordsMatch{true}; // will be set false if either condition fails
     bool m_running{false};
+    bool m_completed{false};
+    BackoffTimer m_retransmitTimer{s_initialRetransmitInterval, s_maximumRetransmitInterval};
     std::shared_ptr<UdpConnection> m_udpConnection;
 };
 }; // namespace dtls_pair_chat
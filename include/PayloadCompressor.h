@@ -0,0 +1,22 @@
+#pragma once
+
+#include <QByteArray>
+
+#include <optional>
+
+namespace dtls_pair_chat {
+/* zstd compression of message bodies. Both ends use the same built-in dictionary of common
+ * chat text, so even short messages compress. Safe to use from any thread. */
+class PayloadCompressor
+{
+public:
+    /* Bodies smaller than this are not worth the frame overhead */
+    static constexpr qsizetype thresholdSize() { return s_thresholdSize; }
+    static std::optional<QByteArray> compress(QByteArrayView data);
+    /* Refuses frames that would decompress to more than maxSize bytes */
+    static std::optional<QByteArray> decompress(QByteArrayView frame, qsizetype maxSize);
+
+private:
+    static constexpr qsizetype s_thresholdSize{48};
+};
+} // namespace dtls_pair_chat
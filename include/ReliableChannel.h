@@ -0,0 +1,84 @@
+#pragma once
+
+#include <RttEstimator.h>
+#include <UdpMessage.h>
+
+#include <QElapsedTimer>
+#include <QMap>
+#include <QObject>
+#include <QTimer>
+
+namespace dtls_pair_chat {
+/* Reliable, ordered delivery on top of datagrams.
+ * Outgoing messages get a sequence number and are kept until the remote acknowledges them,
+ * with retransmission after a timeout estimated from the measured round trip time.
+ * Incoming messages are held in a reorder buffer and released in sequence order.
+ * A message that keeps going unanswered marks the path stalled until anything is received. */
+class ReliableChannel : public QObject
+{
+    Q_OBJECT
+public:
+    struct Statistics
+    {
+        quint64 sent{0};          // messages sent, retransmissions not included
+        quint64 acknowledged{0};  // sent messages acknowledged by remote
+        quint64 retransmitted{0}; // retransmissions
+        quint64 received{0};      // messages delivered in order
+        quint64 duplicates{0};    // received again, e.g. because our ack was lost
+        quint64 reordered{0};     // received ahead of a missing message
+        int unacknowledged{0};    // currently waiting for ack
+        std::chrono::milliseconds smoothedRtt{0};
+        std::chrono::milliseconds retransmissionTimeout{0};
+    };
+    explicit ReliableChannel();
+
+    /* For sending. The message gets a sequence number and is emitted through transmit. */
+    void send(UdpMessage message);
+    /* Attach the pending acknowledgement, if any, to a message about to be sent. */
+    void piggybackAcknowledgement(UdpMessage &message);
+
+    /* For reading. Handles acknowledgements carried by the message and returns
+     * the messages that can now be delivered in order. */
+    QList<UdpMessage> receive(UdpMessage message);
+
+    Statistics statistics() const;
+    bool isStalled() const;
+    /* Sends everything unacknowledged again right away, without the backed off timeout.
+     * For when the path is known to work again. */
+    void retransmitNow();
+
+signals:
+    void transmit(const UdpMessage &message);
+    void statisticsChanged();
+    void stalled();
+
+private slots:
+    void retransmissionTimeout();
+    void sendAcknowledgement();
+
+private:
+    struct PendingMessage
+    {
+        UdpMessage message;
+        QElapsedTimer sentAt;
+        int transmissions{1};
+    };
+    static bool sequenceBefore(quint32 first, quint32 second);
+    void acknowledged(const UdpMessage::Acknowledgement &acknowledgement);
+    void restartRetransmissionTimer();
+    UdpMessage::Acknowledgement currentAcknowledgement() const;
+    static constexpr std::chrono::milliseconds s_acknowledgementDelay{20};
+    static constexpr quint32 s_maxReorderBuffer{1024};
+    static constexpr int s_stallTransmissions{4}; // a few seconds with the minimum timeout
+    quint32 m_nextSequenceNumber{0};
+    quint32 m_nextExpected{0};
+    QMap<quint32, PendingMessage> m_unacknowledged;
+    QMap<quint32, UdpMessage> m_reorderBuffer;
+    RttEstimator m_rttEstimator;
+    QTimer m_retransmissionTimer;
+    QTimer m_acknowledgementTimer;
+    bool m_acknowledgementPending{false};
+    bool m_stalled{false};
+    Statistics m_statistics;
+};
+} // namespace dtls_pair_chat
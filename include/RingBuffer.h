@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QList>
+
+#include <algorithm>
+
+namespace dtls_pair_chat {
+/* Bounded FIFO storage. Appending to a full buffer overwrites the oldest item in O(1).
+ * Storage grows on demand up to the capacity, so a large capacity costs nothing until used.
+ * Index 0 is the oldest item. */
+template<typename T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(qsizetype capacity)
+        : m_capacity{capacity}
+    {}
+
+    qsizetype size() const { return m_size; }
+    qsizetype capacity() const { return m_capacity; }
+    bool isEmpty() const { return m_size == 0; }
+    bool isFull() const { return m_size == m_capacity; }
+
+    const T &at(qsizetype index) const
+    {
+        Q_ASSERT(index >= 0 && index < m_size);
+        return m_items.at((m_first + index) % m_items.size());
+    }
+
+    void append(T value)
+    {
+        if (m_capacity <= 0)
+            return;
+        if (m_size == m_capacity) {
+            // Storage is exactly the capacity when full, overwrite the oldest.
+            m_items[m_first] = std::move(value);
+            m_first = (m_first + 1) % m_items.size();
+        } else if (m_size < m_items.size()) {
+            m_items[(m_first + m_size) % m_items.size()] = std::move(value);
+            m_size++;
+        } else {
+            linearize();
+            m_items.append(std::move(value));
+            m_size++;
+        }
+    }
+
+    void removeOldest(qsizetype count = 1)
+    {
+        count = qMin(count, m_size);
+        for (qsizetype i = 0; i < count; ++i) {
+            m_items[m_first] = T{}; // release what the item holds
+            m_first = (m_first + 1) % m_items.size();
+        }
+        m_size -= count;
+    }
+
+    void setCapacity(qsizetype capacity) // keeps the newest items
+    {
+        linearize();
+        if (m_size > capacity) {
+            m_items.remove(0, m_size - capacity);
+            m_size = capacity;
+        }
+        m_items.resize(m_size);
+        m_capacity = capacity;
+    }
+
+    void clear()
+    {
+        m_items.clear();
+        m_first = 0;
+        m_size = 0;
+    }
+
+private:
+    void linearize()
+    {
+        if (m_first != 0) {
+            std::rotate(m_items.begin(), m_items.begin() + m_first, m_items.end());
+            m_first = 0;
+        }
+        m_items.resize(m_size);
+    }
+
+    QList<T> m_items;
+    qsizetype m_capacity;
+    qsizetype m_first{0}; // index of the oldest item in m_items
+    qsizetype m_size{0};
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+namespace dtls_pair_chat {
+/* Round trip time estimation and retransmission timeout as in RFC 6298 */
+class RttEstimator
+{
+public:
+    void addSample(std::chrono::milliseconds rtt);
+    void backoff(); // after a retransmission timeout the timeout doubles until next sample
+    void resetBackoff(); // path is known to work again, back to the estimated timeout
+    std::chrono::milliseconds retransmissionTimeout() const;
+    std::optional<std::chrono::milliseconds> smoothedRtt() const;
+    std::chrono::milliseconds rttVariation() const;
+
+private:
+    void updateTimeout();
+    static constexpr std::chrono::milliseconds s_initialTimeout{1000};
+    static constexpr std::chrono::milliseconds s_minimumTimeout{200};
+    static constexpr std::chrono::milliseconds s_maximumTimeout{60000};
+    std::optional<double> m_smoothedRttMs;
+    double m_rttVariationMs{0.0};
+    std::chrono::milliseconds m_timeout{s_initialTimeout};
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,79 @@
+#pragma once
+#include <ChatHistory.h>
+
+#include <QFile>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+
+#include <atomic>
+#include <memory>
+
+namespace dtls_pair_chat {
+/* Full-text index over one chat history. Maps each case folded word to the ids of the messages
+ * containing it. Ids are appended in ascending order, so postings are stored as variable length
+ * deltas, mostly one byte per occurrence.
+ * The object is meant to live in a worker thread of its own. Public functions may be called from
+ * any thread, the work is queued to the thread of the object. Messages are indexed from a
+ * read-only view of the history as the writer appends them.
+ * Postings are saved next to the history, appended batch by batch like the history itself, so
+ * opening it again only indexes what was added since. */
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+public:
+    struct Match
+    {
+        quint64 id{0};
+        qint64 timestamp{0};
+        bool incoming{false};
+        QString text; // HTML, matching words highlighted
+    };
+    explicit SearchIndex(QObject *parent = nullptr);
+    void open(const QString &historyDirectory);
+    void close();
+    void historyAppended();
+    // Finds messages containing all words of the query, newest first. Returns the request id
+    // given in searchFinished(). Requests superseded by a newer one are dropped unanswered.
+    quint64 search(const QString &query);
+
+signals:
+    // Complete is false while older history is still being indexed, matches may be missing.
+    void searchFinished(quint64 requestId,
+                        const QList<dtls_pair_chat::SearchIndex::Match> &matches,
+                        bool complete);
+
+private:
+    struct Postings
+    {
+        QByteArray deltas;
+        quint64 last{0};
+        quint64 count{0};
+    };
+    struct UnsavedPostings
+    {
+        qsizetype deltasOffset{0}; // in the deltas of the word
+        quint64 count{0};          // of the word before
+    };
+    void openHistory(const QString &historyDirectory);
+    void loadPostings();
+    bool loadBatch(QByteArrayView records);
+    void savePostings();
+    void indexPending();
+    void addMessage(quint64 id, QStringView text);
+    void runSearch(quint64 requestId, const QString &query);
+    QList<quint64> decode(const Postings &postings) const;
+    QString highlighted(QStringView text, const QSet<QByteArray> &words) const;
+    template<typename F>
+    static void forEachWord(QStringView text, F &&function);
+    static QByteArray normalized(QStringView word);
+    static constexpr quint64 s_indexBatch{20000}; // messages indexed before serving queued work
+    static constexpr qsizetype s_maxMatches{200};
+    std::unique_ptr<ChatHistory> m_history;
+    QHash<QByteArray, Postings> m_postings;
+    QHash<QByteArray, UnsavedPostings> m_unsaved; // added since the last batch was saved
+    QFile m_file; // saved postings, the index is kept in memory only if it can not be written
+    quint64 m_indexed{0};
+    std::atomic<quint64> m_latestRequest{0};
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+
+namespace dtls_pair_chat {
+/* Unbounded lock-free queue between exactly one producer thread and one consumer thread.
+ * Items are kept in a linked list, the producer only touches the tail and the consumer only
+ * the head, so they never contend for anything but the link between the two. */
+template<typename T>
+class SpscQueue
+{
+public:
+    SpscQueue()
+        : m_head{new Node}
+        , m_tail{m_head}
+    {}
+    ~SpscQueue()
+    {
+        while (m_head) {
+            Node *next = m_head->next.load(std::memory_order_relaxed);
+            delete m_head;
+            m_head = next;
+        }
+    }
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    void push(T value) // producer
+    {
+        Node *node = new Node;
+        node->value.emplace(std::move(value));
+        m_tail->next.store(node, std::memory_order_release);
+        m_tail = node;
+    }
+
+    std::optional<T> pop() // consumer
+    {
+        // Head is an empty node, the first item is in the node after it.
+        Node *next = m_head->next.load(std::memory_order_acquire);
+        if (!next)
+            return std::nullopt;
+        std::optional<T> value{std::move(next->value)};
+        next->value.reset();
+        delete m_head;
+        m_head = next;
+        return value;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        std::optional<T> value;
+    };
+    alignas(64) Node *m_head; // consumer side
+    alignas(64) Node *m_tail; // producer side
+};
+} // namespace dtls_pair_chat
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <QByteArray>
+
+namespace dtls_pair_chat {
+/* Always on, fixed size trace of the receive path for looking at latency spikes afterwards.
+ * Events are written as plain numbers into a ring buffer, the oldest are overwritten. Writing
+ * one is a handful of relaxed atomic stores from any thread, nothing is allocated or
+ * formatted. A snapshot is rendered as Chrome trace event JSON, for chrome://tracing or
+ * Perfetto. */
+class Trace
+{
+public:
+    enum class Event : quint8 {
+        DatagramReceived, // value is the datagram size
+        Decrypt,          // value is the payload size
+        Parse,            // value is the message type
+        Emit,             // value is the number of messages
+    };
+
+    // Timestamps are monotonic nanoseconds.
+    static qint64 now();
+    static void instant(Event event, quint32 value = 0);
+    static void complete(Event event, qint64 start, quint32 value = 0);
+
+    // Records a complete event for its lifetime, for functions with many ways out.
+    class Scope
+    {
+    public:
+        explicit Scope(Event event, quint32 value = 0);
+        ~Scope();
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        Event m_event;
+        quint32 m_value;
+        qint64 m_start;
+    };
+
+    static QByteArray toChromeJson();
+
+    static constexpr int s_capacity{8192}; // events, a power of two
+};
+} // namespace dtls_pair_chat
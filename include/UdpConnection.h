@@ -1,38 +1,157 @@
 #pragma once
 
+#include <LinkMonitor.h>
+#include <MessageCoalescer.h>
+#include <MessageFragmenter.h>
+#include <ReliableChannel.h>
+#include <SpscQueue.h>
+#include <UdpMessage.h>
+
 #include <QDtls>
 #include <QObject>
+#include <QTimer>
 #include <QUuid>
 
+#include <atomic>
+
+class QSslPreSharedKeyAuthenticator;
 class QUdpSocket;
 
 namespace dtls_pair_chat {
-class UdpMessage;
+class UdpSocketDemux;
 
+/* Session with one remote end. Sessions on the same local address share one socket, so any
+ * number of them can exist side by side, each with its own DTLS state and protocol version.
+ * Sessions, their sockets and DTLS state live in a network thread of their own, so decrypting
+ * and parsing never wait for the GUI. Signals reach receivers in other threads queued.
+ * Messages sent from one other thread go through a lock-free queue, other calls from outside
+ * the network thread wait until it has handled them. */
 class UdpConnection : public QObject
 {
     Q_OBJECT
 public:
-    explicit UdpConnection(const QHostAddress &myAddress, const QHostAddress &remoteAddress);
+    static constexpr quint16 s_chatPort{49152};
+    /* Created in the network thread, and destroyed there when the last reference is gone.
+     * Both ends use the chat port unless told otherwise, e.g. to run both on one host. */
+    static std::shared_ptr<UdpConnection> create(const QHostAddress &myAddress,
+                                                 const QHostAddress &remoteAddress,
+                                                 quint16 remotePort = s_chatPort,
+                                                 quint16 localPort = s_chatPort);
     ~UdpConnection();
     void sendMessageToRemote(const UdpMessage &message);
+    /* While enabled chat messages are not emitted, they are handed over through a lock-free
+     * queue instead. chatMessagesQueued() tells when the queue is no longer empty, the one
+     * consumer then takes everything with takeChatMessages(). */
+    void setChatQueueEnabled(bool enabled);
+    QList<UdpMessage> takeChatMessages();
+    /* Messages sent within the delay are packed into one record, up to the path MTU, when the
+     * negotiated version supports it. Zero sends every message right away. */
+    void setCoalescingDelay(std::chrono::milliseconds delay);
+    /* Heartbeats keep the path alive and measure it while secure, when the negotiated version
+     * answers them. Nothing received for the dead peer timeout counts as a lost connection. */
+    void setHeartbeatInterval(std::chrono::milliseconds interval);
+    void setDeadPeerTimeout(std::chrono::milliseconds timeout);
+    /* With a key, the DTLS handshake offers pre-shared key cipher suites only and succeeds
+     * only if both ends have the same key. Set before switchToSecureConnection(), it is kept
+     * for resumed sessions. */
+    void setPreSharedKey(const QByteArray &key);
     void switchToSecureConnection(const QUuid &clientUuid, bool isServer);
+    /* After connectionLost() the client end starts a new DTLS handshake on the same session,
+     * offering the cached session ticket. Sequence numbers, unacknowledged messages, version
+     * and path MTU are kept. Does nothing on the server end, it answers the client hello,
+     * nor while a handshake is still in progress or once the path works again. */
+    void resumeSecureConnection();
+    /* Version negotiated with the remote end, limits what is sent and accepted.
+     * Also selects the encoding used for sent messages. */
+    void setSupportedVersion(const QVersionNumber &version);
+    std::optional<QVersionNumber> supportedVersion() const;
+    QHostAddress remoteAddress() const;
+    quint16 remotePort() const;
+    quint16 pathMtu() const;
+    ReliableChannel::Statistics deliveryStatistics() const; // link quality of chat delivery
+    LinkMonitor::Quality linkQuality() const; // measured with heartbeats
+    quint32 receiveQueueDrops() const; // of the shared socket, where the platform reports them
 
 signals:
+    // All messages read in one go, emitted before messageReceived() for each of them.
+    void messagesReceived(const QList<dtls_pair_chat::UdpMessage> &receivedMessages);
     void messageReceived(const UdpMessage &receivedMessage);
     void secureModeChanged(bool isSecure);
     void dtlsError(QDtlsError error);
+    void pathMtuChanged(quint16 pathMtu);
+    void deliveryStatisticsChanged();
+    void linkQualityChanged();
+    void receiveQueueDropsChanged(quint32 drops);
+    void chatMessagesQueued();
+    // Secure path stopped working, or the remote started a new session.
+    void connectionLost();
+    // Secure path works again without a new handshake.
+    void connectionRestored();
 
 private slots:
-    void readPendingMessage();
+    void dtlsHandshakeTimeout();
+    void preSharedKeyRequired(QSslPreSharedKeyAuthenticator *authenticator);
+    void sendMtuProbes();
+    void transmit(UdpMessage message);
+    void sendQueued();
+    void flushCoalesced();
+    void reliableChannelStalled();
 
 private:
+    friend class UdpSocketDemux;
+    explicit UdpConnection(const QHostAddress &myAddress,
+                           const QHostAddress &remoteAddress,
+                           quint16 remotePort,
+                           quint16 localPort);
     enum class SecureState { Off, Handshake, On };
-    static constexpr quint16 s_chatPort{49152};
-    QUdpSocket* m_socket;
+    void datagramReceived(const QByteArray &datagram); // from the demultiplexer
+    void emitReceived(); // once all pending datagrams have been handed over
+    void createDtlsConnection(QSslSocket::SslMode mode);
+    void leaveSecureState(); // to wait for a new handshake on an established session
+    void markConnectionLost();
+    void sendEncoded(const QByteArray &encoded);
+    bool writeRecord(const QByteArray &record);
+    void handlePayload(const QByteArray &payload);
+    bool reliableDeliveryActive() const;
+    bool coalescingActive() const;
+    bool heartbeatsActive() const;
+    void pathMtuAcknowledged(quint16 pathMtu);
+    qsizetype maxRecordSize(quint16 pathMtu) const;
+    static constexpr quint16 s_minimumPathMtu{1280}; // IPv6 minimum, safe on any path
+    static constexpr quint16 s_probedPathMtus[]{1500, 1492, 1420, 1400};
+    static constexpr int s_mtuProbeRounds{3};
+    static constexpr std::chrono::milliseconds s_defaultCoalescingDelay{2};
+    std::shared_ptr<UdpSocketDemux> m_demux;
+    QUdpSocket* m_socket; // owned by m_demux
     QHostAddress m_myAddress;
     QHostAddress m_remoteAddress;
+    quint16 m_remotePort;
     SecureState m_state{SecureState::Off};
+    std::optional<QVersionNumber> m_supportedVersion;
+    UdpMessage::Encoding m_encoding{UdpMessage::Encoding::Xml};
+    QUuid m_clientUuid;
+    bool m_isServer{false};
+    bool m_sessionEstablished{false}; // first handshake done, later ones resume
+    bool m_connectionLost{false};
+    QByteArray m_sessionTicket; // from the last handshake as client
+    QByteArray m_clientRandom;  // of the session handshake as server
+    QByteArray m_preSharedKey;  // empty for a handshake without one
+    QByteArray m_earlyClientHello; // arrived before this end went secure
     std::unique_ptr<QDtls> m_dtlsConnection;
+    QList<UdpMessage> m_receivedMessages; // waiting for emitReceived
+    std::optional<bool> m_secureModeChange;
+    MessageFragmenter m_fragmenter;
+    MessageCoalescer m_coalescer;
+    QTimer m_coalescingTimer;
+    ReliableChannel m_reliableChannel;
+    LinkMonitor m_linkMonitor;
+    std::atomic<quint16> m_pathMtu{s_minimumPathMtu};
+    int m_mtuProbeRoundsLeft{0};
+    QTimer m_mtuProbeTimer;
+    SpscQueue<UdpMessage> m_outgoing; // sent from outside the network thread
+    std::atomic<bool> m_outgoingScheduled{false};
+    SpscQueue<UdpMessage> m_chatQueue;
+    std::atomic<bool> m_chatQueueEnabled{false};
+    std::atomic<bool> m_chatQueueSignalled{false};
 };
 }; // namespace dtls_pair_chat
@@ -1,6 +1,7 @@
 #pragma once
 
-#include <QByteArrayView>
+#include <QAnyStringView>
+#include <QByteArray>
 #include <QStringView>
 #include <QUuid>
 #include <QVersionNumber>
@@ -9,17 +10,63 @@ namespace dtls_pair_chat {
 class UdpMessage
 {
 public:
-    enum class Type { Unknown, SendUuid, AckUuid, SendPassword, AckPassword, Chat };
+    /* Type values are used as the binary type tag, only append new types. */
+    enum class Type {
+        Unknown,
+        SendUuid,
+        AckUuid,
+        SendPassword,
+        AckPassword,
+        Chat,
+        MtuProbe,
+        MtuProbeAck,
+        Ack,
+        FileOffer,
+        FileChunk,
+        FileAck,
+        FileCancel,
+        Heartbeat,
+        HeartbeatAck
+    };
     enum class PasswordState { Accepted, Rejected };
+    /* Xml is understood by every version, Binary from version 1.1 onwards. */
+    enum class Encoding { Xml, Binary };
+    /* Selective acknowledgement of reliably sent messages, binary only.
+     * Every sequence number before nextExpected has been received. Bit n of selective is set
+     * if nextExpected + 1 + n has been received as well. */
+    struct Acknowledgement
+    {
+        quint32 nextExpected{0};
+        quint32 selective{0};
+    };
     explicit UdpMessage(const QUuid &uuidToUse); // Send Uuid constructor
     explicit UdpMessage(const QUuid &uuidOfSender,
                         const QUuid &receiverUuid); // Ack Uuid constructor
     explicit UdpMessage(PasswordState state);       // Ack Password constructor
     explicit UdpMessage(QStringView payload,
                         Type messageType = Type::Chat); // Chat / SendPassword message constructor
+    explicit UdpMessage(Type messageType,
+                        quint16 pathMtu,
+                        qsizetype padding = 0); // MtuProbe / MtuProbeAck constructor, binary only
+    explicit UdpMessage(const Acknowledgement &acknowledgement); // Ack constructor, binary only
+    explicit UdpMessage(quint32 transferId,
+                        quint64 fileSize,
+                        quint32 chunkSize,
+                        QStringView fileName); // FileOffer constructor, binary only
+    // FileChunk constructor, binary only. The message holds its own copy of the data.
+    explicit UdpMessage(quint32 transferId, quint32 chunkIndex, const QByteArray &data);
+    explicit UdpMessage(quint32 transferId,
+                        const Acknowledgement &acknowledgement); // FileAck constructor, binary only
+    explicit UdpMessage(quint32 transferId); // FileCancel constructor, binary only
+    explicit UdpMessage(Type messageType,
+                        quint32 heartbeatNumber); // Heartbeat(Ack) constructor, binary only
 
-    /* received message constructor, will determine the type from byte array content */
-    explicit UdpMessage(QByteArrayView receivedMessage);
+    /* received message constructor, will determine the encoding and type from byte array content.
+     * The byte array is shared, not copied: binary encoded text is read in place from it.
+     * Messages newer than the version negotiated with the sender are rejected. Until the
+     * version is known, any version is accepted. */
+    explicit UdpMessage(const QByteArray &receivedMessage,
+                        const std::optional<QVersionNumber> &supportedVersion = std::nullopt);
 
     /* versioning
      * Major versions are incompatible.
@@ -29,37 +76,88 @@ public:
      * 2.n.m and 3.x.y wont work together, no matter what values n, m, x and y have.
      * 1.3.x and 1.5.y work together, but will only use features of 1.3.x.
      * 1.2.n and 1.2.m will be fully compatible regardless of values of n and m.
+     * The version to use is negotiated per remote end, see UdpConnection::setSupportedVersion.
      */
-    static std::optional<QVersionNumber> supportedVersion();
-    static void resetSupportedVersion(); // set version to use to undefined
-    static void setSupportedVersion(
-        const QVersionNumber &version); // set version to use (i.e. limit to this version)
-    static QVersionNumber localVersion();
+    static const QVersionNumber &localVersion(); // parsed once per process
     /* msgVersion can be local or remote, depending on message origin.
      * invalid message returns std::nullopt */
     std::optional<QVersionNumber> msgVersion() const;
+    /* Most compact encoding the given (negotiated) version is able to read */
+    static Encoding encodingForVersion(const QVersionNumber &version);
+    /* File transfer messages are understood from version 1.2 onwards, binary only */
+    static bool fileTransferSupported(const QVersionNumber &version);
+    /* Several messages packed in one record are understood from version 1.3 onwards */
+    static bool coalescingSupported(const QVersionNumber &version);
+    /* Compressed binary bodies are understood from version 1.4 onwards */
+    static bool compressionSupported(const QVersionNumber &version);
+    /* Heartbeats are answered from version 1.5 onwards, binary only */
+    static bool heartbeatSupported(const QVersionNumber &version);
+    /* Passwords are proven by a pre-shared key DTLS handshake from version 1.6 onwards */
+    static bool preSharedKeySupported(const QVersionNumber &version);
+    /* Longest chat text in UTF-8 bytes, with all extensions still within what the remote
+     * reassembles */
+    static qsizetype maxChatTextSize();
 
-    /* For sending */
-    QByteArray toByteArray() const;
+    /* For sending. Message is marked with the given (negotiated) version, local version
+     * if not given. */
+    QByteArray toByteArray(Encoding encoding = Encoding::Xml,
+                           const std::optional<QVersionNumber> &version = std::nullopt) const;
 
     /* For reading */
     QUuid payloadUuid() const;
     QUuid senderUuid() const;
     Type type() const;
+    QAnyStringView chatText() const; // view to the text, valid as long as the message is
     QString chatMsg() const;
     bool accepted() const;
+    quint16 pathMtu() const; // path MTU probed or acknowledged
+    quint32 heartbeatNumber() const; // heartbeat sent or answered
+
+    /* File transfer */
+    quint32 transferId() const;
+    quint64 fileSize() const;
+    quint32 chunkSize() const;
+    quint32 chunkIndex() const;
+    QString fileName() const;
+    QByteArrayView fileData() const; // view to the chunk data, valid as long as the message is
+    Acknowledgement fileAcknowledgement() const; // chunks received, in chunk index units
+
+    /* Reliable delivery, carried by any binary encoded message */
+    std::optional<quint32> sequenceNumber() const;
+    void setSequenceNumber(quint32 sequenceNumber);
+    std::optional<Acknowledgement> acknowledgement() const;
+    void setAcknowledgement(const Acknowledgement &acknowledgement); // piggybacked ack
 
     /* Helpful aid for logging */
     QString typeAsString() const;
 
 private:
-    static std::optional<QVersionNumber> s_supportedVersion;
-    static bool versionAccepted(const std::optional<QVersionNumber> &receivedVersion);
+    static bool versionAccepted(const std::optional<QVersionNumber> &receivedVersion,
+                                const QVersionNumber &supportedVersion);
+    void parseXml(const std::optional<QVersionNumber> &supportedVersion);
+    void parseBinary(const std::optional<QVersionNumber> &supportedVersion);
+    static std::optional<QVersionNumber> parseVersion(QStringView versionString);
+    QByteArray toXml(const std::optional<QVersionNumber> &version) const;
+    QByteArray toBinary(const std::optional<QVersionNumber> &version) const;
     QUuid m_payloadUuid;
     QUuid m_senderUuid;
     Type m_type{Type::Unknown};
-    QString m_chatMsg;
+    QString m_chatMsg;      // text of sent and XML encoded messages
+    QByteArray m_received;  // received datagram, binary encoded text and data is a slice of it
+    qsizetype m_payloadOffset{0};
+    qsizetype m_payloadSize{0};
     bool m_accepted{false};
+    quint16 m_pathMtu{0};
+    qsizetype m_padding{0};
+    quint32 m_heartbeatNumber{0};
+    quint32 m_transferId{0};
+    quint64 m_fileSize{0};
+    quint32 m_chunkSize{0};
+    quint32 m_chunkIndex{0};
+    QByteArray m_fileData; // chunk data of sent messages
+    Acknowledgement m_fileAcknowledgement;
+    std::optional<quint32> m_sequenceNumber;
+    std::optional<Acknowledgement> m_acknowledgement;
     std::optional<QVersionNumber> m_msgVersion;
 };
 } // namespace dtls_pair_chat
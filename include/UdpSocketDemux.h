@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QDtlsClientVerifier>
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+class QUdpSocket;
+
+namespace dtls_pair_chat {
+class UdpConnection;
+
+/* One UDP socket shared by every UdpConnection on the same local address and port.
+ * Received datagrams are handed to the connection of the sending peer, looked up by peer
+ * address and port, so a single port serves any number of remote ends.
+ * On Linux a burst of datagrams is read with recvmmsg() into preallocated buffers, one system
+ * call per batch instead of one per datagram. Elsewhere QUdpSocket reads them one by one. */
+class UdpSocketDemux : public QObject, public std::enable_shared_from_this<UdpSocketDemux>
+{
+    Q_OBJECT
+public:
+    struct Peer
+    {
+        QHostAddress address;
+        quint16 port{0};
+    };
+    /* Socket bound to the given local end. Connections of the same local end share it,
+     * it is closed when the last one is gone. */
+    static std::shared_ptr<UdpSocketDemux> forLocalEnd(const QHostAddress &address, quint16 port);
+    ~UdpSocketDemux();
+
+    QUdpSocket *socket() const;
+    void addConnection(const Peer &peer, UdpConnection *connection);
+    void removeConnection(const Peer &peer, UdpConnection *connection);
+    qsizetype connectionCount() const;
+    /* DTLS cookie exchange. Answers the client hello with a cookie challenge until the client
+     * proves it receives at its address, only then it is worth setting up DTLS state. */
+    bool verifyClient(const QByteArray &clientHello, const Peer &peer);
+    /* Allowed by default, so peers that do not reassemble fragments themselves still get large
+     * messages. Path MTU probes are sent with it disallowed, where supported. */
+    void setIpFragmentationAllowed(bool allowed);
+    // Datagrams dropped by the kernel because the receive queue was full, where supported.
+    quint32 receiveQueueDrops() const;
+
+signals:
+    void receiveQueueDropsChanged(quint32 drops);
+
+private slots:
+    void readPendingDatagrams();
+
+private:
+    explicit UdpSocketDemux(const QHostAddress &address, quint16 port);
+    // Reads what is queued with recvmmsg(). Returns false where that is not available.
+    bool readBatches(const std::function<void(const QByteArray &, const Peer &)> &receive);
+    static constexpr int s_batchSize{16};
+    static constexpr qsizetype s_maxDatagramSize{65536};
+    QUdpSocket *m_socket;
+    Peer m_localEnd;
+    QHash<Peer, UdpConnection *> m_connections;
+    QDtlsClientVerifier m_clientVerifier;
+    QByteArray m_batchBuffers; // s_batchSize buffers of s_maxDatagramSize, allocated on demand
+    std::atomic<quint32> m_receiveQueueDrops{0}; // read from other threads
+};
+
+bool operator==(const UdpSocketDemux::Peer &first, const UdpSocketDemux::Peer &second);
+size_t qHash(const UdpSocketDemux::Peer &peer, size_t seed = 0);
+} // namespace dtls_pair_chat
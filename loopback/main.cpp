@@ -0,0 +1,221 @@
+#include <ConnectionHandler.h>
+#include <UdpMessage.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QTextStream>
+#include <QTimer>
+
+#include <algorithm>
+
+using namespace dtls_pair_chat;
+
+namespace {
+struct End
+{
+    QHostAddress address;
+    quint16 port;
+    QString password; // given to the other end
+};
+
+/* Connection setup of two complete ConnectionHandler stacks talking to each other on this
+ * host, repeated to get the distribution of setup latency. Both ends go through the initial
+ * handshake, DTLS and password verification exactly as the application does. */
+class LoopbackHarness
+{
+public:
+    LoopbackHarness(End first, End second, std::chrono::milliseconds timeout)
+        : m_first{std::move(first)}
+        , m_second{std::move(second)}
+        , m_timeout{timeout}
+    {}
+
+    // Returns false if the ends did not both get connected in time.
+    bool connectOnce()
+    {
+        QMap<QByteArray, QList<qint64>> stepSamples;
+        const auto first = createHandler(m_first, m_second, stepSamples);
+        const auto second = createHandler(m_second, m_first, stepSamples);
+        QEventLoop loop;
+        const auto checkStates = [&] {
+            if (first->state() == ConnectionHandler::State::Failed
+                || second->state() == ConnectionHandler::State::Failed) {
+                loop.exit(1);
+            } else if (first->state() == ConnectionHandler::State::Connected
+                       && second->state() == ConnectionHandler::State::Connected) {
+                loop.quit();
+            }
+        };
+        QObject::connect(first.get(), &ConnectionHandler::stateChanged, &loop, checkStates);
+        QObject::connect(second.get(), &ConnectionHandler::stateChanged, &loop, checkStates);
+        QTimer::singleShot(m_timeout, &loop, [&loop] { loop.exit(1); });
+        QElapsedTimer timer;
+        timer.start();
+        first->connectToRemote();
+        second->connectToRemote();
+        const bool connected = loop.exec() == 0;
+        if (!connected) {
+            m_failures++;
+            return false;
+        }
+        m_totalSamples.append(timer.nsecsElapsed());
+        for (auto it = stepSamples.cbegin(); it != stepSamples.cend(); ++it)
+            m_stepSamples[it.key()].append(it.value());
+        /* Handlers are destroyed on return, their pending signals with them. Sockets are
+         * released in the network thread before it gets to create those of the next round. */
+        return true;
+    }
+
+    int failures() const { return m_failures; }
+
+    void printSummary(QTextStream &out) const
+    {
+        out << Qt::left << qSetFieldWidth(26) << "step" << qSetFieldWidth(12) << "p50 ms"
+            << "p99 ms" << qSetFieldWidth(0) << "samples" << Qt::endl;
+        const auto printRow = [&out](const QByteArray &name, QList<qint64> samples) {
+            out << qSetFieldWidth(26) << name << qSetFieldWidth(12)
+                << milliseconds(percentile(samples, 50)) << milliseconds(percentile(samples, 99))
+                << qSetFieldWidth(0) << samples.size() << Qt::endl;
+        };
+        for (auto it = m_stepSamples.cbegin(); it != m_stepSamples.cend(); ++it)
+            printRow(it.key(), it.value());
+        printRow(QByteArrayLiteral("total"), m_totalSamples);
+        out << m_failures << " failed" << Qt::endl;
+    }
+
+    QJsonDocument toJson() const
+    {
+        const QJsonObject context{{QStringLiteral("date"),
+                                   QDateTime::currentDateTimeUtc().toString(Qt::ISODate)},
+                                  {QStringLiteral("qt_version"), QString::fromLatin1(qVersion())},
+                                  {QStringLiteral("protocol_version"),
+                                   UdpMessage::localVersion().toString()}};
+        QJsonArray steps;
+        const auto stepObject = [](const QByteArray &name, QList<qint64> samples) {
+            return QJsonObject{{QStringLiteral("name"), QString::fromLatin1(name)},
+                               {QStringLiteral("samples"), samples.size()},
+                               {QStringLiteral("p50_ns"), percentile(samples, 50)},
+                               {QStringLiteral("p99_ns"), percentile(samples, 99)}};
+        };
+        for (auto it = m_stepSamples.cbegin(); it != m_stepSamples.cend(); ++it)
+            steps.append(stepObject(it.key(), it.value()));
+        return QJsonDocument{
+            QJsonObject{{QStringLiteral("context"), context},
+                        {QStringLiteral("steps"), steps},
+                        {QStringLiteral("total"), stepObject("total", m_totalSamples)},
+                        {QStringLiteral("failures"), m_failures}}};
+    }
+
+private:
+    std::unique_ptr<ConnectionHandler> createHandler(const End &local,
+                                                     const End &remote,
+                                                     QMap<QByteArray, QList<qint64>> &stepSamples)
+    {
+        auto handler = std::make_unique<ConnectionHandler>();
+        handler->localIpAddress(local.address);
+        handler->localPort(local.port);
+        handler->localPassword(local.password);
+        handler->remoteIpAddress(remote.address.toString());
+        handler->remotePort(remote.port);
+        handler->remotePassword(remote.password);
+        // Steps of both ends are counted, each sees its own share of the latency.
+        QObject::connect(handler.get(),
+                         &ConnectionHandler::stepDurationMeasured,
+                         handler.get(),
+                         [&stepSamples](const QByteArray &step, std::chrono::nanoseconds duration) {
+                             stepSamples[step].append(duration.count());
+                         });
+        return handler;
+    }
+
+    // Nearest rank
+    static qint64 percentile(QList<qint64> samples, int percent)
+    {
+        if (samples.isEmpty())
+            return 0;
+        std::sort(samples.begin(), samples.end());
+        const qsizetype rank = (samples.size() * percent + 99) / 100;
+        return samples.at(qMax<qsizetype>(rank, 1) - 1);
+    }
+
+    static QString milliseconds(qint64 nanoseconds)
+    {
+        return QString::number(static_cast<double>(nanoseconds) / 1.0e6, 'f', 3);
+    }
+
+    End m_first;
+    End m_second;
+    std::chrono::milliseconds m_timeout;
+    QMap<QByteArray, QList<qint64>> m_stepSamples;
+    QList<qint64> m_totalSamples;
+    int m_failures{0};
+};
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        QStringLiteral("Connects two dtls_pair_chat ends on loopback addresses again and again "
+                       "and reports the setup latency of every step."));
+    parser.addHelpOption();
+    const QCommandLineOption iterationsOption{{QStringLiteral("n"), QStringLiteral("iterations")},
+                                              QStringLiteral("Number of connection setups."),
+                                              QStringLiteral("count"),
+                                              QStringLiteral("1000")};
+    const QCommandLineOption firstOption{QStringLiteral("first"),
+                                         QStringLiteral("Address of the first end."),
+                                         QStringLiteral("address"),
+                                         QStringLiteral("127.0.0.1")};
+    const QCommandLineOption secondOption{QStringLiteral("second"),
+                                          QStringLiteral("Address of the second end."),
+                                          QStringLiteral("address"),
+                                          QStringLiteral("127.0.0.2")};
+    const QCommandLineOption timeoutOption{QStringLiteral("timeout"),
+                                           QStringLiteral("Time allowed for one setup."),
+                                           QStringLiteral("ms"),
+                                           QStringLiteral("10000")};
+    const QCommandLineOption outputOption{{QStringLiteral("o"), QStringLiteral("output")},
+                                          QStringLiteral("Write JSON results to <file>."),
+                                          QStringLiteral("file")};
+    parser.addOptions({iterationsOption, firstOption, secondOption, timeoutOption, outputOption});
+    parser.process(app);
+
+    const QHostAddress firstAddress{parser.value(firstOption)};
+    const QHostAddress secondAddress{parser.value(secondOption)};
+    if (firstAddress.isNull() || secondAddress.isNull()) {
+        qCritical() << "Invalid address";
+        return 2;
+    }
+    // Ports differ, so the ends can also share one address where only 127.0.0.1 exists.
+    constexpr quint16 firstPort{UdpConnection::s_chatPort};
+    constexpr quint16 secondPort{UdpConnection::s_chatPort + 1};
+    LoopbackHarness harness{{firstAddress, firstPort, QStringLiteral("first")},
+                            {secondAddress, secondPort, QStringLiteral("second")},
+                            std::chrono::milliseconds{parser.value(timeoutOption).toLongLong()}};
+    const int iterations = parser.value(iterationsOption).toInt();
+    for (int i = 0; i < iterations; ++i)
+        harness.connectOnce();
+
+    QTextStream out{stdout};
+    harness.printSummary(out);
+    if (parser.isSet(outputOption)) {
+        QFile output{parser.value(outputOption)};
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qCritical() << "Cannot write" << output.fileName();
+            return 1;
+        }
+        output.write(harness.toJson().toJson(QJsonDocument::Indented));
+    }
+    return harness.failures() == 0 ? 0 : 1;
+}
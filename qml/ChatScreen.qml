@@ -1,5 +1,6 @@
 import QtQuick
 import QtQuick.Controls
+import QtQuick.Dialogs
 import dtls_pair_chat 1.0 as DTLSPC
 
 Pane {
@@ -11,12 +12,138 @@ Pane {
         text: qsTr("Disconnect")
         onClicked: _mainWindow.chatExited()
     }
+    Button {
+        id: _sendFileButton
+        anchors.right: _disconnectButton.left
+        anchors.top: parent.top
+        anchors.margins: 8
+        text: {
+            if (DTLSPC.ConnectionSettings.fileOfferPending)
+                return qsTr("Reject")
+            return DTLSPC.ConnectionSettings.fileTransferActive ? qsTr("Cancel transfer")
+                                                               : qsTr("Send file...")
+        }
+        onClicked: {
+            if (DTLSPC.ConnectionSettings.fileTransferActive)
+                DTLSPC.ConnectionSettings.cancelFileTransfer()
+            else
+                _fileDialog.open()
+        }
+    }
+    // Nothing is written to the download directory before the offer is accepted.
+    Button {
+        id: _acceptFileButton
+        anchors.right: _sendFileButton.left
+        anchors.top: parent.top
+        anchors.margins: 8
+        visible: DTLSPC.ConnectionSettings.fileOfferPending
+        text: qsTr("Accept")
+        onClicked: DTLSPC.ConnectionSettings.acceptFileOffer()
+    }
+    FileDialog {
+        id: _fileDialog
+        title: qsTr("Select file to send")
+        onAccepted: DTLSPC.ConnectionSettings.sendFile(selectedFile)
+    }
+    TextField {
+        id: _searchField
+        anchors.left: parent.left
+        anchors.verticalCenter: _disconnectButton.verticalCenter
+        anchors.leftMargin: 8
+        width: 200
+        placeholderText: qsTr("Search history")
+        property int requestId: -1
+        // Search is answered from a worker thread, only the latest request is shown.
+        onTextChanged: {
+            if (text.length > 0) {
+                requestId = DTLSPC.ConnectionSettings.chatModel.search(text)
+            } else {
+                requestId = -1
+                _searchResults.model = []
+                _searchPopup.close()
+            }
+        }
+        Connections {
+            target: DTLSPC.ConnectionSettings.chatModel
+            function onSearchFinished(requestId, matches, complete) {
+                if (requestId !== _searchField.requestId)
+                    return
+                _searchResults.model = matches
+                _searchResults.complete = complete
+                _searchPopup.open()
+            }
+        }
+    }
+    Popup {
+        id: _searchPopup
+        x: _searchField.x
+        y: _searchField.y + _searchField.height
+        width: parent.width - 2 * x
+        height: Math.min(_searchResults.contentHeight + topPadding + bottomPadding,
+                         parent.height / 2)
+        ListView {
+            id: _searchResults
+            anchors.fill: parent
+            clip: true
+            property bool complete: true
+            // Older history is indexed in the background, until then matches may be missing.
+            header: Label {
+                visible: !_searchResults.complete
+                height: visible ? implicitHeight + 8 : 0
+                text: qsTr("Still indexing older messages, results may be incomplete")
+                font.italic: true
+            }
+            delegate: ItemDelegate {
+                width: _searchResults.width
+                contentItem: Label {
+                    text: (modelData.incoming ? qsTr("<b>They:</b> ") : qsTr("<b>You:</b> "))
+                          + modelData.text
+                    wrapMode: Text.WordWrap
+                }
+                onClicked: {
+                    if (DTLSPC.ConnectionSettings.chatModel.loadRow(modelData.row))
+                        _chatList.positionViewAtIndex(modelData.row, ListView.Center)
+                    _searchPopup.close()
+                }
+            }
+        }
+    }
+    Label {
+        id: _transferLabel
+        anchors.left: _searchField.right
+        anchors.right: _acceptFileButton.visible ? _acceptFileButton.left : _sendFileButton.left
+        anchors.verticalCenter: _disconnectButton.verticalCenter
+        anchors.margins: 8
+        elide: Text.ElideMiddle
+        text: {
+            if (DTLSPC.ConnectionSettings.reconnecting)
+                return DTLSPC.ConnectionSettings.progressState
+            if (DTLSPC.ConnectionSettings.fileTransferState !== "")
+                return DTLSPC.ConnectionSettings.fileTransferState
+            if (DTLSPC.ConnectionSettings.roundTripTime < 0)
+                return ""
+            return qsTr("Round trip %1 ms, jitter %2 ms, %3 % lost")
+                .arg(DTLSPC.ConnectionSettings.roundTripTime)
+                .arg(DTLSPC.ConnectionSettings.jitter)
+                .arg(Math.round(DTLSPC.ConnectionSettings.lossRate * 100))
+        }
+    }
+    ProgressBar {
+        id: _transferProgress
+        anchors.left: parent.left
+        anchors.right: parent.right
+        anchors.top: _disconnectButton.bottom
+        anchors.margins: 8
+        visible: DTLSPC.ConnectionSettings.fileTransferActive
+                 && !DTLSPC.ConnectionSettings.fileOfferPending
+        value: DTLSPC.ConnectionSettings.fileTransferProgress
+    }
 
     ListView {
         id: _chatList
         anchors.left: parent.left
         anchors.right: _scrollBar.left
-        anchors.top: _disconnectButton.bottom
+        anchors.top: _transferProgress.visible ? _transferProgress.bottom : _disconnectButton.bottom
         anchors.bottom: _editBox.top
         anchors.margins: 8
         verticalLayoutDirection: ListView.BottomToTop
@@ -58,8 +185,11 @@ Pane {
         anchors.margins: 8
         text: qsTr("Send")
         onClicked: {
-            DTLSPC.ConnectionSettings.chatModel.sendMessage(_editor.text)
-            _editor.clear()
+            // Too long a message stays in the editor to be shortened.
+            if (DTLSPC.ConnectionSettings.chatModel.sendMessage(_editor.text))
+                _editor.clear()
+            else
+                ToolTip.show(qsTr("Message is too long to send"), 3000)
         }
     }
 }
@@ -57,6 +57,10 @@ Window {
                 targetState: _stateLogin
                 signal: _mainWindow.chatExited
             }
+            DSM.SignalTransition {
+                targetState: _stateFailDialog
+                signal: DTLSPC.ConnectionSettings.connectionFailed
+            }
         }
     }
 
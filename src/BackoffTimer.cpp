@@ -0,0 +1,37 @@
+#include <BackoffTimer.h>
+
+using namespace dtls_pair_chat;
+
+BackoffTimer::BackoffTimer(std::chrono::milliseconds initialInterval,
+                           std::chrono::milliseconds maximumInterval)
+    : QObject{nullptr}
+    , m_initialInterval{initialInterval}
+    , m_maximumInterval{maximumInterval}
+    , m_currentInterval{initialInterval}
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &BackoffTimer::expired);
+}
+
+void BackoffTimer::start()
+{
+    m_currentInterval = m_initialInterval;
+    m_timer.start(m_currentInterval);
+}
+
+void BackoffTimer::stop()
+{
+    m_timer.stop();
+}
+
+bool BackoffTimer::isActive() const
+{
+    return m_timer.isActive();
+}
+
+void BackoffTimer::expired()
+{
+    m_currentInterval = qMin(m_currentInterval * 2, m_maximumInterval);
+    m_timer.start(m_currentInterval);
+    emit timeout();
+}
@@ -0,0 +1,206 @@
+#include <ChatHistory.h>
+
+#include <QDebug>
+#include <QDir>
+#include <QtEndian>
+
+using namespace dtls_pair_chat;
+
+/* Index entry, all integers are big endian:
+ * offset 0: segment number as quint32
+ * offset 4: offset of the record in the segment as quint32
+ *
+ * Segment record, all integers are big endian:
+ * offset 0: text size as quint32
+ * offset 4: timestamp as qint64, milliseconds since epoch
+ * offset 12: direction as quint8
+ * offset 13: UTF-8 text
+ */
+
+ChatHistory::ChatHistory(const QString &directory, Mode mode)
+    : m_directory{directory}
+    , m_mode{mode}
+    , m_index{QDir{directory}.filePath(QStringLiteral("index"))}
+{
+    if (m_mode == Mode::ReadOnly) {
+        m_valid = m_index.open(QIODevice::ReadOnly);
+        if (!m_valid)
+            qWarning() << "Opening" << m_index.fileName() << "failed:" << m_index.errorString();
+        refresh();
+        return;
+    }
+    if (!QDir{}.mkpath(m_directory)) {
+        qWarning() << "Creating history directory" << m_directory << "failed";
+        return;
+    }
+    if (!m_index.open(QIODevice::ReadWrite)) {
+        qWarning() << "Opening" << m_index.fileName() << "failed:" << m_index.errorString();
+        return;
+    }
+    // An interrupted append may have left a partial entry behind, it is dropped.
+    const qint64 indexSize = m_index.size();
+    if (indexSize % s_indexEntrySize != 0)
+        m_index.resize(indexSize - indexSize % s_indexEntrySize);
+    m_count = static_cast<quint64>(m_index.size() / s_indexEntrySize);
+    if (m_count > 0) {
+        const auto last = location(m_count - 1);
+        if (last.has_value())
+            m_segmentNumber = last->segment;
+    }
+    m_valid = openSegmentForAppend(m_segmentNumber);
+}
+
+ChatHistory::~ChatHistory()
+{
+    if (m_mappedIndex)
+        m_index.unmap(m_mappedIndex);
+}
+
+bool ChatHistory::isValid() const
+{
+    return m_valid;
+}
+
+QString ChatHistory::directory() const
+{
+    return m_directory;
+}
+
+quint64 ChatHistory::count() const
+{
+    return m_count;
+}
+
+void ChatHistory::refresh()
+{
+    // Writer completes an entry before starting the next one, a partial one is not counted.
+    if (m_mode == Mode::ReadOnly && m_valid)
+        m_count = static_cast<quint64>(m_index.size() / s_indexEntrySize);
+}
+
+bool ChatHistory::append(const ChatRecord &record)
+{
+    return append(QList<ChatRecord>{record});
+}
+
+bool ChatHistory::append(const QList<ChatRecord> &records)
+{
+    if (!m_valid || m_mode == Mode::ReadOnly)
+        return false;
+    // Records go first, the index entries make them visible.
+    QByteArray indexEntries;
+    indexEntries.reserve(records.size() * s_indexEntrySize);
+    for (const auto &record : records) {
+        if (!writeRecord(record, indexEntries))
+            return false;
+    }
+    if (!m_segment.flush()) {
+        qWarning() << "Writing" << m_segment.fileName() << "failed:" << m_segment.errorString();
+        return false;
+    }
+    if (!m_index.seek(static_cast<qint64>(m_count) * s_indexEntrySize)
+        || m_index.write(indexEntries) != indexEntries.size() || !m_index.flush()) {
+        qWarning() << "Writing" << m_index.fileName() << "failed:" << m_index.errorString();
+        return false;
+    }
+    m_count += static_cast<quint64>(records.size());
+    return true;
+}
+
+std::optional<ChatRecord> ChatHistory::read(quint64 id) const
+{
+    const auto recordLocation = location(id);
+    if (!recordLocation.has_value())
+        return std::nullopt;
+    if (m_readerSegment != recordLocation->segment) {
+        m_reader.close();
+        m_reader.setFileName(segmentFileName(recordLocation->segment));
+        m_readerSegment.reset();
+        if (!m_reader.open(QIODevice::ReadOnly)) {
+            qWarning() << "Opening" << m_reader.fileName() << "failed:" << m_reader.errorString();
+            return std::nullopt;
+        }
+        m_readerSegment = recordLocation->segment;
+    }
+    uchar header[s_recordHeaderSize];
+    if (!m_reader.seek(recordLocation->offset)
+        || m_reader.read(reinterpret_cast<char *>(header), s_recordHeaderSize)
+               != s_recordHeaderSize) {
+        return std::nullopt;
+    }
+    ChatRecord record;
+    const quint32 textSize = qFromBigEndian<quint32>(header);
+    record.timestamp = qFromBigEndian<qint64>(header + 4);
+    record.direction = header[12] == static_cast<uchar>(ChatRecord::Direction::Outgoing)
+                           ? ChatRecord::Direction::Outgoing
+                           : ChatRecord::Direction::Incoming;
+    record.text = m_reader.read(textSize);
+    if (record.text.size() != static_cast<qsizetype>(textSize))
+        return std::nullopt;
+    return record;
+}
+
+bool ChatHistory::writeRecord(const ChatRecord &record, QByteArray &indexEntries)
+{
+    const qint64 recordSize = s_recordHeaderSize + record.text.size();
+    if (m_segmentSize > 0 && m_segmentSize + recordSize > s_maxSegmentSize) {
+        // Segment is complete, later index entries point to the next one.
+        if (!m_segment.flush() || !openSegmentForAppend(m_segmentNumber + 1))
+            return false;
+    }
+    uchar header[s_recordHeaderSize];
+    qToBigEndian<quint32>(static_cast<quint32>(record.text.size()), header);
+    qToBigEndian<qint64>(record.timestamp, header + 4);
+    header[12] = static_cast<uchar>(record.direction);
+    const qint64 offset = m_segmentSize;
+    if (m_segment.write(reinterpret_cast<const char *>(header), s_recordHeaderSize)
+            != s_recordHeaderSize
+        || m_segment.write(record.text) != record.text.size()) {
+        qWarning() << "Writing" << m_segment.fileName() << "failed:" << m_segment.errorString();
+        return false;
+    }
+    m_segmentSize += recordSize;
+    uchar entry[s_indexEntrySize];
+    qToBigEndian<quint32>(m_segmentNumber, entry);
+    qToBigEndian<quint32>(static_cast<quint32>(offset), entry + 4);
+    indexEntries.append(reinterpret_cast<const char *>(entry), s_indexEntrySize);
+    return true;
+}
+
+std::optional<ChatHistory::Location> ChatHistory::location(quint64 id) const
+{
+    if (id >= m_count)
+        return std::nullopt;
+    if (id >= m_mappedEntries) {
+        // Index has grown since it was mapped.
+        if (m_mappedIndex)
+            m_index.unmap(m_mappedIndex);
+        m_mappedIndex = m_index.map(0, static_cast<qint64>(m_count) * s_indexEntrySize);
+        m_mappedEntries = m_mappedIndex ? m_count : 0;
+        if (!m_mappedIndex) {
+            qWarning() << "Mapping" << m_index.fileName() << "failed:" << m_index.errorString();
+            return std::nullopt;
+        }
+    }
+    const uchar *entry = m_mappedIndex + id * s_indexEntrySize;
+    return Location{qFromBigEndian<quint32>(entry), qFromBigEndian<quint32>(entry + 4)};
+}
+
+bool ChatHistory::openSegmentForAppend(quint32 segment)
+{
+    m_segment.close();
+    m_segment.setFileName(segmentFileName(segment));
+    if (!m_segment.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Opening" << m_segment.fileName() << "failed:" << m_segment.errorString();
+        return false;
+    }
+    m_segmentNumber = segment;
+    m_segmentSize = m_segment.size();
+    return true;
+}
+
+QString ChatHistory::segmentFileName(quint32 segment) const
+{
+    return QDir{m_directory}.filePath(
+        QStringLiteral("%1.segment").arg(segment, 8, 10, QLatin1Char{'0'}));
+}
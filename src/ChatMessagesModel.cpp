@@ -1,76 +1,289 @@
 #include <ChatMessagesModel.h>
 #include <UdpConnection.h>
 
+#include <QDateTime>
+#include <QDebug>
+
 using namespace dtls_pair_chat;
 
 ChatMessagesModel::ChatMessagesModel()
     : QAbstractListModel{nullptr}
-{}
+    , m_searchIndex{new SearchIndex}
+{
+    m_searchThread.setObjectName(QStringLiteral("SearchIndex"));
+    m_searchIndex->moveToThread(&m_searchThread);
+    connect(&m_searchThread, &QThread::finished, m_searchIndex, &QObject::deleteLater);
+    connect(m_searchIndex,
+            &SearchIndex::searchFinished,
+            this,
+            &ChatMessagesModel::searchIndexFinished);
+    m_searchThread.start(QThread::LowPriority);
+    m_frameTimer.setSingleShot(true);
+    m_frameTimer.setTimerType(Qt::PreciseTimer);
+    m_frameTimer.setInterval(s_frameInterval);
+    connect(&m_frameTimer, &QTimer::timeout, this, &ChatMessagesModel::takeQueuedMessages);
+}
+
+ChatMessagesModel::~ChatMessagesModel()
+{
+    m_searchThread.quit();
+    m_searchThread.wait();
+}
 
 int ChatMessagesModel::rowCount(const QModelIndex &parent) const
 {
-    return m_messages.size();
+    return m_rowCount;
 }
 
 QVariant ChatMessagesModel::data(const QModelIndex &index, int role) const
 {
-    if (role == static_cast<int>(Role::MsgText))
-        return m_messages.at(index.row());
-    else
+    if (!index.isValid() || index.row() >= m_rowCount)
+        return QVariant{};
+    switch (static_cast<Role>(role)) {
+    case Role::MsgText:
+        return formatted(recordAt(index.row()));
+    case Role::Timestamp:
+        return QDateTime::fromMSecsSinceEpoch(recordAt(index.row()).timestamp);
+    case Role::Incoming:
+        return recordAt(index.row()).direction == Direction::Incoming;
+    default:
         return QVariant{};
+    }
 }
 
 QHash<int, QByteArray> ChatMessagesModel::roleNames() const
 {
     QHash<int, QByteArray> returnValue;
     returnValue.insert(static_cast<int>(Role::MsgText), "msgText");
+    returnValue.insert(static_cast<int>(Role::Timestamp), "msgTimestamp");
+    returnValue.insert(static_cast<int>(Role::Incoming), "msgIncoming");
     return returnValue;
 }
 
+bool ChatMessagesModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && m_history && static_cast<quint64>(m_rowCount) < m_history->count();
+}
+
+void ChatMessagesModel::fetchMore(const QModelIndex &parent)
+{
+    if (!canFetchMore(parent))
+        return;
+    // Older messages are the last rows. Records are read only when the view asks for them.
+    const int rows = static_cast<int>(
+        qMin<quint64>(s_pageSize, m_history->count() - static_cast<quint64>(m_rowCount)));
+    beginInsertRows(QModelIndex{}, m_rowCount, m_rowCount + rows - 1);
+    m_rowCount += rows;
+    endInsertRows();
+}
+
 void ChatMessagesModel::setUdpConnection(std::shared_ptr<UdpConnection> udpConnection)
 {
     beginResetModel();
     if (m_udpConnection.get()) {
+        m_udpConnection->setChatQueueEnabled(false);
         disconnect(m_udpConnection.get(),
-                   &UdpConnection::messageReceived,
-                   this,
-                   &ChatMessagesModel::messageReceived);
+                   &UdpConnection::chatMessagesQueued,
+                   &m_frameTimer,
+                   qOverload<>(&QTimer::start));
     }
+    m_frameTimer.stop();
     m_udpConnection = udpConnection;
     if (udpConnection.get()) {
+        // Messages arriving within a frame are inserted together.
         connect(udpConnection.get(),
-                &UdpConnection::messageReceived,
-                this,
-                &ChatMessagesModel::messageReceived);
+                &UdpConnection::chatMessagesQueued,
+                &m_frameTimer,
+                qOverload<>(&QTimer::start));
+        udpConnection->setChatQueueEnabled(true);
     }
     endResetModel();
 }
 
-void ChatMessagesModel::sendMessage(const QString &message)
+void ChatMessagesModel::setHistory(std::unique_ptr<ChatHistory> history)
+{
+    beginResetModel();
+    m_history = history && history->isValid() ? std::move(history) : nullptr;
+    m_messages.clear();
+    m_pages.clear();
+    m_pageOrder.clear();
+    // Only the newest page is shown at first, however long the history is.
+    m_rowCount = m_history ? static_cast<int>(qMin<quint64>(s_pageSize, m_history->count())) : 0;
+    endResetModel();
+    if (m_history)
+        m_searchIndex->open(m_history->directory());
+    else
+        m_searchIndex->close();
+}
+
+bool ChatMessagesModel::sendMessage(const QString &message)
 {
-    insertNewMessage(message, Direction::Outgoing);
+    QByteArray text = message.toUtf8();
+    // Checked before it is stored, the remote could never reassemble it.
+    if (text.size() > UdpMessage::maxChatTextSize()) {
+        qWarning() << "Message of" << text.size() << "bytes is too long to send";
+        return false;
+    }
+    insertNewMessages(
+        {ChatRecord{std::move(text), QDateTime::currentMSecsSinceEpoch(), Direction::Outgoing}});
     m_udpConnection->sendMessageToRemote(UdpMessage{message});
+    return true;
+}
+
+int ChatMessagesModel::search(const QString &query)
+{
+    return static_cast<int>(m_searchIndex->search(query));
+}
+
+bool ChatMessagesModel::loadRow(int row)
+{
+    while (row >= m_rowCount && canFetchMore(QModelIndex{}))
+        fetchMore(QModelIndex{});
+    return row >= 0 && row < m_rowCount;
 }
 
-void ChatMessagesModel::messageReceived(const UdpMessage &message)
+void ChatMessagesModel::appendReceivedMessages(const QList<UdpMessage> &messages)
 {
-    if (message.type() == UdpMessage::Type::Chat) {
-        insertNewMessage(message.chatMsg(), Direction::Incoming);
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<ChatRecord> records;
+    for (const auto &message : messages) {
+        if (message.type() != UdpMessage::Type::Chat)
+            continue;
+        records.append(
+            ChatRecord{message.chatText().toString().toUtf8(), now, Direction::Incoming});
     }
+    if (!records.isEmpty())
+        insertNewMessages(std::move(records));
 }
 
-void ChatMessagesModel::insertNewMessage(QStringView message, Direction direction)
+void ChatMessagesModel::takeQueuedMessages()
+{
+    if (m_udpConnection.get())
+        appendReceivedMessages(m_udpConnection->takeChatMessages());
+}
+
+void ChatMessagesModel::searchIndexFinished(quint64 requestId,
+                                            const QList<SearchIndex::Match> &matches,
+                                            bool complete)
+{
+    QVariantList results;
+    results.reserve(matches.size());
+    for (const auto &match : matches) {
+        // History may have been switched while the search ran.
+        if (!m_history || match.id >= m_history->count())
+            continue;
+        // Row 0 is the newest message.
+        const auto row = static_cast<int>(m_history->count() - 1 - match.id);
+        results.append(QVariantMap{{QStringLiteral("row"), row},
+                                   {QStringLiteral("text"), match.text},
+                                   {QStringLiteral("timestamp"),
+                                    QDateTime::fromMSecsSinceEpoch(match.timestamp)},
+                                   {QStringLiteral("incoming"), match.incoming}});
+    }
+    emit searchFinished(static_cast<int>(requestId), results, complete);
+}
+
+int ChatMessagesModel::maximumMessages() const
+{
+    return static_cast<int>(m_messages.capacity());
+}
+
+void ChatMessagesModel::setMaximumMessages(int maximum)
+{
+    maximum = qMax(maximum, 1);
+    if (maximum == m_messages.capacity())
+        return;
+    if (!m_history && maximum < m_messages.size()) {
+        // Oldest messages are the last rows.
+        beginRemoveRows(QModelIndex{}, maximum, static_cast<int>(m_messages.size()) - 1);
+        m_messages.setCapacity(maximum);
+        m_rowCount = maximum;
+        endRemoveRows();
+    } else {
+        m_messages.setCapacity(maximum);
+    }
+    emit maximumMessagesChanged();
+}
+
+void ChatMessagesModel::insertNewMessages(QList<ChatRecord> records)
+{
+    if (m_history && !m_history->append(records)) {
+        qWarning() << "Chat history can not be written, continuing without it";
+        setHistory(nullptr);
+    }
+    if (m_history) {
+        m_searchIndex->historyAppended();
+        // Messages stay in the history, only their copies in memory are dropped when full.
+        beginInsertRows(QModelIndex{}, 0, static_cast<int>(records.size()) - 1);
+        for (auto &record : records)
+            m_messages.append(std::move(record));
+        m_rowCount += static_cast<int>(records.size());
+        endInsertRows();
+        return;
+    }
+    // Without a history only the newest messages that fit are kept.
+    if (records.size() > m_messages.capacity())
+        records.remove(0, records.size() - m_messages.capacity());
+    const qsizetype evicted = m_messages.size() + records.size() - m_messages.capacity();
+    if (evicted > 0) {
+        // Oldest messages are the last rows, they make room for the new ones.
+        const int lastRow = static_cast<int>(m_messages.size()) - 1;
+        beginRemoveRows(QModelIndex{}, lastRow - static_cast<int>(evicted) + 1, lastRow);
+        m_messages.removeOldest(evicted);
+        m_rowCount -= static_cast<int>(evicted);
+        endRemoveRows();
+    }
+    beginInsertRows(QModelIndex{}, 0, static_cast<int>(records.size()) - 1);
+    for (auto &record : records)
+        m_messages.append(std::move(record));
+    m_rowCount += static_cast<int>(records.size());
+    endInsertRows();
+}
+
+const ChatRecord &ChatMessagesModel::recordAt(int row) const
+{
+    // Row 0 is the newest message, the last one in the buffer.
+    if (!m_history)
+        return m_messages.at(m_messages.size() - 1 - row);
+    const quint64 id = m_history->count() - 1 - static_cast<quint64>(row);
+    const quint64 firstInMemory = m_history->count() - static_cast<quint64>(m_messages.size());
+    if (id >= firstInMemory)
+        return m_messages.at(static_cast<qsizetype>(id - firstInMemory));
+    return storedRecord(id);
+}
+
+const ChatRecord &ChatMessagesModel::storedRecord(quint64 id) const
+{
+    const quint64 page = id / s_pageSize;
+    const quint64 first = page * s_pageSize;
+    auto it = m_pages.find(page);
+    // Newest page may have been read before it was full.
+    if (it == m_pages.end() || id - first >= static_cast<quint64>(it->size())) {
+        if (it == m_pages.end()) {
+            if (m_pageOrder.size() >= s_cachedPages)
+                m_pages.remove(m_pageOrder.takeFirst());
+            m_pageOrder.append(page);
+        }
+        QList<ChatRecord> records;
+        const quint64 last = qMin(first + s_pageSize, m_history->count());
+        records.reserve(static_cast<qsizetype>(last - first));
+        for (quint64 i = first; i < last; ++i)
+            records.append(m_history->read(i).value_or(ChatRecord{}));
+        it = m_pages.insert(page, std::move(records));
+    }
+    return it->at(static_cast<qsizetype>(id - first));
+}
+
+QString ChatMessagesModel::formatted(const ChatRecord &record)
 {
     /* We use HTML formatting so escape all HTML tags. */
-    QString formattedMessage{message.toString().toHtmlEscaped()};
+    QString formattedMessage{QString::fromUtf8(record.text).toHtmlEscaped()};
     /* replace line breaks with their counterparts. */
     formattedMessage.replace(QStringLiteral("\n"), QStringLiteral("<br/>"));
     /* Add prefix. */
-    if (direction == Direction::Incoming)
+    if (record.direction == Direction::Incoming)
         formattedMessage.prepend(tr("<b>They:</b> "));
     else
         formattedMessage.prepend(tr("<b>You:</b> "));
-    beginInsertRows(QModelIndex{}, 0, 0);
-    m_messages.prepend(formattedMessage);
-    endInsertRows();
+    return formattedMessage;
 }
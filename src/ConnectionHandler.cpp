@@ -1,6 +1,9 @@
 #include <ConnectionHandler.h>
+#include <Metrics.h>
 #include <UdpMessage.h>
 
+#include <QtMath>
+
 using namespace dtls_pair_chat;
 
 ConnectionHandler::ConnectionHandler()
@@ -9,6 +12,7 @@ ConnectionHandler::ConnectionHandler()
     m_timeoutTimer.setTimerType(Qt::TimerType::VeryCoarseTimer);
     m_timeoutTimer.setInterval(std::chrono::seconds{1});
     connect(&m_timeoutTimer, &QTimer::timeout, this, &ConnectionHandler::timeoutTick);
+    connect(&m_reconnectTimer, &BackoffTimer::timeout, this, &ConnectionHandler::retryReconnect);
 }
 
 QString ConnectionHandler::localPassword()
@@ -16,6 +20,11 @@ QString ConnectionHandler::localPassword()
     return m_localPassword;
 }
 
+quint16 ConnectionHandler::localPort() const
+{
+    return m_localPort;
+}
+
 QString ConnectionHandler::remoteIpAddress()
 {
     if (m_remoteIp.isNull())
@@ -29,6 +38,11 @@ QString ConnectionHandler::remotePassword()
     return m_remotePassword;
 }
 
+quint16 ConnectionHandler::remotePort() const
+{
+    return m_remotePort;
+}
+
 void ConnectionHandler::localIpAddress(const QHostAddress &address)
 {
     m_localIp = address;
@@ -39,6 +53,11 @@ void ConnectionHandler::localPassword(QStringView password)
     m_localPassword = password.toString();
 }
 
+void ConnectionHandler::localPort(quint16 port)
+{
+    m_localPort = port;
+}
+
 void ConnectionHandler::remoteIpAddress(QStringView address)
 {
     m_remoteIp.setAddress(address.toString());
@@ -51,6 +70,11 @@ void ConnectionHandler::remotePassword(QStringView password)
     m_remotePassword = password.toString();
 }
 
+void ConnectionHandler::remotePort(quint16 port)
+{
+    m_remotePort = port;
+}
+
 void ConnectionHandler::connectToRemote()
 {
     m_state = State::Connecting;
@@ -58,7 +82,7 @@ void ConnectionHandler::connectToRemote()
     emit stateChanged();
     m_errorDescription.clear();
     emit errorDescriptionChanged();
-    m_udpConnection = std::make_shared<UdpConnection>(m_localIp, m_remoteIp);
+    m_udpConnection = UdpConnection::create(m_localIp, m_remoteIp, m_remotePort, m_localPort);
     m_handshaker = std::make_unique<Handshake>(m_udpConnection);
     connect(m_handshaker.get(),
             &Handshake::complete,
@@ -68,10 +92,21 @@ void ConnectionHandler::connectToRemote()
             &Handshake::versionNumberFromRemote,
             this,
             &ConnectionHandler::remoteVersionReceived);
+    /* PBKDF2 runs while the initial handshake does, and is kept for reconnects and further
+     * attempts with the same passwords. Only the HKDF step is left for after it. */
+    const std::pair passwords{m_localPassword, m_remotePassword};
+    if (m_passwordKeyPasswords != passwords) {
+        m_passwordKeyPasswords = passwords;
+        m_localFirstPasswordKey = PasswordVerifier::derivePasswordKey(m_localPassword,
+                                                                      m_remotePassword);
+        m_remoteFirstPasswordKey = PasswordVerifier::derivePasswordKey(m_remotePassword,
+                                                                       m_localPassword);
+    }
     m_remainingSeconds = s_defaultTimeout;
     m_percentComplete = 0;
     emit progressUpdated();
     m_timeoutTimer.start();
+    m_stepTimer.start();
     m_handshaker->start();
 }
 
@@ -81,9 +116,15 @@ void ConnectionHandler::abortConnection(AbortReason reason)
     m_handshaker.reset();
     m_passwordVerifier.reset();
     m_timeoutTimer.stop();
+    m_reconnectTimer.stop();
+    const bool reconnecting{m_state == State::Reconnecting};
     m_state = State::Failed; // by default aborting means a failure.
     switch (reason) {
     case AbortReason::Timeout:
+        if (reconnecting) {
+            m_errorDescription = tr("Reconnecting to other party timed out.");
+            break;
+        }
         switch (m_step) {
         case Step::SenderReceiverHandshake:
             m_errorDescription = tr("Waiting other party timed out.");
@@ -113,6 +154,9 @@ void ConnectionHandler::abortConnection(AbortReason reason)
     case AbortReason::PasswordMismatch:
         m_errorDescription = tr("Password did not match in this or remote end.");
         break;
+    case AbortReason::RemoteClosed:
+        m_errorDescription = tr("Other party closed the connection.");
+        break;
     default: // AbortReason::User
         m_errorDescription.clear();
         m_state = State::Idle;
@@ -120,9 +164,12 @@ void ConnectionHandler::abortConnection(AbortReason reason)
     }
     m_step = Step::WaitingLoginData;
     m_secureChannelError = QDtlsError::NoError;
-    // Also remove udpConnection as we will go back to data entry. Lose version info.
-    UdpMessage::resetSupportedVersion();
-    m_udpConnection.reset();
+    // Also remove udpConnection as we will go back to data entry. Version info goes with it.
+    if (m_udpConnection.get()) {
+        // Chat may still hold it for a moment, its signals are of no interest anymore.
+        disconnect(m_udpConnection.get(), nullptr, this, nullptr);
+        m_udpConnection.reset();
+    }
     // emit signals about changes
     emit stateChanged();
     emit progressUpdated();
@@ -154,6 +201,10 @@ QString ConnectionHandler::currentStep() const
     case Step::SenderReceiverHandshake:
         return tr("Waiting for other party (%n second(s) until timeout)...", "", m_remainingSeconds);
     case Step::OpeningSecureChannel:
+        if (m_state == State::Reconnecting)
+            return tr("Connection lost, reconnecting (%n second(s) until timeout)...",
+                      "",
+                      m_remainingSeconds);
         return tr("Opening secure channel (%n second(s) until timeout)...", "", m_remainingSeconds);
     case Step::ExchangingPasswords:
         return tr("Verifying passwords (%n second(s) until timeout)...", "", m_remainingSeconds);
@@ -176,31 +227,27 @@ std::shared_ptr<UdpConnection> ConnectionHandler::udpConnection() const
 void ConnectionHandler::remoteVersionReceived(const QVersionNumber &version)
 {
     const auto localVersion = UdpMessage::localVersion();
-    if (version.majorVersion() != localVersion.majorVersion())
+    if (version.majorVersion() != localVersion.majorVersion()) {
         abortConnection(AbortReason::VersionMismatch);
-    else if (version.minorVersion() < localVersion.minorVersion())
-        UdpMessage::setSupportedVersion(version);
-    else
-        UdpMessage::setSupportedVersion(UdpMessage::localVersion());
+    } else {
+        if (version.minorVersion() < localVersion.minorVersion())
+            m_udpConnection->setSupportedVersion(version);
+        else
+            m_udpConnection->setSupportedVersion(localVersion);
+    }
 }
 
 void ConnectionHandler::initialHandshakeDone(QUuid clientUuid, bool isServer)
 {
-    if (UdpMessage::supportedVersion().has_value()) {
-        // delete connection object. That will also close connection.
-        m_handshaker.reset();
+    if (m_udpConnection->supportedVersion().has_value()) {
+        stepCompleted();
+        /* Handshake object is kept until the secure channel is open, it answers remote
+         * retransmissions in case our last message was lost. */
         m_step = Step::OpeningSecureChannel;
         m_percentComplete = 34; // initial handshake reaches 33%
         m_remainingSeconds = s_defaultTimeout;
         emit progressUpdated();
 
-        /* Create password verifier already as password from remote could be
-     * sent immediately after secure mode is enabled.
-     * Then switch to secure connection.
-     */
-        m_passwordVerifier = std::make_unique<PasswordVerifier>(m_udpConnection,
-                                                                m_localPassword,
-                                                                m_remotePassword);
         connect(m_udpConnection.get(),
                 &UdpConnection::secureModeChanged,
                 this,
@@ -209,7 +256,33 @@ void ConnectionHandler::initialHandshakeDone(QUuid clientUuid, bool isServer)
                 &UdpConnection::dtlsError,
                 this,
                 &ConnectionHandler::secureChannelOpenError);
-        m_udpConnection->switchToSecureConnection(clientUuid, isServer);
+        if (!passwordsInHandshake()) {
+            /* Create password verifier already as password from remote could be
+             * sent immediately after secure mode is enabled.
+             * Then switch to secure connection.
+             */
+            m_passwordVerifier = std::make_unique<PasswordVerifier>(m_udpConnection,
+                                                                    m_localPassword,
+                                                                    m_remotePassword);
+            m_udpConnection->switchToSecureConnection(clientUuid, isServer);
+        } else {
+            // The password the server gave goes first on both ends.
+            QFuture<QByteArray> passwordKey = isServer ? m_localFirstPasswordKey
+                                                       : m_remoteFirstPasswordKey;
+            if (passwordKey.isFinished()) {
+                openPreSharedKeyChannel(passwordKey.result(), clientUuid, isServer);
+            } else {
+                // Handshake was quicker, nothing blocks until the key is ready.
+                const std::weak_ptr<UdpConnection> connection{m_udpConnection};
+                passwordKey.then(this,
+                                 [this, connection, clientUuid, isServer](QByteArray key) {
+                                     // Unless aborted meanwhile
+                                     const auto current = connection.lock();
+                                     if (current && current == m_udpConnection)
+                                         openPreSharedKeyChannel(key, clientUuid, isServer);
+                                 });
+            }
+        }
     } else {
         // if no supported version set, abort
         abortConnection(AbortReason::NoVersionFromRemote);
@@ -231,7 +304,15 @@ void ConnectionHandler::secureChannelOpened(bool isSecure)
                &UdpConnection::dtlsError,
                this,
                &ConnectionHandler::secureChannelOpenError);
+    // Remote has left the initial handshake behind, nothing to answer anymore.
+    m_handshaker.reset();
     if (isSecure) {
+        stepCompleted();
+        if (passwordsInHandshake()) {
+            // Same key on both ends, so the passwords match.
+            connectionEstablished();
+            return;
+        }
         m_step = Step::ExchangingPasswords;
         m_percentComplete = 67; // secure channel handshake reaches 67%
         m_remainingSeconds = s_defaultTimeout;
@@ -241,6 +322,9 @@ void ConnectionHandler::secureChannelOpened(bool isSecure)
                 &ConnectionHandler::passwordVerificationDone);
         m_passwordVerifier->start();
         emit progressUpdated();
+    } else if (passwordsInHandshake() && m_secureChannelError == QDtlsError::TlsFatalError) {
+        // Most likely the keys differ, the handshake fails when the Finished messages do.
+        abortConnection(AbortReason::PasswordMismatch);
     } else {
         abortConnection(AbortReason::SecureConnectFail);
     }
@@ -253,17 +337,43 @@ void ConnectionHandler::passwordVerificationDone(bool success)
                this,
                &ConnectionHandler::passwordVerificationDone);
     if (success) {
-        // All done, connected.
-        m_passwordVerifier.reset();
-        m_percentComplete = 100;
-        m_state = State::Connected;
-        emit progressUpdated();
-        emit stateChanged();
+        /* All done, connected. Verifier is kept as long as connected, remote may still
+         * be waiting for our ack and repeating its password. */
+        stepCompleted();
+        connectionEstablished();
     } else {
         abortConnection(AbortReason::PasswordMismatch);
     }
 }
 
+void ConnectionHandler::connectionEstablished()
+{
+    m_timeoutTimer.stop();
+    if (m_state == State::Connecting) {
+        // From now on a lost path is reconnected instead of going back to login.
+        connect(m_udpConnection.get(),
+                &UdpConnection::connectionLost,
+                this,
+                &ConnectionHandler::connectionLost);
+        connect(m_udpConnection.get(),
+                &UdpConnection::connectionRestored,
+                this,
+                &ConnectionHandler::connectionRestored);
+        connect(m_udpConnection.get(),
+                &UdpConnection::secureModeChanged,
+                this,
+                &ConnectionHandler::secureChannelReopened);
+        connect(m_udpConnection.get(),
+                &UdpConnection::dtlsError,
+                this,
+                &ConnectionHandler::connectedDtlsError);
+    }
+    m_percentComplete = 100;
+    m_state = State::Connected;
+    emit progressUpdated();
+    emit stateChanged();
+}
+
 void ConnectionHandler::timeoutTick()
 {
     m_remainingSeconds--;
@@ -281,6 +391,122 @@ void ConnectionHandler::timeoutTick()
     }
 }
 
+void ConnectionHandler::connectionLost()
+{
+    if (m_state != State::Connected)
+        return;
+    /* Setup restarts at the secure channel, the negotiated version and the roles of
+     * the initial handshake stay with the connection. */
+    m_state = State::Reconnecting;
+    m_step = Step::OpeningSecureChannel;
+    m_percentComplete = 34;
+    m_remainingSeconds = s_defaultTimeout;
+    m_secureChannelError = QDtlsError::NoError;
+    if (!passwordsInHandshake()) {
+        // Passwords are verified again for the new session, the remote may send its own first.
+        m_passwordVerifier = std::make_unique<PasswordVerifier>(m_udpConnection,
+                                                                m_localPassword,
+                                                                m_remotePassword);
+    }
+    m_udpConnection->resumeSecureConnection();
+    m_reconnectTimer.start();
+    m_timeoutTimer.start();
+    m_stepTimer.start();
+    emit stateChanged();
+    emit progressUpdated();
+}
+
+void ConnectionHandler::connectionRestored()
+{
+    // Path came back before a new handshake was started, the old session is still good.
+    if (m_state != State::Reconnecting || m_step != Step::OpeningSecureChannel)
+        return;
+    m_reconnectTimer.stop();
+    m_timeoutTimer.stop();
+    m_percentComplete = 100;
+    m_state = State::Connected;
+    emit progressUpdated();
+    emit stateChanged();
+}
+
+void ConnectionHandler::secureChannelReopened(bool isSecure)
+{
+    // A failed attempt is retried until the timeout.
+    if (m_state != State::Reconnecting || !isSecure)
+        return;
+    m_reconnectTimer.stop();
+    stepCompleted();
+    if (passwordsInHandshake()) {
+        connectionEstablished();
+        return;
+    }
+    m_step = Step::ExchangingPasswords;
+    m_percentComplete = 67;
+    m_remainingSeconds = s_defaultTimeout;
+    connect(m_passwordVerifier.get(),
+            &PasswordVerifier::complete,
+            this,
+            &ConnectionHandler::passwordVerificationDone);
+    m_passwordVerifier->start();
+    emit progressUpdated();
+}
+
+void ConnectionHandler::connectedDtlsError(QDtlsError error)
+{
+    if (error == QDtlsError::RemoteClosedConnectionError)
+        abortConnection(AbortReason::RemoteClosed);
+    else if (m_state == State::Reconnecting)
+        m_secureChannelError = error;
+}
+
+void ConnectionHandler::retryReconnect()
+{
+    m_udpConnection->resumeSecureConnection();
+}
+
+QByteArray ConnectionHandler::stepName(Step step)
+{
+    switch (step) {
+    case Step::SenderReceiverHandshake:
+        return QByteArrayLiteral("SenderReceiverHandshake");
+    case Step::OpeningSecureChannel:
+        return QByteArrayLiteral("OpeningSecureChannel");
+    case Step::ExchangingPasswords:
+        return QByteArrayLiteral("ExchangingPasswords");
+    default:
+        return QByteArrayLiteral("WaitingLoginData");
+    }
+}
+
+void ConnectionHandler::openPreSharedKeyChannel(const QByteArray &passwordKey,
+                                                const QUuid &clientUuid,
+                                                bool isServer)
+{
+    m_udpConnection->setPreSharedKey(PasswordVerifier::preSharedKey(passwordKey, clientUuid));
+    m_udpConnection->switchToSecureConnection(clientUuid, isServer);
+}
+
+bool ConnectionHandler::passwordsInHandshake() const
+{
+    const auto version = m_udpConnection ? m_udpConnection->supportedVersion() : std::nullopt;
+    return version.has_value() && UdpMessage::preSharedKeySupported(version.value());
+}
+
+void ConnectionHandler::stepCompleted()
+{
+    // Reconnects skip the first step and are kept apart from first connects.
+    const QByteArray labels = "step=\"" + stepName(m_step) + "\",setup=\""
+                              + (m_state == State::Reconnecting ? "reconnect" : "connect") + '"';
+    const std::chrono::nanoseconds duration{m_stepTimer.nsecsElapsed()};
+    m_stepTimer.start();
+    Metrics::histogram("dtls_pair_chat_setup_step_duration_seconds",
+                       "Time taken by each step of connection setup.",
+                       Metrics::durationBuckets(),
+                       labels)
+        .observe(std::chrono::duration<double>{duration}.count());
+    emit stepDurationMeasured(stepName(m_step), duration);
+}
+
 QString ConnectionHandler::toString(QDtlsError error)
 {
     switch (error) {
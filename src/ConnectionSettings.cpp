@@ -1,17 +1,24 @@
 #include <ConnectionSettings.h>
 
+#include <ChatHistory.h>
 #include <ChatMessagesModel.h>
 #include <ConnectionHandler.h>
+#include <FileTransfer.h>
 #include <HostInfo.h>
+#include <UdpConnection.h>
 
 #include <QClipboard>
+#include <QDir>
 #include <QGuiApplication>
+#include <QLocale>
+#include <QStandardPaths>
 
 using namespace dtls_pair_chat;
 
 ConnectionSettings::ConnectionSettings(QObject *parent)
     : QObject{parent}
     , m_chatModel{std::make_unique<ChatMessagesModel>()}
+    , m_fileTransfer{std::make_unique<FileTransfer>()}
     , m_connectionHandler{std::make_unique<ConnectionHandler>()}
     , m_hostInfo{std::make_unique<HostInfo>()}
 {
@@ -31,6 +38,14 @@ ConnectionSettings::ConnectionSettings(QObject *parent)
             &ConnectionHandler::remoteIpInvalid,
             this,
             &ConnectionSettings::remoteIpInvalid);
+    connect(m_fileTransfer.get(),
+            &FileTransfer::stateChanged,
+            this,
+            &ConnectionSettings::fileTransferChanged);
+    connect(m_fileTransfer.get(),
+            &FileTransfer::progressChanged,
+            this,
+            &ConnectionSettings::fileTransferProgressChanged);
     connect(m_hostInfo.get(),
             &HostInfo::addressesChanged,
             this,
@@ -41,6 +56,7 @@ ConnectionSettings::ConnectionSettings(QObject *parent)
 void ConnectionSettings::abortConnection()
 {
     m_chatModel->setUdpConnection({});
+    m_fileTransfer->setUdpConnection({});
     m_connectionHandler->abortConnection(ConnectionHandler::AbortReason::User);
 }
 
@@ -54,6 +70,21 @@ void ConnectionSettings::copyToClipboard(const QString &text)
     QGuiApplication::clipboard()->setText(text);
 }
 
+void ConnectionSettings::sendFile(const QUrl &fileUrl)
+{
+    m_fileTransfer->sendFile(fileUrl.toLocalFile());
+}
+
+void ConnectionSettings::acceptFileOffer()
+{
+    m_fileTransfer->acceptOffer();
+}
+
+void ConnectionSettings::cancelFileTransfer()
+{
+    m_fileTransfer->cancel();
+}
+
 void ConnectionSettings::setRemoteIp(const QString &newIp)
 {
     m_connectionHandler->remoteIpAddress(newIp);
@@ -121,6 +152,11 @@ QString ConnectionSettings::progressState() const
     return m_connectionHandler->currentStep();
 }
 
+bool ConnectionSettings::reconnecting() const
+{
+    return m_connectionHandler->state() == ConnectionHandler::State::Reconnecting;
+}
+
 bool ConnectionSettings::requiredFieldsFilled() const
 {
     return m_connectionHandler->loginInfoSet();
@@ -140,6 +176,87 @@ QAbstractItemModel *ConnectionSettings::chatModel() const
     return m_chatModel.get();
 }
 
+bool ConnectionSettings::fileTransferActive() const
+{
+    return m_fileTransfer->isActive();
+}
+
+bool ConnectionSettings::fileOfferPending() const
+{
+    return m_fileTransfer->state() == FileTransfer::State::Offered;
+}
+
+QString ConnectionSettings::fileTransferState() const
+{
+    const QLocale locale;
+    const QString rate = tr("%1/s").arg(locale.formattedDataSize(
+        static_cast<qint64>(m_fileTransfer->bytesPerSecond())));
+    const bool outgoing{m_fileTransfer->direction() == FileTransfer::Direction::Outgoing};
+    switch (m_fileTransfer->state()) {
+    case FileTransfer::State::Offering:
+        return tr("Waiting for other party to accept %1...").arg(m_fileTransfer->fileName());
+    case FileTransfer::State::Offered:
+        return tr("Other party offers %1 (%2)")
+            .arg(m_fileTransfer->fileName(),
+                 locale.formattedDataSize(static_cast<qint64>(m_fileTransfer->fileSize())));
+    case FileTransfer::State::Sending:
+        return tr("Sending %1 (%2)").arg(m_fileTransfer->fileName(), rate);
+    case FileTransfer::State::Receiving:
+        return tr("Receiving %1 (%2)").arg(m_fileTransfer->fileName(), rate);
+    case FileTransfer::State::Complete:
+        if (outgoing)
+            return tr("Sent %1").arg(m_fileTransfer->fileName());
+        else
+            return tr("Received %1").arg(m_fileTransfer->fileName());
+    case FileTransfer::State::Failed:
+        return tr("Transfer of %1 failed").arg(m_fileTransfer->fileName());
+    default: // Idle
+        return {};
+    }
+}
+
+qreal ConnectionSettings::fileTransferProgress() const
+{
+    return m_fileTransfer->progress();
+}
+
+qreal ConnectionSettings::fileTransferRate() const
+{
+    return m_fileTransfer->bytesPerSecond();
+}
+
+int ConnectionSettings::roundTripTime() const
+{
+    if (!m_linkQuality.smoothedRtt.has_value())
+        return -1;
+    return static_cast<int>(m_linkQuality.smoothedRtt->count());
+}
+
+int ConnectionSettings::jitter() const
+{
+    return static_cast<int>(m_linkQuality.jitter.count());
+}
+
+qreal ConnectionSettings::lossRate() const
+{
+    return m_linkQuality.lossRate;
+}
+
+int ConnectionSettings::deadPeerTimeout() const
+{
+    return m_deadPeerTimeout;
+}
+
+void ConnectionSettings::setDeadPeerTimeout(int seconds)
+{
+    if (seconds <= 0 || seconds == m_deadPeerTimeout)
+        return;
+    m_deadPeerTimeout = seconds;
+    if (const auto udpConnection = m_connectionHandler->udpConnection())
+        udpConnection->setDeadPeerTimeout(std::chrono::seconds{m_deadPeerTimeout});
+    emit deadPeerTimeoutChanged();
+}
+
 void ConnectionSettings::setThisMachineIpAddresses(const QList<QHostAddress> &newAddresses)
 {
     setLocalAddressIdx(-1); // none selected
@@ -157,12 +274,27 @@ void ConnectionSettings::setThisMachineIpAddresses(const QList<QHostAddress> &ne
 void ConnectionSettings::connectionStateChanged()
 {
     // this signal is only received when state actually changed, so we can signal every time
+    const bool wasReconnecting{std::exchange(m_reconnecting, reconnecting())};
+    if (wasReconnecting != m_reconnecting)
+        emit reconnectingChanged();
     switch (m_connectionHandler->state()) {
     case ConnectionHandler::State::Connecting:
         emit connectionStarted();
         break;
     case ConnectionHandler::State::Connected:
+        if (wasReconnecting)
+            break; // same connection, chat and transfer carry on with it
+        m_chatModel->setHistory(std::make_unique<ChatHistory>(
+            historyDirectory(m_connectionHandler->udpConnection()->remoteAddress())));
         m_chatModel->setUdpConnection(m_connectionHandler->udpConnection());
+        m_fileTransfer->setUdpConnection(m_connectionHandler->udpConnection());
+        m_connectionHandler->udpConnection()->setDeadPeerTimeout(
+            std::chrono::seconds{m_deadPeerTimeout});
+        connect(m_connectionHandler->udpConnection().get(),
+                &UdpConnection::linkQualityChanged,
+                this,
+                &ConnectionSettings::updateLinkQuality);
+        updateLinkQuality();
         emit connectionSuccessful();
         break;
     case ConnectionHandler::State::Failed:
@@ -173,3 +305,20 @@ void ConnectionSettings::connectionStateChanged()
         break;
     }
 }
+
+void ConnectionSettings::updateLinkQuality()
+{
+    const auto udpConnection = m_connectionHandler->udpConnection();
+    // Fetched once per change, the properties are read from the copy.
+    m_linkQuality = udpConnection ? udpConnection->linkQuality() : LinkMonitor::Quality{};
+    emit linkQualityChanged();
+}
+
+QString ConnectionSettings::historyDirectory(const QHostAddress &remoteAddress)
+{
+    // One directory per peer address. Colons of IPv6 addresses are not allowed everywhere.
+    QString peer{remoteAddress.toString()};
+    peer.replace(QLatin1Char{':'}, QLatin1Char{'_'});
+    return QDir{QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)}.filePath(
+        QStringLiteral("history/") + peer);
+}
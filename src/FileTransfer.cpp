@@ -0,0 +1,554 @@
+#include <FileTransfer.h>
+#include <UdpConnection.h>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QStandardPaths>
+
+#include <limits>
+
+using namespace dtls_pair_chat;
+
+// Received files are written under this suffix until complete.
+static const QString s_partialSuffix{QStringLiteral(".part")};
+
+FileTransfer::FileTransfer()
+    : QObject{nullptr}
+    , m_downloadDirectory{QStandardPaths::writableLocation(QStandardPaths::DownloadLocation)}
+{
+    if (m_downloadDirectory.isEmpty())
+        m_downloadDirectory = QDir::homePath();
+    m_retransmissionTimer.setSingleShot(true);
+    m_retransmissionTimer.setTimerType(Qt::TimerType::PreciseTimer);
+    connect(&m_retransmissionTimer,
+            &QTimer::timeout,
+            this,
+            &FileTransfer::retransmissionTimeout);
+    connect(&m_offerTimer, &BackoffTimer::timeout, this, &FileTransfer::retransmitOffer);
+    m_acknowledgementTimer.setSingleShot(true);
+    m_acknowledgementTimer.setInterval(s_acknowledgementDelay);
+    connect(&m_acknowledgementTimer,
+            &QTimer::timeout,
+            this,
+            &FileTransfer::sendAcknowledgement);
+    m_progressTimer.setInterval(s_progressInterval);
+    connect(&m_progressTimer, &QTimer::timeout, this, &FileTransfer::updateThroughput);
+}
+
+FileTransfer::~FileTransfer()
+{
+    if (isActive())
+        finish(State::Failed);
+}
+
+void FileTransfer::setUdpConnection(std::shared_ptr<UdpConnection> udpConnection)
+{
+    if (m_udpConnection.get()) {
+        disconnect(m_udpConnection.get(),
+                   &UdpConnection::messageReceived,
+                   this,
+                   &FileTransfer::messageReceived);
+    }
+    // Transfers do not survive the connection they were started on.
+    if (isActive())
+        finish(State::Failed);
+    m_udpConnection = udpConnection;
+    if (udpConnection.get()) {
+        connect(udpConnection.get(),
+                &UdpConnection::messageReceived,
+                this,
+                &FileTransfer::messageReceived);
+    }
+}
+
+void FileTransfer::setDownloadDirectory(const QString &directory)
+{
+    m_downloadDirectory = directory;
+}
+
+bool FileTransfer::sendFile(const QString &filePath)
+{
+    if (!m_udpConnection.get() || isActive()) {
+        qWarning() << "File transfer not possible now";
+        return false;
+    }
+    const auto version = m_udpConnection->supportedVersion();
+    if (!version.has_value() || !UdpMessage::fileTransferSupported(version.value())) {
+        qWarning() << "Remote version does not support file transfer";
+        return false;
+    }
+    m_file.setFileName(filePath);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Opening" << filePath << "failed:" << m_file.errorString();
+        return false;
+    }
+    const quint64 size = static_cast<quint64>(m_file.size());
+    if ((size + s_chunkSize - 1) / s_chunkSize > std::numeric_limits<quint32>::max()) {
+        qWarning() << "File" << filePath << "is too large to send";
+        m_file.close();
+        return false;
+    }
+    m_transferId = QRandomGenerator::global()->generate();
+    m_fileName = QFileInfo{filePath}.fileName();
+    m_fileSize = size;
+    m_chunkSize = s_chunkSize;
+    start(State::Offering, Direction::Outgoing);
+    // Chunks are sent once the remote has acknowledged the offer.
+    sendToRemote(UdpMessage{m_transferId, m_fileSize, m_chunkSize, m_fileName});
+    m_offerTimer.start();
+    return true;
+}
+
+void FileTransfer::acceptOffer()
+{
+    if (m_state != State::Offered)
+        return;
+    m_file.setFileName(m_targetPath + s_partialSuffix);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Opening" << m_file.fileName() << "failed:" << m_file.errorString();
+        sendToRemote(UdpMessage{m_transferId});
+        finish(State::Failed);
+        return;
+    }
+    start(State::Receiving, Direction::Incoming);
+    sendAcknowledgement();
+    if (chunkCount() == 0)
+        finishReceiving();
+}
+
+void FileTransfer::cancel()
+{
+    if (!isActive())
+        return;
+    sendToRemote(UdpMessage{m_transferId});
+    finish(State::Failed);
+}
+
+FileTransfer::State FileTransfer::state() const
+{
+    return m_state;
+}
+
+bool FileTransfer::isActive() const
+{
+    return m_state == State::Offering || m_state == State::Offered || m_state == State::Sending
+           || m_state == State::Receiving;
+}
+
+FileTransfer::Direction FileTransfer::direction() const
+{
+    return m_direction;
+}
+
+QString FileTransfer::fileName() const
+{
+    return m_fileName;
+}
+
+quint64 FileTransfer::fileSize() const
+{
+    return m_fileSize;
+}
+
+quint64 FileTransfer::transferredBytes() const
+{
+    return m_transferredBytes;
+}
+
+qreal FileTransfer::progress() const
+{
+    if (m_fileSize == 0)
+        return m_state == State::Complete ? 1.0 : 0.0;
+    return static_cast<qreal>(m_transferredBytes) / static_cast<qreal>(m_fileSize);
+}
+
+qreal FileTransfer::bytesPerSecond() const
+{
+    return m_bytesPerSecond;
+}
+
+void FileTransfer::messageReceived(const UdpMessage &message)
+{
+    switch (message.type()) {
+    case UdpMessage::Type::FileOffer:
+        offerReceived(message);
+        break;
+    case UdpMessage::Type::FileChunk:
+        chunkReceived(message);
+        break;
+    case UdpMessage::Type::FileAck:
+        if (m_direction == Direction::Outgoing && message.transferId() == m_transferId
+            && (m_state == State::Offering || m_state == State::Sending)) {
+            if (m_state == State::Offering) {
+                m_offerTimer.stop();
+                m_state = State::Sending;
+                emit stateChanged();
+            }
+            acknowledgementReceived(message.fileAcknowledgement());
+        }
+        break;
+    case UdpMessage::Type::FileCancel:
+        if (message.transferId() == m_transferId && isActive()) {
+            qWarning() << "Remote cancelled transfer of" << m_fileName;
+            finish(State::Failed);
+        }
+        break;
+    default:
+        // Not for us, ignore silently.
+        break;
+    }
+}
+
+void FileTransfer::retransmissionTimeout()
+{
+    if (m_state != State::Sending || m_inFlight.isEmpty())
+        return;
+    const qint64 timeoutMs = m_rttEstimator.retransmissionTimeout().count();
+    bool retransmitted{false};
+    for (auto it = m_inFlight.begin(); it != m_inFlight.end(); ++it) {
+        if (it->sentAt.elapsed() >= timeoutMs) {
+            it->transmissions++;
+            it->sentAt.start();
+            retransmitted = true;
+            sendToRemote(UdpMessage{m_transferId, it.key(), chunkData(it.key())});
+        }
+    }
+    if (retransmitted) {
+        m_rttEstimator.backoff();
+        if (++m_timeoutsWithoutProgress > s_maxTimeoutsWithoutProgress) {
+            qWarning() << "Remote stopped acknowledging" << m_fileName;
+            finish(State::Failed);
+            return;
+        }
+    }
+    restartRetransmissionTimer();
+}
+
+void FileTransfer::retransmitOffer()
+{
+    if (m_state != State::Offering) {
+        m_offerTimer.stop();
+    } else if (++m_offerRetransmissions > s_maxOfferRetransmissions) {
+        qWarning() << "Remote did not answer offer of" << m_fileName;
+        // Withdrawn, the remote may still be showing it.
+        sendToRemote(UdpMessage{m_transferId});
+        finish(State::Failed);
+    } else {
+        sendToRemote(UdpMessage{m_transferId, m_fileSize, m_chunkSize, m_fileName});
+    }
+}
+
+void FileTransfer::sendAcknowledgement()
+{
+    m_acknowledgementTimer.stop();
+    m_unacknowledgedChunks = 0;
+    UdpMessage::Acknowledgement acknowledgement{m_nextExpected, 0};
+    for (auto it = m_outOfOrder.cbegin(); it != m_outOfOrder.cend(); ++it) {
+        const quint32 bit = it.key() - m_nextExpected - 1;
+        if (bit >= 32)
+            break; // ordered by key, the rest is even further away
+        acknowledgement.selective |= 1u << bit;
+    }
+    sendToRemote(UdpMessage{m_transferId, acknowledgement});
+}
+
+void FileTransfer::updateThroughput()
+{
+    const qint64 elapsedMs = m_rateClock.restart();
+    if (elapsedMs > 0) {
+        const qreal sample = static_cast<qreal>(m_transferredBytes - m_rateBytes) * 1000.0
+                             / static_cast<qreal>(elapsedMs);
+        // Smooth out the bursts of a window being acknowledged at once.
+        m_bytesPerSecond = m_bytesPerSecond > 0.0 ? 0.75 * m_bytesPerSecond + 0.25 * sample
+                                                  : sample;
+    }
+    m_rateBytes = m_transferredBytes;
+    emit progressChanged();
+}
+
+void FileTransfer::offerReceived(const UdpMessage &message)
+{
+    if (m_direction == Direction::Incoming && message.transferId() == m_transferId
+        && (m_state == State::Receiving || m_state == State::Complete)) {
+        // Offer repeated, our answer was lost.
+        sendAcknowledgement();
+        return;
+    }
+    if (m_direction == Direction::Incoming && message.transferId() == m_transferId
+        && m_state == State::Offered) {
+        return; // offer repeated, the user has not decided yet
+    }
+    if (isActive()) {
+        // One transfer at a time, let the remote know right away instead of timing out.
+        sendToRemote(UdpMessage{message.transferId()});
+        return;
+    }
+    const QString fileName = QFileInfo{message.fileName()}.fileName();
+    const quint64 fileSize = message.fileSize();
+    const quint32 chunkSize = message.chunkSize();
+    // Rounded up without adding first, sizes near 2^64 would wrap around to no chunks at all.
+    const quint64 chunks = chunkSize == 0 ? 0 : fileSize / chunkSize + (fileSize % chunkSize != 0);
+    if (fileName.isEmpty() || fileName == QLatin1String{".."} || fileName == QLatin1String{"."}
+        || chunkSize == 0 || chunkSize > s_maxChunkSize || (chunks == 0 && fileSize > 0)
+        || chunks > std::numeric_limits<quint32>::max()) {
+        qWarning() << "Invalid file offer rejected";
+        sendToRemote(UdpMessage{message.transferId()});
+        return;
+    }
+    m_transferId = message.transferId();
+    m_fileName = fileName;
+    m_fileSize = message.fileSize();
+    m_chunkSize = message.chunkSize();
+    m_targetPath = QDir{m_downloadDirectory}.filePath(m_fileName);
+    // Remote keeps repeating the offer meanwhile, it is answered once accepted.
+    start(State::Offered, Direction::Incoming);
+}
+
+void FileTransfer::acknowledgementReceived(const UdpMessage::Acknowledgement &acknowledgement)
+{
+    if (acknowledgement.nextExpected > chunkCount())
+        return; // not from this transfer
+    std::optional<std::chrono::milliseconds> rttSample;
+    const auto isAcknowledged = [&acknowledgement](quint32 chunkIndex) {
+        if (chunkIndex < acknowledgement.nextExpected)
+            return true;
+        const quint32 bit = chunkIndex - acknowledgement.nextExpected - 1;
+        return bit < 32 && (acknowledgement.selective & (1u << bit));
+    };
+    bool progress{false};
+    for (auto it = m_inFlight.begin(); it != m_inFlight.end();) {
+        if (isAcknowledged(it.key())) {
+            // Karn's algorithm: retransmitted chunks give ambiguous samples.
+            if (it->transmissions == 1)
+                rttSample = std::chrono::milliseconds{it->sentAt.elapsed()};
+            it = m_inFlight.erase(it);
+            progress = true;
+        } else {
+            ++it;
+        }
+    }
+    if (acknowledgement.nextExpected > m_acknowledged) {
+        m_acknowledged = acknowledgement.nextExpected;
+        m_transferredBytes = qMin<quint64>(quint64{m_acknowledged} * m_chunkSize, m_fileSize);
+        m_duplicateAcknowledgements = 0;
+        progress = true;
+    } else if (!m_inFlight.isEmpty()
+               && ++m_duplicateAcknowledgements == s_duplicateAcknowledgementsToRetransmit) {
+        // Later chunks keep arriving but the next expected one does not, it was lost.
+        auto lost = m_inFlight.find(m_acknowledged);
+        if (lost != m_inFlight.end()) {
+            lost->transmissions++;
+            lost->sentAt.start();
+            sendToRemote(UdpMessage{m_transferId, lost.key(), chunkData(lost.key())});
+        }
+    }
+    if (progress)
+        m_timeoutsWithoutProgress = 0;
+    if (rttSample.has_value())
+        m_rttEstimator.addSample(rttSample.value());
+    if (m_acknowledged == chunkCount()) {
+        finish(State::Complete);
+        return;
+    }
+    sendWindow();
+    restartRetransmissionTimer();
+}
+
+void FileTransfer::sendWindow()
+{
+    while (m_nextChunk < chunkCount() && static_cast<quint32>(m_inFlight.size()) < s_windowSize)
+        sendChunk(m_nextChunk++);
+}
+
+void FileTransfer::sendChunk(quint32 chunkIndex)
+{
+    PendingChunk pending;
+    pending.sentAt.start();
+    m_inFlight.insert(chunkIndex, pending);
+    sendToRemote(UdpMessage{m_transferId, chunkIndex, chunkData(chunkIndex)});
+}
+
+QByteArray FileTransfer::chunkData(quint32 chunkIndex)
+{
+    const qint64 offset = qint64{chunkIndex} * m_chunkSize;
+    const qint64 size = chunkDataSize(chunkIndex);
+    if (offset < m_mappedOffset || offset + size > m_mappedOffset + m_mappedSize) {
+        // Map one segment at a time, the whole file may not fit the address space.
+        if (m_mapped)
+            m_file.unmap(m_mapped);
+        m_mappedOffset = offset - offset % s_mappedSegmentSize;
+        m_mappedSize = qMin<qint64>(s_mappedSegmentSize, m_fileSize - m_mappedOffset);
+        m_mapped = m_file.map(m_mappedOffset, m_mappedSize);
+        if (!m_mapped) {
+            // E.g. a file system without mmap support, read it instead.
+            m_mappedSize = 0;
+            m_file.seek(offset);
+            return m_file.read(size);
+        }
+    }
+    /* Copied out of the mapping: the message is encoded later in the network thread, by then
+     * this segment may have been unmapped for the next one or the transfer finished. */
+    return QByteArray{reinterpret_cast<const char *>(m_mapped) + (offset - m_mappedOffset), size};
+}
+
+void FileTransfer::restartRetransmissionTimer()
+{
+    if (m_inFlight.isEmpty()) {
+        m_retransmissionTimer.stop();
+        return;
+    }
+    // Fire when the oldest transmission runs out of time.
+    const qint64 timeoutMs = m_rttEstimator.retransmissionTimeout().count();
+    qint64 nextMs{timeoutMs};
+    for (const auto &pending : std::as_const(m_inFlight))
+        nextMs = qMin(nextMs, timeoutMs - pending.sentAt.elapsed());
+    m_retransmissionTimer.start(std::chrono::milliseconds{qMax<qint64>(nextMs, 1)});
+}
+
+void FileTransfer::chunkReceived(const UdpMessage &message)
+{
+    if (m_direction != Direction::Incoming || message.transferId() != m_transferId)
+        return;
+    if (m_state == State::Complete) {
+        // Our last ack was lost, sender keeps retransmitting.
+        sendAcknowledgement();
+        return;
+    }
+    if (m_state != State::Receiving)
+        return;
+    const quint32 chunkIndex = message.chunkIndex();
+    const QByteArrayView data = message.fileData();
+    if (chunkIndex >= chunkCount() || data.size() != chunkDataSize(chunkIndex))
+        return;
+    if (chunkIndex < m_nextExpected || m_outOfOrder.contains(chunkIndex)) {
+        // Duplicate, our ack may have been lost.
+        sendAcknowledgement();
+        return;
+    }
+    if (chunkIndex != m_nextExpected) {
+        if (chunkIndex - m_nextExpected < s_maxOutOfOrderChunks)
+            m_outOfOrder.insert(chunkIndex, data.toByteArray());
+        // A gap means loss, tell the sender at once.
+        sendAcknowledgement();
+        return;
+    }
+    // Written in order straight from the received datagram.
+    bool written = writeChunk(data);
+    m_nextExpected++;
+    for (auto next = m_outOfOrder.find(m_nextExpected); written && next != m_outOfOrder.end();
+         next = m_outOfOrder.find(m_nextExpected)) {
+        written = writeChunk(next.value());
+        m_outOfOrder.erase(next);
+        m_nextExpected++;
+    }
+    if (!written) {
+        qWarning() << "Writing" << m_file.fileName() << "failed:" << m_file.errorString();
+        cancel();
+        return;
+    }
+    if (m_nextExpected == chunkCount()) {
+        sendAcknowledgement();
+        finishReceiving();
+    } else if (++m_unacknowledgedChunks >= s_chunksPerAcknowledgement) {
+        sendAcknowledgement();
+    } else if (!m_acknowledgementTimer.isActive()) {
+        m_acknowledgementTimer.start();
+    }
+}
+
+bool FileTransfer::writeChunk(QByteArrayView data)
+{
+    if (m_file.write(data.data(), data.size()) != data.size())
+        return false;
+    m_transferredBytes += data.size();
+    return true;
+}
+
+void FileTransfer::finishReceiving()
+{
+    m_file.close();
+    // Never overwrite an existing file, add a counter to the name instead.
+    const QFileInfo target{m_targetPath};
+    QString finalPath = m_targetPath;
+    for (int counter = 1; QFile::exists(finalPath); ++counter) {
+        finalPath = target.dir().filePath(QStringLiteral("%1 (%2)%3")
+                                              .arg(target.completeBaseName())
+                                              .arg(counter)
+                                              .arg(target.suffix().isEmpty()
+                                                       ? QString{}
+                                                       : QLatin1Char{'.'} + target.suffix()));
+    }
+    if (!m_file.rename(finalPath)) {
+        qWarning() << "Renaming" << m_file.fileName() << "failed:" << m_file.errorString();
+        finish(State::Failed);
+        return;
+    }
+    m_targetPath = finalPath;
+    finish(State::Complete);
+}
+
+void FileTransfer::start(State state, Direction direction)
+{
+    m_state = state;
+    m_direction = direction;
+    m_transferredBytes = 0;
+    m_nextChunk = 0;
+    m_acknowledged = 0;
+    m_inFlight.clear();
+    m_rttEstimator = RttEstimator{};
+    m_offerRetransmissions = 0;
+    m_timeoutsWithoutProgress = 0;
+    m_duplicateAcknowledgements = 0;
+    m_nextExpected = 0;
+    m_outOfOrder.clear();
+    m_unacknowledgedChunks = 0;
+    m_rateBytes = 0;
+    m_bytesPerSecond = 0.0;
+    m_rateClock.start();
+    m_progressTimer.start();
+    emit stateChanged();
+    emit progressChanged();
+}
+
+void FileTransfer::finish(State state)
+{
+    m_offerTimer.stop();
+    m_retransmissionTimer.stop();
+    m_acknowledgementTimer.stop();
+    m_progressTimer.stop();
+    m_inFlight.clear();
+    m_outOfOrder.clear();
+    if (m_mapped) {
+        m_file.unmap(m_mapped);
+        m_mapped = nullptr;
+    }
+    m_mappedOffset = 0;
+    m_mappedSize = 0;
+    if (m_file.isOpen()) {
+        m_file.close();
+        // Do not leave partial downloads behind.
+        if (m_direction == Direction::Incoming && state == State::Failed)
+            m_file.remove();
+    }
+    m_state = state;
+    emit stateChanged();
+    emit progressChanged();
+}
+
+void FileTransfer::sendToRemote(const UdpMessage &message)
+{
+    if (m_udpConnection.get())
+        m_udpConnection->sendMessageToRemote(message);
+}
+
+quint32 FileTransfer::chunkCount() const
+{
+    return static_cast<quint32>(m_fileSize / m_chunkSize + (m_fileSize % m_chunkSize != 0));
+}
+
+qint64 FileTransfer::chunkDataSize(quint32 chunkIndex) const
+{
+    const quint64 offset = quint64{chunkIndex} * m_chunkSize;
+    return static_cast<qint64>(qMin<quint64>(m_chunkSize, m_fileSize - offset));
+}
@@ -1,12 +1,13 @@
 #include <Handshake.h>
-#include <UdpMessage.h>
 
 using namespace dtls_pair_chat;
 
 Handshake::Handshake(std::shared_ptr<UdpConnection> udpConnection)
     : QObject{nullptr}
     , m_udpConnection{udpConnection}
-{}
+{
+    connect(&m_retransmitTimer, &BackoffTimer::timeout, this, &Handshake::retransmit);
+}
 
 void Handshake::start()
 {
@@ -20,20 +21,35 @@ void Handshake::start()
             &UdpConnection::messageReceived,
             this,
             &Handshake::messageReceived);
-    m_udpConnection->sendMessageToRemote(UdpMessage{m_myId});
+    sendToRemote(UdpMessage{m_myId}, true);
 }
 
 void Handshake::messageReceived(const UdpMessage &receivedMessage)
 {
     switch (receivedMessage.type()) {
     case UdpMessage::Type::SendUuid:
-        if (m_state == State::WaitingAckForSentUuid) {
-            // remote end did not receive our message and has sent his ID.
+        switch (m_state) {
+        case State::WaitingAckForSentUuid:
+            /* Both ends send their UUID until one gets acknowledged. If both arrive, the
+             * larger UUID wins so that the ends do not acknowledge each other. */
+            if (receivedMessage.senderUuid() < m_myId)
+                break; // remote will acknowledge ours as soon as it arrives.
             // Acknowledge the ID and wait for ack from remote. Remote will be the Server.
             m_state = State::WaitingAckForAck;
-            m_udpConnection->sendMessageToRemote(UdpMessage{m_myId, receivedMessage.senderUuid()});
-        } else {
-            qWarning() << "new UUID received in middle of handshake";
+            m_remoteId = receivedMessage.senderUuid();
+            sendToRemote(UdpMessage{m_myId, m_remoteId}, true);
+            break;
+        case State::WaitingAckForAck:
+            if (receivedMessage.senderUuid() == m_remoteId) {
+                // Remote did not get our ack, repeat it.
+                m_udpConnection->sendMessageToRemote(m_lastSent.value());
+            } else {
+                qWarning() << "new UUID received in middle of handshake";
+            }
+            break;
+        default:
+            // Late retransmission, already handled.
+            break;
         }
         break;
     case UdpMessage::Type::AckUuid:
@@ -48,20 +64,28 @@ void Handshake::messageReceived(const UdpMessage &receivedMessage)
             // We sent UUID and received ack with our UUID
             switch (m_state) {
             case State::WaitingAckForSentUuid:
-                // Response to our UUID. Acknowledge the Ack. Handshake is complete, this side is the server.
-                m_udpConnection->sendMessageToRemote(
-                    UdpMessage{m_myId, receivedMessage.senderUuid()});
-                finalize(receivedMessage.senderUuid());
+                /* Response to our UUID. Acknowledge the Ack. Handshake is complete, this side
+                 * is the server. The ack is not retransmitted on its own, but repeated
+                 * whenever the client repeats its ack. */
+                m_remoteId = receivedMessage.senderUuid();
+                sendToRemote(UdpMessage{m_myId, m_remoteId}, false);
+                finalize(m_remoteId);
                 break;
             case State::WaitingAckForAck:
                 // We sent ack for remote server UUID and now received ack for ack. Handshake is complete, this side is client.
                 finalize(QUuid{});
                 break;
+            case State::Complete:
+                if (m_isServer && receivedMessage.senderUuid() == m_remoteId) {
+                    // Our ack for ack was lost, client is still waiting for it.
+                    m_udpConnection->sendMessageToRemote(m_lastSent.value());
+                }
+                break;
             default:
                 qWarning() << "Valid formed ack received, but in wrong phase of the handshake";
                 break;
             }
-        } else {
+        } else if (m_state != State::Complete) {
             qWarning() << "ACK received but it did not contain our UUID";
         }
         break;
@@ -72,16 +96,33 @@ void Handshake::messageReceived(const UdpMessage &receivedMessage)
     }
 }
 
+void Handshake::retransmit()
+{
+    if (m_lastSent.has_value())
+        m_udpConnection->sendMessageToRemote(m_lastSent.value());
+}
+
+void Handshake::sendToRemote(const UdpMessage &message, bool retransmitUntilAnswered)
+{
+    m_lastSent = message;
+    m_udpConnection->sendMessageToRemote(message);
+    if (retransmitUntilAnswered)
+        m_retransmitTimer.start();
+    else
+        m_retransmitTimer.stop();
+}
+
 void Handshake::finalize(const QUuid &remoteUuid)
 {
     m_state = State::Complete;
-    disconnect(m_udpConnection.get(),
-               &UdpConnection::messageReceived,
-               this,
-               &Handshake::messageReceived);
+    m_retransmitTimer.stop();
+    /* Keep listening until this object is deleted, so that retransmissions from remote
+     * still get answered while the secure channel is being opened. */
     // if remote Uuid was not given, we don't need it because this side is the client and it's our UUID
-    if (remoteUuid.isNull())
+    if (remoteUuid.isNull()) {
         emit complete(m_myId, false);
-    else
+    } else {
+        m_isServer = true;
         emit complete(remoteUuid, true);
+    }
 }
@@ -1,16 +1,33 @@
-#include <QTimerEvent>
 #include <HostInfo.h>
 
+#include <QNetworkInformation>
+#include <QNetworkInterface>
+#include <QSocketNotifier>
+
+#ifdef Q_OS_LINUX
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
 using namespace dtls_pair_chat;
+
 HostInfo::HostInfo()
     : QObject{nullptr}
 {
-    const auto hostName = QHostInfo::localHostName();
-    if (hostName.isEmpty()) {
-        startTimer(1000, Qt::TimerType::VeryCoarseTimer);
-    } else {
-        QHostInfo::lookupHost(hostName, this, &dtls_pair_chat::HostInfo::handleHostInfo);
-    }
+    subscribeToChanges();
+    refresh();
+}
+
+HostInfo::~HostInfo()
+{
+#ifdef Q_OS_LINUX
+    if (m_netlinkSocket >= 0)
+        ::close(m_netlinkSocket);
+#endif
 }
 
 QList<QHostAddress> HostInfo::currentAddresses() const
@@ -23,45 +40,92 @@ QString HostInfo::currentError() const
     return m_currentErrorString;
 }
 
-void HostInfo::handleHostInfo(const QHostInfo newInfo)
+void HostInfo::refresh()
 {
-    const auto oldErrorString = m_currentErrorString;
-    const auto oldError = m_currentError;
-    if (newInfo.error() == QHostInfo::HostInfoError::NoError) {
-        if (newInfo.addresses().empty()) {
-            m_currentError = Error::NoAddress;
-        } else {
-            m_currentAddresses = newInfo.addresses();
-            m_currentError = Error::None;
+    QList<QHostAddress> addresses;
+    bool connected{false};
+    for (const auto &networkInterface : QNetworkInterface::allInterfaces()) {
+        const auto flags = networkInterface.flags();
+        if (!flags.testFlag(QNetworkInterface::IsUp)
+            || !flags.testFlag(QNetworkInterface::IsRunning)
+            || flags.testFlag(QNetworkInterface::IsLoopBack)) {
+            continue;
+        }
+        connected = true;
+        for (const auto &entry : networkInterface.addressEntries()) {
+            // Link local addresses need a scope the remote end does not know.
+            if (!entry.ip().isLoopback() && !entry.ip().isLinkLocal())
+                addresses.append(entry.ip());
         }
-    } else {
-        if (newInfo.error() == QHostInfo::HostInfoError::HostNotFound)
-            m_currentError = Error::HostNotFound;
-        else
-            m_currentError = Error::Unknown;
     }
+    const auto oldAddresses = m_currentAddresses;
+    const auto oldError = m_currentError;
+    m_currentAddresses = addresses;
+    if (!connected)
+        m_currentError = Error::NoNetwork;
+    else if (addresses.isEmpty())
+        m_currentError = Error::NoAddress;
+    else
+        m_currentError = Error::None;
     switch (m_currentError) {
-    case Error::HostNotFound:
+    case Error::NoNetwork:
         m_currentErrorString = tr("No network connection");
         break;
     case Error::NoAddress:
         m_currentErrorString = tr("No address assigned");
         break;
-    case Error::Unknown:
-        m_currentErrorString = newInfo.errorString();
     default: // no error
         m_currentErrorString.clear();
         break;
     }
-    if (oldError != m_currentError || oldErrorString != m_currentErrorString)
+    if (oldError != m_currentError || oldAddresses != m_currentAddresses)
         emit addressesChanged(m_currentAddresses);
 }
 
-void HostInfo::timerEvent(QTimerEvent *event)
+void HostInfo::readNetlinkEvents()
+{
+#ifdef Q_OS_LINUX
+    /* The content does not matter, any event means the interfaces are enumerated again. A
+     * burst, e.g. all addresses of a VPN coming up, is read in full and handled once. */
+    char buffer[8192];
+    forever {
+        const ssize_t size = ::recv(m_netlinkSocket, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size < 0 && errno == EINTR)
+            continue;
+        // ENOBUFS means events were lost, enumerating catches up with them as well.
+        if (size < 0 && errno != ENOBUFS)
+            break;
+    }
+#endif
+    refresh();
+}
+
+void HostInfo::subscribeToChanges()
 {
-    const auto hostName = QHostInfo::localHostName();
-    if (!hostName.isEmpty()) {
-        killTimer(event->timerId());
-        QHostInfo::lookupHost(hostName, this, &dtls_pair_chat::HostInfo::handleHostInfo);
+#ifdef Q_OS_LINUX
+    m_netlinkSocket = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (m_netlinkSocket >= 0) {
+        sockaddr_nl address{};
+        address.nl_family = AF_NETLINK;
+        address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+        if (::bind(m_netlinkSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0) {
+            m_netlinkNotifier = new QSocketNotifier{m_netlinkSocket, QSocketNotifier::Read, this};
+            connect(m_netlinkNotifier,
+                    &QSocketNotifier::activated,
+                    this,
+                    &HostInfo::readNetlinkEvents);
+            return;
+        }
+        qWarning() << "Subscribing to address changes failed:" << qt_error_string(errno);
+        ::close(m_netlinkSocket);
+        m_netlinkSocket = -1;
+    }
+#endif
+    // Without rtnetlink, e.g. in a sandbox or on other platforms
+    if (QNetworkInformation::loadDefaultBackend()) {
+        connect(QNetworkInformation::instance(),
+                &QNetworkInformation::reachabilityChanged,
+                this,
+                &HostInfo::refresh);
     }
 }
@@ -0,0 +1,117 @@
+#include <LinkMonitor.h>
+
+#include <QtAlgorithms>
+#include <QtMath>
+
+using namespace dtls_pair_chat;
+
+// Gain of the interarrival jitter estimate in RFC 3550
+static constexpr double s_jitterGain{1.0 / 16.0};
+
+LinkMonitor::LinkMonitor()
+    : QObject{nullptr}
+{
+    m_timer.setInterval(s_defaultInterval);
+    connect(&m_timer, &QTimer::timeout, this, &LinkMonitor::sendHeartbeat);
+}
+
+void LinkMonitor::start()
+{
+    m_sinceReceived.start();
+    m_peerDead = false;
+    m_timer.start();
+}
+
+void LinkMonitor::stop()
+{
+    m_timer.stop();
+    // Heartbeats of a stopped monitor are neither answered nor lost.
+    m_outstanding.clear();
+}
+
+bool LinkMonitor::isActive() const
+{
+    return m_timer.isActive();
+}
+
+void LinkMonitor::setInterval(std::chrono::milliseconds interval)
+{
+    m_timer.setInterval(interval);
+}
+
+void LinkMonitor::setDeadPeerTimeout(std::chrono::milliseconds timeout)
+{
+    m_deadPeerTimeout = timeout;
+}
+
+void LinkMonitor::remoteActive()
+{
+    m_sinceReceived.start();
+    m_peerDead = false;
+}
+
+void LinkMonitor::answerReceived(quint32 heartbeatNumber)
+{
+    const auto outstanding = m_outstanding.find(heartbeatNumber);
+    if (outstanding == m_outstanding.end())
+        return; // counted lost already, or a duplicate
+    const qint64 rttMs = outstanding->elapsed();
+    m_outstanding.erase(outstanding);
+    m_rttEstimator.addSample(std::chrono::milliseconds{rttMs});
+    if (m_previousRttMs.has_value()) {
+        const auto difference = static_cast<double>(qAbs(rttMs - m_previousRttMs.value()));
+        m_jitterMs += s_jitterGain * (difference - m_jitterMs);
+    }
+    m_previousRttMs = rttMs;
+    m_answered++;
+    recordResult(true);
+    emit qualityChanged();
+}
+
+LinkMonitor::Quality LinkMonitor::quality() const
+{
+    Quality quality;
+    quality.smoothedRtt = m_rttEstimator.smoothedRtt();
+    quality.jitter = std::chrono::milliseconds{qRound64(m_jitterMs)};
+    if (m_resultCount > 0) {
+        const quint32 window = m_resultCount < s_lossWindow ? (1u << m_resultCount) - 1 : ~0u;
+        const int lost = m_resultCount - static_cast<int>(qPopulationCount(m_results & window));
+        quality.lossRate = static_cast<qreal>(lost) / m_resultCount;
+    }
+    quality.sent = m_sent;
+    quality.answered = m_answered;
+    return quality;
+}
+
+void LinkMonitor::sendHeartbeat()
+{
+    if (!m_peerDead && m_sinceReceived.elapsed() >= m_deadPeerTimeout.count()) {
+        m_peerDead = true;
+        emit peerDead();
+    }
+    // Heartbeats not answered by now are not waited for anymore.
+    const qint64 answerTimeoutMs = s_answerTimeoutIntervals * m_timer.interval();
+    bool lost{false};
+    for (auto it = m_outstanding.begin(); it != m_outstanding.end();) {
+        if (it->elapsed() >= answerTimeoutMs) {
+            recordResult(false);
+            lost = true;
+            it = m_outstanding.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (lost)
+        emit qualityChanged();
+    const quint32 heartbeatNumber = m_nextHeartbeat++;
+    m_outstanding[heartbeatNumber].start();
+    m_sent++;
+    emit transmit(UdpMessage{UdpMessage::Type::Heartbeat, heartbeatNumber});
+}
+
+void LinkMonitor::recordResult(bool answered)
+{
+    static_assert(s_lossWindow <= 32, "results are kept in a quint32");
+    m_results = (m_results << 1) | (answered ? 1u : 0u);
+    m_resultCount = qMin(m_resultCount + 1, s_lossWindow);
+}
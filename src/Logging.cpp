@@ -0,0 +1,6 @@
+#include <Logging.h>
+
+namespace dtls_pair_chat {
+Q_LOGGING_CATEGORY(lcDatagram, "dtls_pair_chat.datagram")
+Q_LOGGING_CATEGORY(lcSession, "dtls_pair_chat.session")
+} // namespace dtls_pair_chat
@@ -0,0 +1,83 @@
+#include <MessageCoalescer.h>
+
+#include <QtEndian>
+
+#include <cstring>
+#include <limits>
+
+using namespace dtls_pair_chat;
+
+/* Envelope record, all integers are big endian:
+ * offset 0: magic byte (differs from UdpMessage binary, fragment and XML first bytes)
+ * offset 1: length of the first message as quint16, followed by the message
+ * and so on for every message packed in the envelope.
+ */
+static constexpr quint8 s_envelopeMagic{0xDE};
+
+bool MessageCoalescer::isEnvelope(QByteArrayView record)
+{
+    return record.size() > s_headerSize + s_lengthSize
+           && static_cast<quint8>(record.front()) == s_envelopeMagic;
+}
+
+QList<QByteArray> MessageCoalescer::unpack(QByteArrayView envelope)
+{
+    QList<QByteArray> messages;
+    if (!isEnvelope(envelope))
+        return messages;
+    qsizetype offset{s_headerSize};
+    while (offset < envelope.size()) {
+        if (envelope.size() - offset < s_lengthSize)
+            return {};
+        const auto length = qFromBigEndian<quint16>(envelope.data() + offset);
+        offset += s_lengthSize;
+        if (length == 0 || envelope.size() - offset < length)
+            return {};
+        messages.append(envelope.sliced(offset, length).toByteArray());
+        offset += length;
+    }
+    return messages;
+}
+
+bool MessageCoalescer::add(const QByteArray &message, qsizetype maxRecordSize)
+{
+    const qsizetype entrySize = s_lengthSize + message.size();
+    if (!fits(message, maxRecordSize) || m_envelopeSize + entrySize > maxRecordSize)
+        return false;
+    m_messages.append(message);
+    m_envelopeSize += entrySize;
+    return true;
+}
+
+bool MessageCoalescer::fits(const QByteArray &message, qsizetype maxRecordSize)
+{
+    return !message.isEmpty() && message.size() <= std::numeric_limits<quint16>::max()
+           && s_headerSize + s_lengthSize + message.size() <= maxRecordSize;
+}
+
+bool MessageCoalescer::isEmpty() const
+{
+    return m_messages.isEmpty();
+}
+
+QByteArray MessageCoalescer::take()
+{
+    QByteArray record;
+    if (m_messages.size() == 1) {
+        record = m_messages.takeFirst(); // nothing to share the record with, no envelope
+    } else if (!m_messages.isEmpty()) {
+        record.resize(m_envelopeSize);
+        auto *data = reinterpret_cast<uchar *>(record.data());
+        data[0] = s_envelopeMagic;
+        qsizetype offset{s_headerSize};
+        for (const auto &message : std::as_const(m_messages)) {
+            qToBigEndian<quint16>(static_cast<quint16>(message.size()), data + offset);
+            offset += s_lengthSize;
+            std::memcpy(data + offset, message.constData(), message.size());
+            offset += message.size();
+        }
+        m_messages.clear();
+    }
+    m_envelopeSize = s_headerSize;
+    return record;
+}
@@ -0,0 +1,139 @@
+#include <Logging.h>
+#include <MessageFragmenter.h>
+
+#include <QDebug>
+#include <QtEndian>
+
+#include <cstring>
+#include <limits>
+
+using namespace dtls_pair_chat;
+
+/* Fragment record, all integers are big endian:
+ * offset 0: magic byte (differs from UdpMessage binary magic and from XML)
+ * offset 1: reserved, zero
+ * offset 2: message id as quint32
+ * offset 6: fragment index as quint16
+ * offset 8: fragment count as quint16
+ * offset 10: fragment data
+ */
+static constexpr quint8 s_fragmentMagic{0xDF};
+
+bool MessageFragmenter::isFragment(QByteArrayView datagram)
+{
+    return datagram.size() > s_headerSize
+           && static_cast<quint8>(datagram.front()) == s_fragmentMagic;
+}
+
+QList<QByteArray> MessageFragmenter::split(const QByteArray &message, qsizetype maxRecordSize)
+{
+    QList<QByteArray> records;
+    const qsizetype maxDataSize = maxRecordSize - s_headerSize;
+    Q_ASSERT(maxDataSize > 0);
+    // Remote would drop it, and a reliable message be retransmitted forever.
+    if (message.size() > s_maxPendingBytes) {
+        qWarning() << "Message of" << message.size() << "bytes is too large to send";
+        return records;
+    }
+    const qsizetype fragmentCount = (message.size() + maxDataSize - 1) / maxDataSize;
+    if (fragmentCount > std::numeric_limits<quint16>::max()) {
+        qWarning() << "Message of" << message.size() << "bytes is too large to send";
+        return records;
+    }
+    const quint32 messageId = m_nextMessageId++;
+    records.reserve(fragmentCount);
+    for (qsizetype index = 0; index < fragmentCount; ++index) {
+        const QByteArrayView data = QByteArrayView{message}.sliced(
+            index * maxDataSize, qMin(maxDataSize, message.size() - index * maxDataSize));
+        QByteArray record{s_headerSize + data.size(), Qt::Uninitialized};
+        auto *header = reinterpret_cast<quint8 *>(record.data());
+        header[0] = s_fragmentMagic;
+        header[1] = 0;
+        qToBigEndian<quint32>(messageId, header + 2);
+        qToBigEndian<quint16>(static_cast<quint16>(index), header + 6);
+        qToBigEndian<quint16>(static_cast<quint16>(fragmentCount), header + 8);
+        memcpy(header + s_headerSize, data.data(), data.size());
+        records.append(std::move(record));
+    }
+    return records;
+}
+
+std::optional<QByteArray> MessageFragmenter::reassemble(QByteArrayView fragment)
+{
+    if (!isFragment(fragment))
+        return std::nullopt;
+    dropExpired();
+    const auto *header = reinterpret_cast<const quint8 *>(fragment.data());
+    const quint32 messageId = qFromBigEndian<quint32>(header + 2);
+    const quint16 index = qFromBigEndian<quint16>(header + 6);
+    const quint16 count = qFromBigEndian<quint16>(header + 8);
+    const QByteArrayView data = fragment.sliced(s_headerSize);
+    // Count is checked before any slots are allocated for it.
+    if (index >= count || count > s_maxFragmentCount || data.size() > s_maxPendingBytes)
+        return std::nullopt;
+
+    auto pending = m_pending.find(messageId);
+    if (pending == m_pending.end()) {
+        while (m_pending.size() >= s_maxPendingMessages)
+            dropOldest();
+        PendingMessage newMessage;
+        newMessage.fragments.resize(count);
+        newMessage.deadline = QDeadlineTimer{s_reassemblyTimeout};
+        m_pendingBytes += footprint(newMessage);
+        pending = m_pending.insert(messageId, std::move(newMessage));
+    }
+    if (pending->fragments.size() != count || !pending->fragments.at(index).isNull())
+        return std::nullopt; // inconsistent or duplicate fragment
+    pending->fragments[index] = data.toByteArray();
+    pending->receivedCount++;
+    pending->receivedBytes += data.size();
+    m_pendingBytes += data.size();
+
+    if (pending->receivedCount == count) {
+        QByteArray message;
+        message.reserve(pending->receivedBytes);
+        for (const auto &part : std::as_const(pending->fragments))
+            message.append(part);
+        m_pendingBytes -= footprint(pending.value());
+        m_pending.erase(pending);
+        return message;
+    }
+    // Keep the buffer bounded, oldest incomplete messages go first.
+    while (m_pendingBytes > s_maxPendingBytes && !m_pending.isEmpty())
+        dropOldest();
+    return std::nullopt;
+}
+
+qsizetype MessageFragmenter::footprint(const PendingMessage &message)
+{
+    return message.receivedBytes
+           + message.fragments.size() * static_cast<qsizetype>(sizeof(QByteArray));
+}
+
+void MessageFragmenter::dropExpired()
+{
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (it->deadline.hasExpired()) {
+            qCDebug(lcDatagram) << "Incomplete message" << it.key() << "dropped after timeout";
+            m_pendingBytes -= footprint(it.value());
+            it = m_pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void MessageFragmenter::dropOldest()
+{
+    auto oldest = m_pending.begin();
+    for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
+        if (it->deadline.deadline() < oldest->deadline.deadline())
+            oldest = it;
+    }
+    if (oldest != m_pending.end()) {
+        qCDebug(lcDatagram) << "Incomplete message" << oldest.key()
+                            << "dropped, reassembly buffer full";
+        m_pendingBytes -= footprint(oldest.value());
+        m_pending.erase(oldest);
+    }
+}
@@ -0,0 +1,239 @@
+#include <Metrics.h>
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+
+#include <algorithm>
+#include <vector>
+
+using namespace dtls_pair_chat;
+
+namespace {
+struct Entry
+{
+    QByteArray name;
+    QByteArray help;
+    QByteArray labels;
+    std::unique_ptr<Metrics::Counter> counter; // either this
+    std::unique_ptr<Metrics::Histogram> histogram; // or this
+};
+
+/* Entries are only ever appended. The instruments are heap allocated, so references to them
+ * stay valid while the list grows. */
+struct Registry
+{
+    QMutex mutex;
+    std::vector<Entry> entries;
+};
+
+Registry &registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+Entry *find(const QByteArray &name, const QByteArray &labels)
+{
+    for (auto &entry : registry().entries) {
+        if (entry.name == name && entry.labels == labels)
+            return &entry;
+    }
+    return nullptr;
+}
+
+// Entries grouped by name in order of first registration, as Prometheus wants them.
+std::vector<const Entry *> groupedEntries()
+{
+    std::vector<const Entry *> grouped;
+    for (const auto &entry : registry().entries)
+        grouped.push_back(&entry);
+    QList<QByteArray> order;
+    for (const auto *entry : grouped) {
+        if (!order.contains(entry->name))
+            order.append(entry->name);
+    }
+    std::stable_sort(grouped.begin(), grouped.end(), [&order](const Entry *a, const Entry *b) {
+        return order.indexOf(a->name) < order.indexOf(b->name);
+    });
+    return grouped;
+}
+
+QByteArray number(double value)
+{
+    return QByteArray::number(value, 'g', 17);
+}
+
+QByteArray series(const QByteArray &name,
+                  const QByteArray &labels,
+                  const QByteArray &extraLabel = {})
+{
+    QByteArray allLabels = labels;
+    if (!extraLabel.isEmpty())
+        allLabels += (allLabels.isEmpty() ? "" : ",") + extraLabel;
+    return allLabels.isEmpty() ? name : name + '{' + allLabels + '}';
+}
+
+// step="Connected",other="x" to a JSON object. Values never contain commas or quotes here.
+QJsonObject labelObject(const QByteArray &labels)
+{
+    QJsonObject object;
+    for (const auto &label : labels.split(',')) {
+        const qsizetype separator = label.indexOf('=');
+        if (separator <= 0)
+            continue;
+        QByteArray value = label.sliced(separator + 1);
+        if (value.startsWith('"') && value.endsWith('"') && value.size() >= 2)
+            value = value.sliced(1, value.size() - 2);
+        object.insert(QString::fromUtf8(label.first(separator)), QString::fromUtf8(value));
+    }
+    return object;
+}
+} // namespace
+
+Metrics::Histogram::Histogram(const QList<double> &upperBounds)
+    : m_upperBounds{upperBounds}
+    , m_bucketCounts{std::make_unique<std::atomic<quint64>[]>(upperBounds.size() + 1)}
+{
+    for (qsizetype i = 0; i <= m_upperBounds.size(); ++i)
+        m_bucketCounts[i].store(0, std::memory_order_relaxed);
+}
+
+void Metrics::Histogram::observe(double value)
+{
+    const auto bound = std::lower_bound(m_upperBounds.cbegin(), m_upperBounds.cend(), value);
+    m_bucketCounts[std::distance(m_upperBounds.cbegin(), bound)].fetch_add(
+        1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    // No fetch_add for floating point atomics before C++20.
+    double sum = m_sum.load(std::memory_order_relaxed);
+    while (!m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+    }
+}
+
+const QList<double> &Metrics::Histogram::upperBounds() const
+{
+    return m_upperBounds;
+}
+
+QList<quint64> Metrics::Histogram::bucketCounts() const
+{
+    QList<quint64> counts;
+    counts.reserve(m_upperBounds.size() + 1);
+    for (qsizetype i = 0; i <= m_upperBounds.size(); ++i)
+        counts.append(m_bucketCounts[i].load(std::memory_order_relaxed));
+    return counts;
+}
+
+quint64 Metrics::Histogram::count() const
+{
+    return m_count.load(std::memory_order_relaxed);
+}
+
+double Metrics::Histogram::sum() const
+{
+    return m_sum.load(std::memory_order_relaxed);
+}
+
+Metrics::Counter &Metrics::counter(const QByteArray &name,
+                                   const QByteArray &help,
+                                   const QByteArray &labels)
+{
+    const QMutexLocker locker{&registry().mutex};
+    if (Entry *entry = find(name, labels)) {
+        Q_ASSERT(entry->counter);
+        return *entry->counter;
+    }
+    registry().entries.push_back({name, help, labels, std::make_unique<Counter>(), nullptr});
+    return *registry().entries.back().counter;
+}
+
+Metrics::Histogram &Metrics::histogram(const QByteArray &name,
+                                       const QByteArray &help,
+                                       const QList<double> &upperBounds,
+                                       const QByteArray &labels)
+{
+    const QMutexLocker locker{&registry().mutex};
+    if (Entry *entry = find(name, labels)) {
+        Q_ASSERT(entry->histogram);
+        return *entry->histogram;
+    }
+    registry().entries.push_back(
+        {name, help, labels, nullptr, std::make_unique<Histogram>(upperBounds)});
+    return *registry().entries.back().histogram;
+}
+
+const QList<double> &Metrics::durationBuckets()
+{
+    static const QList<double> buckets{0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+                                       1.0,   2.5,  5.0,   10.0, 30.0, 60.0};
+    return buckets;
+}
+
+QByteArray Metrics::toPrometheusText()
+{
+    const QMutexLocker locker{&registry().mutex};
+    QByteArray text;
+    QByteArray previousName;
+    for (const Entry *entry : groupedEntries()) {
+        if (entry->name != previousName) {
+            previousName = entry->name;
+            text += "# HELP " + entry->name + ' ' + entry->help + '\n';
+            text += "# TYPE " + entry->name + (entry->counter ? " counter\n" : " histogram\n");
+        }
+        if (entry->counter) {
+            text += series(entry->name, entry->labels) + ' '
+                    + QByteArray::number(entry->counter->value()) + '\n';
+            continue;
+        }
+        const Histogram &histogram = *entry->histogram;
+        const QList<quint64> counts = histogram.bucketCounts();
+        quint64 cumulative{0};
+        for (qsizetype i = 0; i < counts.size(); ++i) {
+            cumulative += counts.at(i);
+            const QByteArray bound = i < histogram.upperBounds().size()
+                                         ? number(histogram.upperBounds().at(i))
+                                         : QByteArrayLiteral("+Inf");
+            text += series(entry->name + "_bucket", entry->labels, "le=\"" + bound + '"') + ' '
+                    + QByteArray::number(cumulative) + '\n';
+        }
+        text += series(entry->name + "_sum", entry->labels) + ' ' + number(histogram.sum()) + '\n';
+        text += series(entry->name + "_count", entry->labels) + ' '
+                + QByteArray::number(cumulative) + '\n';
+    }
+    return text;
+}
+
+QByteArray Metrics::toJson()
+{
+    const QMutexLocker locker{&registry().mutex};
+    QJsonArray counters;
+    QJsonArray histograms;
+    for (const Entry *entry : groupedEntries()) {
+        QJsonObject object{{QStringLiteral("name"), QString::fromUtf8(entry->name)},
+                           {QStringLiteral("help"), QString::fromUtf8(entry->help)},
+                           {QStringLiteral("labels"), labelObject(entry->labels)}};
+        if (entry->counter) {
+            object.insert(QStringLiteral("value"),
+                          static_cast<qint64>(entry->counter->value()));
+            counters.append(object);
+            continue;
+        }
+        QJsonArray buckets;
+        const QList<quint64> counts = entry->histogram->bucketCounts();
+        for (qsizetype i = 0; i < counts.size(); ++i) {
+            QJsonObject bucket{{QStringLiteral("count"), static_cast<qint64>(counts.at(i))}};
+            if (i < entry->histogram->upperBounds().size())
+                bucket.insert(QStringLiteral("le"), entry->histogram->upperBounds().at(i));
+            buckets.append(bucket); // the last one, without a bound, is +Inf
+        }
+        object.insert(QStringLiteral("buckets"), buckets);
+        object.insert(QStringLiteral("count"), static_cast<qint64>(entry->histogram->count()));
+        object.insert(QStringLiteral("sum"), entry->histogram->sum());
+        histograms.append(object);
+    }
+    return QJsonDocument{QJsonObject{{QStringLiteral("counters"), counters},
+                                     {QStringLiteral("histograms"), histograms}}}
+        .toJson(QJsonDocument::Compact);
+}
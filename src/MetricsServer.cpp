@@ -0,0 +1,70 @@
+#include <Metrics.h>
+#include <MetricsServer.h>
+#include <Trace.h>
+
+#include <QTcpSocket>
+
+using namespace dtls_pair_chat;
+
+MetricsServer::MetricsServer(QObject *parent)
+    : QObject{parent}
+{
+    connect(&m_server, &QTcpServer::newConnection, this, &MetricsServer::acceptConnections);
+}
+
+bool MetricsServer::listen(quint16 port)
+{
+    // Never reachable from the network, scrapers run on the same node.
+    if (!m_server.listen(QHostAddress::LocalHost, port)) {
+        qWarning() << "Metrics endpoint on port" << port << "failed:" << m_server.errorString();
+        return false;
+    }
+    return true;
+}
+
+quint16 MetricsServer::port() const
+{
+    return m_server.serverPort();
+}
+
+void MetricsServer::acceptConnections()
+{
+    while (QTcpSocket *socket = m_server.nextPendingConnection()) {
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket] {
+            // Only the request line matters, wait until the headers are complete.
+            if (!socket->peek(s_maxRequestSize).contains("\r\n\r\n")) {
+                if (socket->bytesAvailable() >= s_maxRequestSize)
+                    socket->abort();
+                return;
+            }
+            const QList<QByteArray> requestLine = socket->readLine().trimmed().split(' ');
+            QByteArray status{"200 OK"};
+            QByteArray contentType;
+            QByteArray body;
+            const QByteArray path = requestLine.size() == 3 ? requestLine.at(1) : QByteArray{};
+            if (requestLine.value(0) != "GET") {
+                status = "405 Method Not Allowed";
+            } else if (path == "/metrics") {
+                contentType = "text/plain; version=0.0.4; charset=utf-8";
+                body = Metrics::toPrometheusText();
+            } else if (path == "/metrics.json") {
+                contentType = "application/json";
+                body = Metrics::toJson();
+            } else if (path == "/trace.json") {
+                contentType = "application/json";
+                body = Trace::toChromeJson();
+            } else {
+                status = "404 Not Found";
+            }
+            QByteArray response = "HTTP/1.1 " + status + "\r\nConnection: close\r\n";
+            if (!contentType.isEmpty())
+                response += "Content-Type: " + contentType + "\r\n";
+            response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n\r\n" + body;
+            // One request per connection, the rest is not looked at.
+            QObject::disconnect(socket, &QTcpSocket::readyRead, nullptr, nullptr);
+            socket->write(response);
+            socket->disconnectFromHost();
+        });
+    }
+}
@@ -1,6 +1,11 @@
 #include <PasswordVerifier.h>
 #include <UdpMessage.h>
 
+#include <QMessageAuthenticationCode>
+#include <QPasswordDigestor>
+#include <QPromise>
+#include <QThreadPool>
+
 using namespace dtls_pair_chat;
 
 PasswordVerifier::PasswordVerifier(std::shared_ptr<UdpConnection> udpConnection,
@@ -15,6 +20,43 @@ PasswordVerifier::PasswordVerifier(std::shared_ptr<UdpConnection> udpConnection,
             &UdpConnection::messageReceived,
             this,
             &PasswordVerifier::messageReceived);
+    connect(&m_retransmitTimer, &BackoffTimer::timeout, this, &PasswordVerifier::retransmit);
+}
+
+QFuture<QByteArray> PasswordVerifier::derivePasswordKey(QStringView serverPassword,
+                                                       QStringView clientPassword)
+{
+    auto promise = std::make_shared<QPromise<QByteArray>>();
+    QFuture<QByteArray> future = promise->future();
+    promise->start();
+    QThreadPool::globalInstance()->start([promise,
+                                          server = serverPassword.toString(),
+                                          client = clientPassword.toString()] {
+        // Length prefixed, so that no other pair of passwords gives the same input.
+        QByteArray passwords;
+        for (const auto &password : {server, client}) {
+            const QByteArray utf8 = password.toUtf8();
+            passwords += QByteArray::number(utf8.size()) + ':' + utf8;
+        }
+        promise->addResult(QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha256,
+                                                              passwords,
+                                                              "dtls_pair_chat password key",
+                                                              s_keyDerivationIterations,
+                                                              s_preSharedKeySize));
+        promise->finish();
+    });
+    return future;
+}
+
+QByteArray PasswordVerifier::preSharedKey(const QByteArray &passwordKey, const QUuid &clientUuid)
+{
+    // HKDF-SHA256 (RFC 5869), one block of output is the whole key.
+    const QByteArray pseudoRandomKey = QMessageAuthenticationCode::hash(
+        passwordKey, "dtls_pair_chat psk " + clientUuid.toRfc4122(), QCryptographicHash::Sha256);
+    return QMessageAuthenticationCode::hash(QByteArrayLiteral("dtls_pair_chat psk\x01"),
+                                            pseudoRandomKey,
+                                            QCryptographicHash::Sha256)
+        .first(s_preSharedKeySize);
 }
 
 void PasswordVerifier::start()
@@ -24,9 +66,9 @@ void PasswordVerifier::start()
         return;
     }
     m_running = true;
-    // Send remote password to remote for verification
-    m_udpConnection->sendMessageToRemote(
-        UdpMessage{m_remotePassword, UdpMessage::Type::SendPassword});
+    // Send remote password to remote for verification, repeat until it is acknowledged.
+    sendPassword();
+    m_retransmitTimer.start();
     // We may have received password already, but wait as Ack can not have been received.
 }
 
@@ -34,10 +76,11 @@ void PasswordVerifier::messageReceived(const UdpMessage &receivedMessage)
 {
     switch (receivedMessage.type()) {
     case UdpMessage::Type::SendPassword: {
-        const bool passwordAccepted{receivedMessage.chatMsg() == m_localPassword};
+        const bool passwordAccepted{
+            QAnyStringView::compare(receivedMessage.chatText(), m_localPassword) == 0};
         m_received.setFlag(ReceivedMessage::Password);
         m_passwordsMatch = m_passwordsMatch && passwordAccepted;
-        // Send ack
+        // Send ack, also for repeated passwords as our previous ack may have been lost.
         if (passwordAccepted)
             m_udpConnection->sendMessageToRemote(UdpMessage{UdpMessage::PasswordState::Accepted});
         else
@@ -45,6 +88,7 @@ void PasswordVerifier::messageReceived(const UdpMessage &receivedMessage)
         tryFinalize();
     } break;
     case UdpMessage::Type::AckPassword:
+        m_retransmitTimer.stop();
         m_received.setFlag(ReceivedMessage::Ack);
         m_passwordsMatch = m_passwordsMatch && receivedMessage.accepted();
         tryFinalize();
@@ -55,14 +99,27 @@ void PasswordVerifier::messageReceived(const UdpMessage &receivedMessage)
     }
 }
 
+void PasswordVerifier::retransmit()
+{
+    if (m_running && !m_received.testFlag(ReceivedMessage::Ack))
+        sendPassword();
+    else
+        m_retransmitTimer.stop();
+}
+
+void PasswordVerifier::sendPassword()
+{
+    m_udpConnection->sendMessageToRemote(
+        UdpMessage{m_remotePassword, UdpMessage::Type::SendPassword});
+}
+
 void PasswordVerifier::tryFinalize()
 {
-    if (m_running && m_received.testFlags(ReceivedMessages{ReceivedMessage::Both})) {
-        // nothing left to do.
-        disconnect(m_udpConnection.get(),
-                   &UdpConnection::messageReceived,
-                   this,
-                   &PasswordVerifier::messageReceived);
+    if (m_running && !m_completed
+        && m_received.testFlags(ReceivedMessages{ReceivedMessage::Both})) {
+        /* Nothing left to do. Keep listening until this object is deleted, remote repeats
+         * its password until our ack gets through. */
+        m_completed = true;
         emit complete(m_passwordsMatch);
     }
 }
@@ -0,0 +1,214 @@
+#include <ReliableChannel.h>
+
+using namespace dtls_pair_chat;
+
+ReliableChannel::ReliableChannel()
+    : QObject{nullptr}
+{
+    m_retransmissionTimer.setSingleShot(true);
+    m_retransmissionTimer.setTimerType(Qt::TimerType::PreciseTimer);
+    connect(&m_retransmissionTimer,
+            &QTimer::timeout,
+            this,
+            &ReliableChannel::retransmissionTimeout);
+    m_acknowledgementTimer.setSingleShot(true);
+    m_acknowledgementTimer.setInterval(s_acknowledgementDelay);
+    connect(&m_acknowledgementTimer,
+            &QTimer::timeout,
+            this,
+            &ReliableChannel::sendAcknowledgement);
+}
+
+void ReliableChannel::send(UdpMessage message)
+{
+    const quint32 sequenceNumber = m_nextSequenceNumber++;
+    message.setSequenceNumber(sequenceNumber);
+    PendingMessage pending{message, {}, 1};
+    pending.sentAt.start();
+    m_unacknowledged.insert(sequenceNumber, std::move(pending));
+    m_statistics.sent++;
+    if (!m_retransmissionTimer.isActive())
+        restartRetransmissionTimer();
+    emit transmit(message);
+    emit statisticsChanged();
+}
+
+void ReliableChannel::piggybackAcknowledgement(UdpMessage &message)
+{
+    if (m_acknowledgementPending) {
+        message.setAcknowledgement(currentAcknowledgement());
+        m_acknowledgementPending = false;
+        m_acknowledgementTimer.stop();
+    }
+}
+
+QList<UdpMessage> ReliableChannel::receive(UdpMessage message)
+{
+    if (m_stalled) {
+        // Remote got through, so does our retransmission. No need to wait the backed off time.
+        m_stalled = false;
+        retransmitNow();
+    }
+    QList<UdpMessage> deliverable;
+    const auto acknowledgement = message.acknowledgement();
+    if (acknowledgement.has_value())
+        acknowledged(acknowledgement.value());
+    const auto sequenceNumber = message.sequenceNumber();
+    if (!sequenceNumber.has_value()) {
+        // Not reliably sent, e.g. a pure ack. Deliver anything but acks as is.
+        if (message.type() != UdpMessage::Type::Ack)
+            deliverable.append(std::move(message));
+        return deliverable;
+    }
+    // Acknowledge everything, also duplicates as our previous ack may have been lost.
+    m_acknowledgementPending = true;
+    if (!m_acknowledgementTimer.isActive())
+        m_acknowledgementTimer.start();
+
+    const quint32 received = sequenceNumber.value();
+    if (sequenceBefore(received, m_nextExpected) || m_reorderBuffer.contains(received)) {
+        m_statistics.duplicates++;
+    } else if (received == m_nextExpected) {
+        deliverable.append(std::move(message));
+        m_nextExpected++;
+        // Release whatever was waiting for this one.
+        for (auto next = m_reorderBuffer.find(m_nextExpected); next != m_reorderBuffer.end();
+             next = m_reorderBuffer.find(m_nextExpected)) {
+            deliverable.append(std::move(next.value()));
+            m_reorderBuffer.erase(next);
+            m_nextExpected++;
+        }
+    } else if (received - m_nextExpected < s_maxReorderBuffer) {
+        m_reorderBuffer.insert(received, std::move(message));
+        m_statistics.reordered++;
+    }
+    // else too far ahead to buffer, the remote will retransmit it.
+    m_statistics.received += deliverable.size();
+    emit statisticsChanged();
+    return deliverable;
+}
+
+ReliableChannel::Statistics ReliableChannel::statistics() const
+{
+    Statistics statistics{m_statistics};
+    statistics.unacknowledged = static_cast<int>(m_unacknowledged.size());
+    statistics.smoothedRtt = m_rttEstimator.smoothedRtt().value_or(std::chrono::milliseconds{0});
+    statistics.retransmissionTimeout = m_rttEstimator.retransmissionTimeout();
+    return statistics;
+}
+
+bool ReliableChannel::isStalled() const
+{
+    return m_stalled;
+}
+
+void ReliableChannel::retransmitNow()
+{
+    m_rttEstimator.resetBackoff();
+    for (auto &pending : m_unacknowledged) {
+        pending.transmissions++;
+        pending.sentAt.start();
+        m_statistics.retransmitted++;
+        emit transmit(pending.message);
+    }
+    if (!m_unacknowledged.isEmpty())
+        emit statisticsChanged();
+    restartRetransmissionTimer();
+}
+
+void ReliableChannel::retransmissionTimeout()
+{
+    if (m_unacknowledged.isEmpty())
+        return;
+    const qint64 timeoutMs = m_rttEstimator.retransmissionTimeout().count();
+    bool retransmitted{false};
+    bool stallReached{false};
+    for (auto &pending : m_unacknowledged) {
+        if (pending.sentAt.elapsed() >= timeoutMs) {
+            pending.transmissions++;
+            pending.sentAt.start();
+            m_statistics.retransmitted++;
+            retransmitted = true;
+            stallReached = stallReached || pending.transmissions >= s_stallTransmissions;
+            emit transmit(pending.message);
+        }
+    }
+    if (retransmitted) {
+        m_rttEstimator.backoff();
+        emit statisticsChanged();
+    }
+    restartRetransmissionTimer();
+    if (stallReached && !m_stalled) {
+        m_stalled = true;
+        emit stalled();
+    }
+}
+
+void ReliableChannel::sendAcknowledgement()
+{
+    if (m_acknowledgementPending) {
+        // Nothing was sent to carry the ack in time, send it on its own.
+        m_acknowledgementPending = false;
+        emit transmit(UdpMessage{currentAcknowledgement()});
+    }
+}
+
+bool ReliableChannel::sequenceBefore(quint32 first, quint32 second)
+{
+    // Serial number arithmetic, survives wrap around.
+    return static_cast<qint32>(first - second) < 0;
+}
+
+void ReliableChannel::acknowledged(const UdpMessage::Acknowledgement &acknowledgement)
+{
+    std::optional<std::chrono::milliseconds> rttSample;
+    const auto isAcknowledged = [&acknowledgement](quint32 sequenceNumber) {
+        if (sequenceBefore(sequenceNumber, acknowledgement.nextExpected))
+            return true;
+        const quint32 bit = sequenceNumber - acknowledgement.nextExpected - 1;
+        return bit < 32 && (acknowledgement.selective & (1u << bit));
+    };
+    for (auto it = m_unacknowledged.begin(); it != m_unacknowledged.end();) {
+        if (isAcknowledged(it.key())) {
+            // Karn's algorithm: retransmitted messages give ambiguous samples.
+            if (it->transmissions == 1)
+                rttSample = std::chrono::milliseconds{it->sentAt.elapsed()};
+            m_statistics.acknowledged++;
+            it = m_unacknowledged.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (rttSample.has_value()) {
+        m_rttEstimator.addSample(rttSample.value());
+        restartRetransmissionTimer();
+        emit statisticsChanged();
+    } else if (m_unacknowledged.isEmpty()) {
+        m_retransmissionTimer.stop();
+    }
+}
+
+void ReliableChannel::restartRetransmissionTimer()
+{
+    if (m_unacknowledged.isEmpty()) {
+        m_retransmissionTimer.stop();
+        return;
+    }
+    // Fire when the oldest transmission runs out of time.
+    const qint64 timeoutMs = m_rttEstimator.retransmissionTimeout().count();
+    qint64 nextMs{timeoutMs};
+    for (const auto &pending : std::as_const(m_unacknowledged))
+        nextMs = qMin(nextMs, timeoutMs - pending.sentAt.elapsed());
+    m_retransmissionTimer.start(std::chrono::milliseconds{qMax<qint64>(nextMs, 1)});
+}
+
+UdpMessage::Acknowledgement ReliableChannel::currentAcknowledgement() const
+{
+    UdpMessage::Acknowledgement acknowledgement{m_nextExpected, 0};
+    for (auto it = m_reorderBuffer.cbegin(); it != m_reorderBuffer.cend(); ++it) {
+        const quint32 bit = it.key() - m_nextExpected - 1;
+        if (bit < 32)
+            acknowledgement.selective |= 1u << bit;
+    }
+    return acknowledgement;
+}
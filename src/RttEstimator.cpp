@@ -0,0 +1,63 @@
+#include <RttEstimator.h>
+
+#include <QtGlobal>
+
+#include <cmath>
+
+using namespace dtls_pair_chat;
+
+// Gains from RFC 6298
+static constexpr double s_alpha{1.0 / 8.0};
+static constexpr double s_beta{1.0 / 4.0};
+
+void RttEstimator::addSample(std::chrono::milliseconds rtt)
+{
+    const double sampleMs = static_cast<double>(rtt.count());
+    if (m_smoothedRttMs.has_value()) {
+        m_rttVariationMs = (1.0 - s_beta) * m_rttVariationMs
+                           + s_beta * std::abs(m_smoothedRttMs.value() - sampleMs);
+        m_smoothedRttMs = (1.0 - s_alpha) * m_smoothedRttMs.value() + s_alpha * sampleMs;
+    } else {
+        m_smoothedRttMs = sampleMs;
+        m_rttVariationMs = sampleMs / 2.0;
+    }
+    updateTimeout();
+}
+
+void RttEstimator::backoff()
+{
+    m_timeout = qMin(m_timeout * 2, s_maximumTimeout);
+}
+
+void RttEstimator::resetBackoff()
+{
+    if (m_smoothedRttMs.has_value())
+        updateTimeout();
+    else
+        m_timeout = s_initialTimeout;
+}
+
+std::chrono::milliseconds RttEstimator::retransmissionTimeout() const
+{
+    return m_timeout;
+}
+
+std::optional<std::chrono::milliseconds> RttEstimator::smoothedRtt() const
+{
+    if (m_smoothedRttMs.has_value())
+        return std::chrono::milliseconds{qRound64(m_smoothedRttMs.value())};
+    else
+        return std::nullopt;
+}
+
+std::chrono::milliseconds RttEstimator::rttVariation() const
+{
+    return std::chrono::milliseconds{qRound64(m_rttVariationMs)};
+}
+
+void RttEstimator::updateTimeout()
+{
+    const auto timeout = std::chrono::milliseconds{
+        qRound64(m_smoothedRttMs.value() + 4.0 * m_rttVariationMs)};
+    m_timeout = qBound(s_minimumTimeout, timeout, s_maximumTimeout);
+}
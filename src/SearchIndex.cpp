@@ -0,0 +1,328 @@
+#include <SearchIndex.h>
+
+#include <QDebug>
+#include <QDir>
+#include <QtEndian>
+
+#include <algorithm>
+
+using namespace dtls_pair_chat;
+
+/* Postings file "search" in the history directory, all integers are big endian:
+ * offset 0: magic "DPCSRCH" and format version as quint8
+ * then batches, appended as messages are indexed:
+ *   offset 0: number of messages indexed after the batch as quint64
+ *   offset 8: size of the word records as quint32
+ *   offset 12: word records
+ * Word record, postings of one word added by the batch:
+ *   offset 0: word size as quint32
+ *   offset 4: case folded UTF-8 word
+ *   then: number of ids added as quint64, last id as quint64, deltas size as quint32, deltas
+ *         continuing those of the word before
+ */
+static const QByteArray s_fileHeader{"DPCSRCH\x01", 8};
+static constexpr qsizetype s_batchHeaderSize{12};
+static constexpr qsizetype s_recordFieldsSize{20}; // after the word
+
+SearchIndex::SearchIndex(QObject *parent)
+    : QObject{parent}
+{}
+
+template<typename F>
+void SearchIndex::forEachWord(QStringView text, F &&function)
+{
+    // Word is a run of letters and digits, everything else separates words.
+    qsizetype start{-1};
+    for (qsizetype i = 0; i <= text.size(); ++i) {
+        const bool wordCharacter = i < text.size() && text.at(i).isLetterOrNumber();
+        if (wordCharacter && start < 0) {
+            start = i;
+        } else if (!wordCharacter && start >= 0) {
+            function(start, i - start);
+            start = -1;
+        }
+    }
+}
+
+void SearchIndex::open(const QString &historyDirectory)
+{
+    QMetaObject::invokeMethod(
+        this, [this, historyDirectory] { openHistory(historyDirectory); }, Qt::QueuedConnection);
+}
+
+void SearchIndex::close()
+{
+    QMetaObject::invokeMethod(
+        this,
+        [this] {
+            m_history.reset();
+            m_postings.clear();
+            m_unsaved.clear();
+            m_file.close();
+            m_indexed = 0;
+        },
+        Qt::QueuedConnection);
+}
+
+void SearchIndex::historyAppended()
+{
+    QMetaObject::invokeMethod(this, &SearchIndex::indexPending, Qt::QueuedConnection);
+}
+
+quint64 SearchIndex::search(const QString &query)
+{
+    const quint64 requestId = ++m_latestRequest;
+    QMetaObject::invokeMethod(
+        this, [this, requestId, query] { runSearch(requestId, query); }, Qt::QueuedConnection);
+    return requestId;
+}
+
+void SearchIndex::openHistory(const QString &historyDirectory)
+{
+    m_history = std::make_unique<ChatHistory>(historyDirectory, ChatHistory::Mode::ReadOnly);
+    m_postings.clear();
+    m_unsaved.clear();
+    m_file.close();
+    m_indexed = 0;
+    if (!m_history->isValid()) {
+        m_history.reset();
+        return;
+    }
+    m_file.setFileName(QDir{historyDirectory}.filePath(QStringLiteral("search")));
+    if (m_file.open(QIODevice::ReadWrite))
+        loadPostings();
+    else
+        qWarning() << "Opening" << m_file.fileName() << "failed:" << m_file.errorString();
+    indexPending();
+}
+
+void SearchIndex::loadPostings()
+{
+    const QByteArray data = m_file.readAll();
+    qsizetype offset{0};
+    if (data.startsWith(s_fileHeader)) {
+        offset = s_fileHeader.size();
+        while (data.size() - offset >= s_batchHeaderSize) {
+            const auto *header = reinterpret_cast<const uchar *>(data.constData() + offset);
+            const quint64 indexed = qFromBigEndian<quint64>(header);
+            const quint32 size = qFromBigEndian<quint32>(header + 8);
+            if (data.size() - offset - s_batchHeaderSize < size)
+                break; // interrupted append, dropped below
+            if (indexed <= m_indexed || indexed > m_history->count()
+                || !loadBatch(QByteArrayView{data}.sliced(offset + s_batchHeaderSize, size))) {
+                // Not the index of this history, e.g. the history was removed meanwhile.
+                m_postings.clear();
+                m_indexed = 0;
+                offset = 0;
+                break;
+            }
+            m_indexed = indexed;
+            offset += s_batchHeaderSize + size;
+        }
+    }
+    if (offset == 0) {
+        // New or unusable, indexed again from the start.
+        if (!m_file.resize(0) || m_file.write(s_fileHeader) != s_fileHeader.size()) {
+            qWarning() << "Writing" << m_file.fileName() << "failed:" << m_file.errorString();
+            m_file.close();
+            return;
+        }
+        offset = s_fileHeader.size();
+    }
+    m_file.resize(offset);
+    m_file.seek(offset);
+}
+
+bool SearchIndex::loadBatch(QByteArrayView records)
+{
+    const auto *data = reinterpret_cast<const uchar *>(records.data());
+    qsizetype offset{0};
+    while (offset < records.size()) {
+        if (records.size() - offset < 4)
+            return false;
+        const quint32 wordSize = qFromBigEndian<quint32>(data + offset);
+        offset += 4;
+        if (records.size() - offset < wordSize + s_recordFieldsSize)
+            return false;
+        Postings &postings = m_postings[records.sliced(offset, wordSize).toByteArray()];
+        offset += wordSize;
+        const quint64 count = qFromBigEndian<quint64>(data + offset);
+        const quint64 last = qFromBigEndian<quint64>(data + offset + 8);
+        const quint32 deltasSize = qFromBigEndian<quint32>(data + offset + 16);
+        offset += s_recordFieldsSize;
+        if (records.size() - offset < deltasSize || (postings.count > 0 && last <= postings.last))
+            return false;
+        postings.deltas.append(records.sliced(offset, deltasSize));
+        postings.count += count;
+        postings.last = last;
+        offset += deltasSize;
+    }
+    return true;
+}
+
+void SearchIndex::savePostings()
+{
+    if (!m_file.isOpen()) {
+        m_unsaved.clear();
+        return;
+    }
+    QByteArray batch{s_batchHeaderSize, Qt::Uninitialized};
+    for (auto it = m_unsaved.cbegin(); it != m_unsaved.cend(); ++it) {
+        const Postings &postings = m_postings[it.key()];
+        const QByteArrayView deltas = QByteArrayView{postings.deltas}.sliced(it->deltasOffset);
+        uchar wordSize[4];
+        qToBigEndian<quint32>(static_cast<quint32>(it.key().size()), wordSize);
+        uchar fields[s_recordFieldsSize];
+        qToBigEndian<quint64>(postings.count - it->count, fields);
+        qToBigEndian<quint64>(postings.last, fields + 8);
+        qToBigEndian<quint32>(static_cast<quint32>(deltas.size()), fields + 16);
+        batch.append(reinterpret_cast<const char *>(wordSize), sizeof(wordSize));
+        batch.append(it.key());
+        batch.append(reinterpret_cast<const char *>(fields), s_recordFieldsSize);
+        batch.append(deltas);
+    }
+    m_unsaved.clear();
+    auto *header = reinterpret_cast<uchar *>(batch.data());
+    qToBigEndian<quint64>(m_indexed, header);
+    qToBigEndian<quint32>(static_cast<quint32>(batch.size() - s_batchHeaderSize), header + 8);
+    if (m_file.write(batch) != batch.size() || !m_file.flush()) {
+        // The next open drops the partial batch and indexes the rest again.
+        qWarning() << "Writing" << m_file.fileName() << "failed:" << m_file.errorString();
+        m_file.close();
+    }
+}
+
+void SearchIndex::indexPending()
+{
+    if (!m_history)
+        return;
+    m_history->refresh();
+    const quint64 end = qMin(m_history->count(), m_indexed + s_indexBatch);
+    if (m_indexed < end) {
+        for (; m_indexed < end; ++m_indexed) {
+            const auto record = m_history->read(m_indexed);
+            if (record.has_value())
+                addMessage(m_indexed, QString::fromUtf8(record->text));
+        }
+        savePostings();
+    }
+    // Existing history is indexed in batches, searches queued in between are answered from
+    // what has been indexed so far.
+    if (m_indexed < m_history->count())
+        QMetaObject::invokeMethod(this, &SearchIndex::indexPending, Qt::QueuedConnection);
+}
+
+void SearchIndex::addMessage(quint64 id, QStringView text)
+{
+    forEachWord(text, [this, id, text](qsizetype start, qsizetype length) {
+        const QByteArray word = normalized(text.sliced(start, length));
+        Postings &postings = m_postings[word];
+        if (postings.count > 0 && postings.last == id)
+            return; // word repeated in the same message
+        if (!m_unsaved.contains(word))
+            m_unsaved.insert(word, UnsavedPostings{postings.deltas.size(), postings.count});
+        // Unsigned LEB128: 7 bits per byte, high bit set when more bytes follow.
+        quint64 delta = id - postings.last;
+        while (delta >= 0x80) {
+            postings.deltas.append(static_cast<char>((delta & 0x7f) | 0x80));
+            delta >>= 7;
+        }
+        postings.deltas.append(static_cast<char>(delta));
+        postings.last = id;
+        postings.count++;
+    });
+}
+
+void SearchIndex::runSearch(quint64 requestId, const QString &query)
+{
+    if (requestId != m_latestRequest.load())
+        return; // user has typed more since
+    if (m_history)
+        m_history->refresh();
+    const bool complete = !m_history || m_indexed >= m_history->count();
+    QSet<QByteArray> words;
+    forEachWord(query, [&words, &query](qsizetype start, qsizetype length) {
+        words.insert(normalized(QStringView{query}.sliced(start, length)));
+    });
+    QList<Match> matches;
+    QList<const Postings *> lists;
+    for (const auto &word : std::as_const(words)) {
+        const auto it = m_postings.constFind(word);
+        if (it == m_postings.cend()) {
+            lists.clear();
+            break;
+        }
+        lists.append(&it.value());
+    }
+    if (m_history && !lists.isEmpty()) {
+        // Shortest list first keeps the intersections small.
+        std::sort(lists.begin(), lists.end(), [](const Postings *a, const Postings *b) {
+            return a->count < b->count;
+        });
+        QList<quint64> ids = decode(*lists.first());
+        for (qsizetype i = 1; i < lists.size() && !ids.isEmpty(); ++i) {
+            const QList<quint64> other = decode(*lists.at(i));
+            QList<quint64> common;
+            std::set_intersection(ids.cbegin(),
+                                  ids.cend(),
+                                  other.cbegin(),
+                                  other.cend(),
+                                  std::back_inserter(common));
+            ids = std::move(common);
+        }
+        for (auto it = ids.crbegin(); it != ids.crend() && matches.size() < s_maxMatches; ++it) {
+            const auto record = m_history->read(*it);
+            if (!record.has_value())
+                continue;
+            matches.append(Match{*it,
+                                 record->timestamp,
+                                 record->direction == ChatRecord::Direction::Incoming,
+                                 highlighted(QString::fromUtf8(record->text), words)});
+        }
+    }
+    emit searchFinished(requestId, matches, complete);
+}
+
+QList<quint64> SearchIndex::decode(const Postings &postings) const
+{
+    QList<quint64> ids;
+    ids.reserve(static_cast<qsizetype>(postings.count));
+    quint64 id{0};
+    quint64 delta{0};
+    int shift{0};
+    for (const char byte : postings.deltas) {
+        delta |= static_cast<quint64>(static_cast<uchar>(byte) & 0x7f) << shift;
+        if (static_cast<uchar>(byte) & 0x80) {
+            shift += 7;
+            continue;
+        }
+        id += delta;
+        ids.append(id);
+        delta = 0;
+        shift = 0;
+    }
+    return ids;
+}
+
+QString SearchIndex::highlighted(QStringView text, const QSet<QByteArray> &words) const
+{
+    QString result;
+    qsizetype position{0};
+    forEachWord(text, [&](qsizetype start, qsizetype length) {
+        const QStringView word{text.sliced(start, length)};
+        if (!words.contains(normalized(word)))
+            return;
+        result += text.sliced(position, start - position).toString().toHtmlEscaped();
+        result += QStringLiteral("<span style=\"background-color: #ffe066\">")
+                  + word.toString().toHtmlEscaped() + QStringLiteral("</span>");
+        position = start + length;
+    });
+    result += text.sliced(position).toString().toHtmlEscaped();
+    result.replace(QStringLiteral("\n"), QStringLiteral("<br/>"));
+    return result;
+}
+
+QByteArray SearchIndex::normalized(QStringView word)
+{
+    return word.toString().toCaseFolded().toUtf8();
+}
@@ -0,0 +1,150 @@
+#include <Trace.h>
+
+#include <QCoreApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+using namespace dtls_pair_chat;
+
+namespace {
+/* One event, guarded like a seqlock: the sequence is odd while the slot is written and
+ * tells which event it holds once done, so readers skip slots overwritten meanwhile. */
+struct Slot
+{
+    std::atomic<quint64> sequence;
+    std::atomic<quint64> meta; // event, thread and value packed
+    std::atomic<qint64> start;
+    std::atomic<qint64> duration; // negative for instant events
+};
+
+// Zero initialized, nothing runs before the first event is written.
+std::array<Slot, Trace::s_capacity> s_slots;
+std::atomic<quint64> s_nextEvent{0};
+std::atomic<quint32> s_nextThread{0};
+
+static_assert((Trace::s_capacity & (Trace::s_capacity - 1)) == 0, "capacity is a power of two");
+
+// Small numbers read better than native thread ids in the trace viewer.
+quint32 threadNumber()
+{
+    thread_local const quint32 number = s_nextThread.fetch_add(1, std::memory_order_relaxed);
+    return number;
+}
+
+void record(Trace::Event event, qint64 start, qint64 duration, quint32 value)
+{
+    const quint64 index = s_nextEvent.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = s_slots[index % Trace::s_capacity];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    const quint64 meta = (quint64{static_cast<quint8>(event)} << 56)
+                         | (quint64{threadNumber() & 0xFFFFFF} << 32) | value;
+    slot.meta.store(meta, std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.duration.store(duration, std::memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+QString eventName(Trace::Event event)
+{
+    switch (event) {
+    case Trace::Event::DatagramReceived:
+        return QStringLiteral("receive");
+    case Trace::Event::Decrypt:
+        return QStringLiteral("decrypt");
+    case Trace::Event::Parse:
+        return QStringLiteral("parse");
+    case Trace::Event::Emit:
+        return QStringLiteral("emit");
+    }
+    return QStringLiteral("unknown");
+}
+
+QString valueName(Trace::Event event)
+{
+    switch (event) {
+    case Trace::Event::DatagramReceived:
+    case Trace::Event::Decrypt:
+        return QStringLiteral("bytes");
+    case Trace::Event::Parse:
+        return QStringLiteral("type");
+    case Trace::Event::Emit:
+        return QStringLiteral("messages");
+    }
+    return QStringLiteral("value");
+}
+} // namespace
+
+qint64 Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void Trace::instant(Event event, quint32 value)
+{
+    record(event, now(), -1, value);
+}
+
+void Trace::complete(Event event, qint64 start, quint32 value)
+{
+    record(event, start, now() - start, value);
+}
+
+Trace::Scope::Scope(Event event, quint32 value)
+    : m_event{event}
+    , m_value{value}
+    , m_start{now()}
+{}
+
+Trace::Scope::~Scope()
+{
+    complete(m_event, m_start, m_value);
+}
+
+QByteArray Trace::toChromeJson()
+{
+    constexpr quint64 capacity{s_capacity};
+    const quint64 end = s_nextEvent.load(std::memory_order_acquire);
+    const quint64 begin = end > capacity ? end - capacity : 0;
+    const qint64 pid = QCoreApplication::applicationPid();
+    QJsonArray events;
+    for (quint64 index = begin; index < end; ++index) {
+        const Slot &slot = s_slots[index % capacity];
+        const quint64 sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * index + 2)
+            continue; // still being written, or overwritten by a newer event
+        const quint64 meta = slot.meta.load(std::memory_order_relaxed);
+        const qint64 start = slot.start.load(std::memory_order_relaxed);
+        const qint64 duration = slot.duration.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+            continue;
+        const auto event = static_cast<Event>(meta >> 56);
+        const QJsonObject args{{valueName(event), static_cast<qint64>(meta & 0xFFFFFFFF)}};
+        // Chrome wants microseconds.
+        QJsonObject object{{QStringLiteral("name"), eventName(event)},
+                           {QStringLiteral("cat"), QStringLiteral("dtls_pair_chat")},
+                           {QStringLiteral("ts"), static_cast<double>(start) / 1000.0},
+                           {QStringLiteral("pid"), pid},
+                           {QStringLiteral("tid"), static_cast<qint64>((meta >> 32) & 0xFFFFFF)},
+                           {QStringLiteral("args"), args}};
+        if (duration < 0) {
+            object.insert(QStringLiteral("ph"), QStringLiteral("i"));
+            object.insert(QStringLiteral("s"), QStringLiteral("t"));
+        } else {
+            object.insert(QStringLiteral("ph"), QStringLiteral("X"));
+            object.insert(QStringLiteral("dur"), static_cast<double>(duration) / 1000.0);
+        }
+        events.append(object);
+    }
+    return QJsonDocument{QJsonObject{{QStringLiteral("traceEvents"), events},
+                                     {QStringLiteral("displayTimeUnit"), QStringLiteral("ns")}}}
+        .toJson(QJsonDocument::Compact);
+}
@@ -1,127 +1,834 @@
+#include <Logging.h>
+#include <Metrics.h>
+#include <Trace.h>
 #include <UdpConnection.h>
 #include <UdpMessage.h>
+#include <UdpSocketDemux.h>
 
-#include <QNetworkDatagram>
+#include <QCoreApplication>
+#include <QPointer>
+#include <QSslCipher>
+#include <QSslConfiguration>
+#include <QSslPreSharedKeyAuthenticator>
+#include <QThread>
 #include <QUdpSocket>
 
 using namespace dtls_pair_chat;
 
-UdpConnection::UdpConnection(const QHostAddress &myAddress, const QHostAddress &remoteAddress)
+/* DTLS record content types are 20..25, plain setup messages start with XML or a magic byte.
+ * Lets late handshake retransmissions be told apart from DTLS handshake records. */
+static bool isDtlsRecord(QByteArrayView datagram)
+{
+    constexpr qsizetype dtlsRecordHeaderSize{13};
+    if (datagram.size() < dtlsRecordHeaderSize)
+        return false;
+    const auto contentType = static_cast<quint8>(datagram.front());
+    return contentType >= 20 && contentType <= 25;
+}
+
+// First flight of a new DTLS session: handshake record of epoch 0 carrying a client hello.
+static bool isDtlsClientHello(QByteArrayView datagram)
+{
+    constexpr qsizetype handshakeTypeOffset{13};
+    if (datagram.size() <= handshakeTypeOffset)
+        return false;
+    const auto byteAt = [datagram](qsizetype index) {
+        return static_cast<quint8>(datagram[index]);
+    };
+    constexpr quint8 handshakeContentType{22};
+    constexpr quint8 clientHelloType{1};
+    return byteAt(0) == handshakeContentType && byteAt(3) == 0 && byteAt(4) == 0
+           && byteAt(handshakeTypeOffset) == clientHelloType;
+}
+
+/* Client random of a client hello. Same in retransmissions and in the hello answering the
+ * cookie challenge, different for every new session. */
+static QByteArray dtlsClientRandom(QByteArrayView datagram)
+{
+    // record header, handshake header and client version come first
+    constexpr qsizetype randomOffset{13 + 12 + 2};
+    constexpr qsizetype randomSize{32};
+    if (!isDtlsClientHello(datagram) || datagram.size() < randomOffset + randomSize)
+        return {};
+    return datagram.sliced(randomOffset, randomSize).toByteArray();
+}
+
+// Probes and heartbeats measure the path. They travel alone, without acks piggybacked.
+static bool isPathMeasurement(UdpMessage::Type type)
+{
+    return type == UdpMessage::Type::MtuProbe || type == UdpMessage::Type::MtuProbeAck
+           || type == UdpMessage::Type::Heartbeat || type == UdpMessage::Type::HeartbeatAck;
+}
+
+// Application data of the previous session, still in flight while a new handshake runs.
+static bool isDtlsApplicationData(QByteArrayView datagram)
+{
+    constexpr quint8 applicationDataContentType{23};
+    return isDtlsRecord(datagram)
+           && static_cast<quint8>(datagram.front()) == applicationDataContentType;
+}
+
+// Pre-shared key cipher suites, those with forward secrecy first.
+static QList<QSslCipher> preSharedKeyCiphers()
+{
+    QList<QSslCipher> ephemeral;
+    QList<QSslCipher> plain;
+    for (const auto &cipher : QSslConfiguration::supportedCiphers()) {
+        const QString name = cipher.name();
+        if (name.startsWith(QLatin1String("ECDHE-PSK"))
+            || name.startsWith(QLatin1String("DHE-PSK"))) {
+            ephemeral.append(cipher);
+        } else if (name.contains(QLatin1String("PSK"))) {
+            plain.append(cipher);
+        }
+    }
+    return ephemeral + plain;
+}
+
+/* Network thread shared by all connections. Started with the first connection and stopped
+ * when the application object is destroyed. */
+static QThread *s_networkThread{nullptr};
+static QObject *s_networkContext{nullptr}; // lives in the network thread
+
+static void stopNetworkThread()
+{
+    s_networkThread->quit();
+    s_networkThread->wait();
+    delete s_networkContext;
+    delete s_networkThread;
+    s_networkContext = nullptr;
+    s_networkThread = nullptr;
+}
+
+// Runs the function in the network thread and waits until it is done.
+template<typename F>
+static void runInNetworkThread(F &&function)
+{
+    if (!s_networkThread || QThread::currentThread() == s_networkThread)
+        function();
+    else
+        QMetaObject::invokeMethod(s_networkContext,
+                                  std::forward<F>(function),
+                                  Qt::BlockingQueuedConnection);
+}
+
+// All connections together. Records written by QDtls itself, handshake and alerts, are not seen.
+static Metrics::Counter &s_datagramsSent{
+    Metrics::counter("dtls_pair_chat_datagrams_sent_total", "Message records sent.")};
+static Metrics::Counter &s_bytesSent{
+    Metrics::counter("dtls_pair_chat_sent_bytes_total",
+                     "Bytes of message records sent, before encryption.")};
+static Metrics::Counter &s_decryptFailures{
+    Metrics::counter("dtls_pair_chat_decrypt_failures_total",
+                     "Records of a secure session that could not be decrypted.")};
+static Metrics::Counter &s_unknownMessages{
+    Metrics::counter("dtls_pair_chat_unknown_messages_total",
+                     "Messages dropped because their content was not understood.")};
+
+// Worst case DTLS record overhead of the cipher suites in use (header, IV, MAC and padding)
+static constexpr qsizetype s_dtlsRecordOverhead{96};
+
+std::shared_ptr<UdpConnection> UdpConnection::create(const QHostAddress &myAddress,
+                                                     const QHostAddress &remoteAddress,
+                                                     quint16 remotePort,
+                                                     quint16 localPort)
+{
+    if (!s_networkThread) {
+        s_networkThread = new QThread;
+        s_networkThread->setObjectName(QStringLiteral("Network"));
+        s_networkContext = new QObject;
+        s_networkContext->moveToThread(s_networkThread);
+        s_networkThread->start();
+        qAddPostRoutine(stopNetworkThread);
+    }
+    UdpConnection *connection{nullptr};
+    runInNetworkThread([&] {
+        connection = new UdpConnection{myAddress, remoteAddress, remotePort, localPort};
+    });
+    // Deleted from the network context, never from an event of the connection itself.
+    return std::shared_ptr<UdpConnection>{connection, [](UdpConnection *connection) {
+        runInNetworkThread([connection] { delete connection; });
+    }};
+}
+
+UdpConnection::UdpConnection(const QHostAddress &myAddress,
+                             const QHostAddress &remoteAddress,
+                             quint16 remotePort,
+                             quint16 localPort)
     : QObject{nullptr}
-    , m_socket{new QUdpSocket()}
+    , m_demux{UdpSocketDemux::forLocalEnd(myAddress, localPort)}
+    , m_socket{m_demux->socket()}
     , m_myAddress{myAddress}
     , m_remoteAddress{remoteAddress}
+    , m_remotePort{remotePort}
 {
-    m_socket->bind(m_myAddress, s_chatPort);
-    connect(m_socket, &QUdpSocket::readyRead, this, &UdpConnection::readPendingMessage);
+    m_demux->addConnection({m_remoteAddress, m_remotePort}, this);
+    m_mtuProbeTimer.setInterval(std::chrono::seconds{1});
+    connect(&m_mtuProbeTimer, &QTimer::timeout, this, &UdpConnection::sendMtuProbes);
+    m_coalescingTimer.setSingleShot(true);
+    m_coalescingTimer.setTimerType(Qt::PreciseTimer);
+    m_coalescingTimer.setInterval(s_defaultCoalescingDelay);
+    connect(&m_coalescingTimer, &QTimer::timeout, this, &UdpConnection::flushCoalesced);
+    connect(&m_reliableChannel, &ReliableChannel::transmit, this, &UdpConnection::transmit);
+    connect(&m_reliableChannel,
+            &ReliableChannel::statisticsChanged,
+            this,
+            &UdpConnection::deliveryStatisticsChanged);
+    connect(&m_reliableChannel,
+            &ReliableChannel::stalled,
+            this,
+            &UdpConnection::reliableChannelStalled);
+    connect(&m_linkMonitor, &LinkMonitor::transmit, this, &UdpConnection::transmit);
+    connect(&m_linkMonitor,
+            &LinkMonitor::qualityChanged,
+            this,
+            &UdpConnection::linkQualityChanged);
+    connect(&m_linkMonitor, &LinkMonitor::peerDead, this, &UdpConnection::markConnectionLost);
+    connect(m_demux.get(),
+            &UdpSocketDemux::receiveQueueDropsChanged,
+            this,
+            &UdpConnection::receiveQueueDropsChanged);
 }
 
 UdpConnection::~UdpConnection()
 {
-    disconnect(m_socket, &QUdpSocket::readyRead, this, &UdpConnection::readPendingMessage);
-    if (m_dtlsConnection.get()) {
+    m_demux->removeConnection({m_remoteAddress, m_remotePort}, this);
+    flushCoalesced();
+    if (m_dtlsConnection.get() && m_dtlsConnection->isConnectionEncrypted()) {
         m_dtlsConnection->shutdown(m_socket);
     }
     m_dtlsConnection.reset();
-    // We may have unsent data, so use deleteLater()
-    m_socket->deleteLater();
+    // Socket is closed with the demultiplexer, once no connection uses it.
     m_socket = nullptr;
 }
 
 void UdpConnection::sendMessageToRemote(const UdpMessage &message)
 {
-    switch (m_state) {
-    case SecureState::Off:
-        m_socket->writeDatagram(message.toByteArray(), m_remoteAddress, s_chatPort);
-        break;
-    case SecureState::On:
-        m_dtlsConnection->writeDatagramEncrypted(m_socket, message.toByteArray());
-        break;
-    default:
-        qWarning() << "Attempt to send message in middle of handshake";
+    if (QThread::currentThread() != thread()) {
+        // One queued send at a time takes everything pushed until it runs.
+        m_outgoing.push(message);
+        if (!m_outgoingScheduled.exchange(true))
+            QMetaObject::invokeMethod(this, &UdpConnection::sendQueued, Qt::QueuedConnection);
+        return;
+    }
+    // While resuming, chat waits in the reliable channel until the session is secure again.
+    const bool resuming{m_sessionEstablished && m_encoding == UdpMessage::Encoding::Binary};
+    if ((reliableDeliveryActive() || resuming) && message.type() == UdpMessage::Type::Chat) {
+        // Gets a sequence number and comes back through transmit(), also when retransmitted.
+        m_reliableChannel.send(message);
+    } else {
+        transmit(message);
+    }
+}
+
+void UdpConnection::setChatQueueEnabled(bool enabled)
+{
+    m_chatQueueEnabled = enabled;
+}
+
+QList<UdpMessage> UdpConnection::takeChatMessages()
+{
+    // Cleared first, whatever is queued after this point signals again.
+    m_chatQueueSignalled = false;
+    QList<UdpMessage> messages;
+    while (auto message = m_chatQueue.pop())
+        messages.append(std::move(message.value()));
+    return messages;
+}
+
+void UdpConnection::setCoalescingDelay(std::chrono::milliseconds delay)
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this, delay] { setCoalescingDelay(delay); });
+        return;
     }
+    if (delay.count() <= 0)
+        flushCoalesced();
+    m_coalescingTimer.setInterval(delay);
+}
+
+void UdpConnection::setHeartbeatInterval(std::chrono::milliseconds interval)
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this, interval] { setHeartbeatInterval(interval); });
+        return;
+    }
+    m_linkMonitor.setInterval(interval);
+}
+
+void UdpConnection::setDeadPeerTimeout(std::chrono::milliseconds timeout)
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this, timeout] { setDeadPeerTimeout(timeout); });
+        return;
+    }
+    m_linkMonitor.setDeadPeerTimeout(timeout);
+}
+
+void UdpConnection::setPreSharedKey(const QByteArray &key)
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this, key] { setPreSharedKey(key); });
+        return;
+    }
+    m_preSharedKey = key;
 }
 
 void UdpConnection::switchToSecureConnection(const QUuid &clientUuid, bool isServer)
 {
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread(
+            [this, clientUuid, isServer] { switchToSecureConnection(clientUuid, isServer); });
+        return;
+    }
+    m_clientUuid = clientUuid;
+    m_isServer = isServer;
     if (isServer) {
-        m_dtlsConnection = std::make_unique<QDtls>(QSslSocket::SslMode::SslServerMode);
-        m_dtlsConnection->setPeer(m_remoteAddress, s_chatPort, clientUuid.toString());
-        // Wait until handshake from client
+        /* Wait until handshake from client. DTLS state is created only after the client
+         * has answered the cookie challenge. */
+        m_dtlsConnection.reset();
     } else {
-        m_dtlsConnection = std::make_unique<QDtls>(QSslSocket::SslMode::SslClientMode);
-        m_dtlsConnection->setPeer(m_remoteAddress, s_chatPort, clientUuid.toString());
+        createDtlsConnection(QSslSocket::SslMode::SslClientMode);
         // Send handshake to server and then wait handshake from server
         m_dtlsConnection->doHandshake(m_socket);
     }
     m_state = SecureState::Handshake;
+    // Saves the client a handshake retransmission timeout.
+    if (isServer && !m_earlyClientHello.isEmpty())
+        datagramReceived(std::exchange(m_earlyClientHello, {}));
+}
+
+void UdpConnection::resumeSecureConnection()
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this] { resumeSecureConnection(); });
+        return;
+    }
+    if (m_isServer || !m_sessionEstablished || !m_connectionLost)
+        return;
+    if (m_state == SecureState::Handshake && m_dtlsConnection.get()
+        && m_dtlsConnection->handshakeState() == QDtls::HandshakeState::HandshakeInProgress) {
+        return; // QDtls retransmits its flights on its own
+    }
+    if (m_state == SecureState::On)
+        leaveSecureState();
+    createDtlsConnection(QSslSocket::SslMode::SslClientMode);
+    if (!m_dtlsConnection->doHandshake(m_socket)) {
+        // Typically no route yet. Next call tries again.
+        qCDebug(lcSession) << "Resuming secure connection failed:"
+                           << m_dtlsConnection->dtlsErrorString();
+        m_dtlsConnection.reset();
+    }
+}
+
+void UdpConnection::setSupportedVersion(const QVersionNumber &version)
+{
+    if (QThread::currentThread() != thread()) {
+        runInNetworkThread([this, version] { setSupportedVersion(version); });
+        return;
+    }
+    m_supportedVersion = version;
+    // 1.0.x peers only understand XML, newer ones get the compact encoding.
+    m_encoding = UdpMessage::encodingForVersion(version);
+}
+
+std::optional<QVersionNumber> UdpConnection::supportedVersion() const
+{
+    return m_supportedVersion;
 }
 
-void UdpConnection::readPendingMessage()
+QHostAddress UdpConnection::remoteAddress() const
 {
-    QList<UdpMessage> receivedMessages;
-    std::optional<bool> secureMode;
-    while (m_socket->hasPendingDatagrams()) {
-        QNetworkDatagram datagram = m_socket->receiveDatagram();
-        if (datagram.senderAddress() != m_remoteAddress) {
-            qWarning() << "Message from unexpected sender ignored.";
-            continue;
+    return m_remoteAddress;
+}
+
+quint16 UdpConnection::remotePort() const
+{
+    return m_remotePort;
+}
+
+quint16 UdpConnection::pathMtu() const
+{
+    return m_pathMtu;
+}
+
+ReliableChannel::Statistics UdpConnection::deliveryStatistics() const
+{
+    ReliableChannel::Statistics statistics;
+    runInNetworkThread([&] { statistics = m_reliableChannel.statistics(); });
+    return statistics;
+}
+
+LinkMonitor::Quality UdpConnection::linkQuality() const
+{
+    LinkMonitor::Quality quality;
+    runInNetworkThread([&] { quality = m_linkMonitor.quality(); });
+    return quality;
+}
+
+quint32 UdpConnection::receiveQueueDrops() const
+{
+    return m_demux->receiveQueueDrops();
+}
+
+void UdpConnection::datagramReceived(const QByteArray &datagram)
+{
+    switch (m_state) {
+    case SecureState::Off:
+        if (isDtlsClientHello(datagram)) {
+            // Client went secure first, answered as soon as this end does.
+            m_earlyClientHello = datagram;
+            break;
         }
-        switch (m_state) {
-        case SecureState::Off: {
-            const UdpMessage receivedMessage{datagram.data()};
-            if (receivedMessage.type() == UdpMessage::Type::Unknown) {
-                qWarning() << "Message had invalid content, ignored.";
-                // Jump to next message
-                continue;
-            }
-            if (receivedMessage.type() == UdpMessage::Type::Chat) {
-                qWarning() << "Unsecured chat message ignored.";
-                // Jump to next message
-                continue;
-            }
-            qDebug() << "Received" << receivedMessage.typeAsString();
-            receivedMessages.append(receivedMessage);
-        } break;
-        case SecureState::Handshake: {
-            qDebug() << "Received DTLS handshake";
-            if (m_dtlsConnection->doHandshake(m_socket, datagram.data())) {
-                if (m_dtlsConnection->handshakeState() == QDtls::HandshakeState::HandshakeComplete) {
-                    m_state = SecureState::On;
-                    secureMode = true;
-                    // do not return, we might have received encrypted datagrams already
+        handlePayload(datagram);
+        break;
+    case SecureState::Handshake:
+        if (!isDtlsRecord(datagram)) {
+            // Remote retransmits its last setup message if our answer was lost.
+            handlePayload(datagram);
+            break;
+        }
+        if (m_sessionEstablished && isDtlsApplicationData(datagram)) {
+            // Sent by the remote before it noticed, the reliable channel sends it again.
+            qCDebug(lcDatagram) << "Data of previous secure session ignored.";
+            break;
+        }
+        qCDebug(lcSession) << "Received DTLS handshake";
+        if (m_isServer && isDtlsClientHello(datagram))
+            m_clientRandom = dtlsClientRandom(datagram);
+        if (!m_dtlsConnection.get()) {
+            // Server end, the client hello is answered with a cookie until verified.
+            if (!m_demux->verifyClient(datagram, {m_remoteAddress, m_remotePort}))
+                break;
+            createDtlsConnection(QSslSocket::SslMode::SslServerMode);
+        }
+        if (m_dtlsConnection->doHandshake(m_socket, datagram)) {
+            if (m_dtlsConnection->handshakeState() == QDtls::HandshakeState::HandshakeComplete) {
+                m_state = SecureState::On;
+                m_secureModeChange = true;
+                if (!m_isServer)
+                    m_sessionTicket = m_dtlsConnection->dtlsConfiguration().sessionTicket();
+                if (std::exchange(m_sessionEstablished, true)) {
+                    // Resumed, whatever waited for the new session goes out now.
+                    m_connectionLost = false;
+                    m_reliableChannel.retransmitNow();
                 }
-                // else keep shaking hands
-            } else {
-                m_state = SecureState::Off;
-                // emit dtlsError right away. Other signals are emitted at end of function.
-                emit dtlsError(m_dtlsConnection->dtlsError());
-                secureMode = false;
-                // if secure mode failed, we will shut down the socket anyway, but flush rest of the messages.
-                continue;
+                // do not return, we might have received encrypted datagrams already
+            }
+            // else keep shaking hands
+        } else {
+            // emit dtlsError right away. Other signals are emitted once all datagrams are read.
+            emit dtlsError(m_dtlsConnection->dtlsError());
+            if (m_sessionEstablished) {
+                // Resuming failed, nothing is sent until a new handshake succeeds.
+                m_dtlsConnection.reset();
+                break;
             }
-        } break;
-        default: // secure mode
+            m_state = SecureState::Off;
+            // if secure mode failed, we will shut down the socket anyway, but flush rest of the messages.
+            m_secureModeChange = false;
+        }
+        break;
+    default: // secure mode
+        if (!isDtlsRecord(datagram)) {
+            qCDebug(lcDatagram) << "Late unencrypted setup message ignored.";
+            break;
+        }
+        if (m_isServer && isDtlsClientHello(datagram)
+            && dtlsClientRandom(datagram) != m_clientRandom) {
+            /* Remote lost the session, e.g. after moving to another network, and starts anew.
+             * Late retransmissions of the current hello are no new session. The hello is
+             * answered with a stateless cookie challenge first, anyone can send one from the
+             * address of the remote. The session is kept unless the cookie comes back. */
+            if (!m_demux->verifyClient(datagram, {m_remoteAddress, m_remotePort}))
+                break;
+            qCDebug(lcSession) << "Remote resumes secure connection";
+            markConnectionLost();
+            leaveSecureState();
+            m_dtlsConnection.reset();
+            datagramReceived(datagram); // cookie challenge as for the first handshake
+            break;
+        }
         {
-            const UdpMessage receivedMessage{
-                m_dtlsConnection->decryptDatagram(m_socket, datagram.data())};
-            if (receivedMessage.type() == UdpMessage::Type::Unknown) {
-                qWarning() << "Encrypted message had invalid content, ignored.";
-                // Jump to next message
-                continue;
+            const qint64 decryptStart = Trace::now();
+            const QByteArray payload = m_dtlsConnection->decryptDatagram(m_socket, datagram);
+            Trace::complete(Trace::Event::Decrypt,
+                            decryptStart,
+                            static_cast<quint32>(payload.size()));
+            if (payload.isEmpty()
+                && m_dtlsConnection->dtlsError() == QDtlsError::RemoteClosedConnectionError) {
+                // Remote is gone for good, not a reason to reconnect.
+                emit dtlsError(QDtlsError::RemoteClosedConnectionError);
+                break;
             }
-            qDebug() << "Received encrypted" << receivedMessage.typeAsString();
-            receivedMessages.append(receivedMessage);
-        } break;
+            if (payload.isEmpty() && m_dtlsConnection->dtlsError() != QDtlsError::NoError)
+                s_decryptFailures.add();
+            handlePayload(payload);
         }
+        break;
     }
-    // Wait until all datagrams have been processed before emitting signals.
-    if (secureMode.has_value())
-    {
-        emit secureModeChanged(secureMode.value());
+}
+
+void UdpConnection::emitReceived()
+{
+    // Slots may close the connection, e.g. when the setup fails.
+    const QPointer<UdpConnection> alive{this};
+    if (m_secureModeChange.has_value()) {
+        const bool isSecure = m_secureModeChange.value();
+        m_secureModeChange.reset();
+        emit secureModeChanged(isSecure);
+        if (alive.isNull())
+            return;
+        // Peers that understand fragments also answer path MTU probes.
+        if (isSecure && m_encoding == UdpMessage::Encoding::Binary) {
+            m_mtuProbeRoundsLeft = s_mtuProbeRounds;
+            sendMtuProbes();
+        }
+        if (isSecure && heartbeatsActive())
+            m_linkMonitor.start();
+    }
+    // Slots may send, and receive more, while we emit. Take what we have so far.
+    QList<UdpMessage> receivedMessages = std::exchange(m_receivedMessages, {});
+    const Trace::Scope emitTrace{Trace::Event::Emit, static_cast<quint32>(receivedMessages.size())};
+    if (m_chatQueueEnabled) {
+        const qsizetype queued = receivedMessages.removeIf([this](const UdpMessage &message) {
+            if (message.type() != UdpMessage::Type::Chat)
+                return false;
+            m_chatQueue.push(message);
+            return true;
+        });
+        if (queued > 0 && !m_chatQueueSignalled.exchange(true)) {
+            emit chatMessagesQueued();
+            if (alive.isNull())
+                return;
+        }
     }
-    for (const auto& message : receivedMessages)
-    {
+    if (receivedMessages.isEmpty())
+        return;
+    // Consumers of bulk traffic take the whole batch, setup logic filters single messages.
+    emit messagesReceived(receivedMessages);
+    if (alive.isNull())
+        return;
+    for (const auto &message : receivedMessages) {
         emit messageReceived(message);
+        if (alive.isNull())
+            return;
     }
 }
+
+void UdpConnection::createDtlsConnection(QSslSocket::SslMode mode)
+{
+    m_dtlsConnection = std::make_unique<QDtls>(mode);
+    auto configuration = QSslConfiguration::defaultDtlsConfiguration();
+    // The client keeps the session ticket, so that a reconnect can skip the full handshake.
+    configuration.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (mode == QSslSocket::SslMode::SslClientMode && !m_sessionTicket.isEmpty())
+        configuration.setSessionTicket(m_sessionTicket);
+    if (!m_preSharedKey.isEmpty()) {
+        // The key alone authenticates both ends, there are no certificates to verify.
+        configuration.setCiphers(preSharedKeyCiphers());
+        configuration.setPeerVerifyMode(QSslSocket::VerifyNone);
+        connect(m_dtlsConnection.get(),
+                &QDtls::pskRequired,
+                this,
+                &UdpConnection::preSharedKeyRequired);
+    }
+    m_dtlsConnection->setDtlsConfiguration(configuration);
+    m_dtlsConnection->setPeer(m_remoteAddress, m_remotePort, m_clientUuid.toString());
+    m_dtlsConnection->setMtuHint(m_pathMtu);
+    connect(m_dtlsConnection.get(),
+            &QDtls::handshakeTimeout,
+            this,
+            &UdpConnection::dtlsHandshakeTimeout);
+}
+
+void UdpConnection::transmit(UdpMessage message)
+{
+    if (m_state == SecureState::Handshake && m_sessionEstablished) {
+        // Resuming. Chat is retransmitted by the reliable channel once secure again.
+        return;
+    }
+    // Answers to retransmitted setup messages are still sent unencrypted during the handshake.
+    if (m_state == SecureState::Handshake && message.type() != UdpMessage::Type::SendUuid
+        && message.type() != UdpMessage::Type::AckUuid) {
+        qWarning() << "Attempt to send message in middle of handshake";
+        return;
+    }
+    if (reliableDeliveryActive() && !isPathMeasurement(message.type()))
+        m_reliableChannel.piggybackAcknowledgement(message);
+    const QByteArray encoded = message.toByteArray(m_encoding, m_supportedVersion);
+    if (coalescingActive() && !isPathMeasurement(message.type())
+        && MessageCoalescer::fits(encoded, maxRecordSize(m_pathMtu))) {
+        if (!m_coalescer.add(encoded, maxRecordSize(m_pathMtu))) {
+            flushCoalesced();
+            m_coalescer.add(encoded, maxRecordSize(m_pathMtu));
+        }
+        // Delay is counted from the first message waiting, a burst does not postpone it.
+        if (!m_coalescingTimer.isActive())
+            m_coalescingTimer.start();
+        return;
+    }
+    flushCoalesced(); // keeps the order of messages
+    sendEncoded(encoded);
+}
+
+void UdpConnection::sendEncoded(const QByteArray &encoded)
+{
+    // 1.0.x peers can not reassemble, they get the message as one datagram like before.
+    if (m_encoding == UdpMessage::Encoding::Xml || encoded.size() <= maxRecordSize(m_pathMtu)) {
+        if (!writeRecord(encoded) && m_pathMtu > s_minimumPathMtu) {
+            // Path got narrower since it was probed, fall back to the safe size and retry.
+            pathMtuAcknowledged(s_minimumPathMtu);
+            sendEncoded(encoded);
+        }
+        return;
+    }
+    for (const auto &fragment : m_fragmenter.split(encoded, maxRecordSize(m_pathMtu))) {
+        if (!writeRecord(fragment)) {
+            if (m_pathMtu > s_minimumPathMtu) {
+                pathMtuAcknowledged(s_minimumPathMtu);
+                sendEncoded(encoded);
+            }
+            return;
+        }
+    }
+}
+
+void UdpConnection::flushCoalesced()
+{
+    m_coalescingTimer.stop();
+    if (!m_coalescer.isEmpty())
+        sendEncoded(m_coalescer.take());
+}
+
+void UdpConnection::sendQueued()
+{
+    m_outgoingScheduled = false;
+    while (auto message = m_outgoing.pop())
+        sendMessageToRemote(message.value());
+}
+
+void UdpConnection::reliableChannelStalled()
+{
+    markConnectionLost();
+}
+
+void UdpConnection::dtlsHandshakeTimeout()
+{
+    // A DTLS handshake flight was lost, QDtls retransmits it with its own backoff.
+    if (m_dtlsConnection.get() && m_state == SecureState::Handshake)
+        m_dtlsConnection->handleTimeout(m_socket);
+}
+
+void UdpConnection::preSharedKeyRequired(QSslPreSharedKeyAuthenticator *authenticator)
+{
+    // Both ends derive the same key for the session, the identity tells nothing more.
+    if (!m_isServer)
+        authenticator->setIdentity(QByteArrayLiteral("dtls_pair_chat"));
+    authenticator->setPreSharedKey(m_preSharedKey);
+}
+
+void UdpConnection::sendMtuProbes()
+{
+    if (m_state != SecureState::On || m_mtuProbeRoundsLeft <= 0) {
+        m_mtuProbeTimer.stop();
+        return;
+    }
+    m_mtuProbeRoundsLeft--;
+    /* Probes are padded so that the IP packet is exactly the probed size. Only probes that
+     * fit the path get through and acknowledged, the largest acknowledged one wins. They are
+     * the only datagrams sent unfragmented, the socket is shared with other peers. */
+    m_demux->setIpFragmentationAllowed(false);
+    for (const quint16 probedMtu : s_probedPathMtus) {
+        if (probedMtu <= m_pathMtu)
+            break;
+        constexpr qsizetype emptyProbeSize{12}; // binary header and the MTU field
+        const UdpMessage probe{UdpMessage::Type::MtuProbe,
+                               probedMtu,
+                               maxRecordSize(probedMtu) - emptyProbeSize};
+        const QByteArray encoded = probe.toByteArray(m_encoding, m_supportedVersion);
+        if (m_dtlsConnection->writeDatagramEncrypted(m_socket, encoded) >= 0) {
+            s_datagramsSent.add();
+            s_bytesSent.add(encoded.size());
+        }
+    }
+    m_demux->setIpFragmentationAllowed(true);
+    if (m_mtuProbeRoundsLeft > 0 && m_pathMtu < s_probedPathMtus[0])
+        m_mtuProbeTimer.start();
+    else
+        m_mtuProbeTimer.stop();
+}
+
+bool UdpConnection::writeRecord(const QByteArray &record)
+{
+    qint64 written{-1};
+    if (m_state == SecureState::On)
+        written = m_dtlsConnection->writeDatagramEncrypted(m_socket, record);
+    else
+        written = m_socket->writeDatagram(record, m_remoteAddress, m_remotePort);
+    if (written < 0) {
+        qWarning() << "Sending" << record.size() << "bytes failed:"
+                   << (m_state == SecureState::On ? m_dtlsConnection->dtlsErrorString()
+                                                  : m_socket->errorString());
+        // Too large is handled by the caller, anything else means there is no path right now.
+        if (m_state == SecureState::On
+            && m_socket->error() != QAbstractSocket::DatagramTooLargeError) {
+            markConnectionLost();
+        }
+        return false;
+    }
+    s_datagramsSent.add();
+    s_bytesSent.add(record.size());
+    return true;
+}
+
+void UdpConnection::leaveSecureState()
+{
+    flushCoalesced(); // still goes out with the old session
+    m_mtuProbeTimer.stop();
+    m_linkMonitor.stop();
+    m_state = SecureState::Handshake;
+}
+
+void UdpConnection::markConnectionLost()
+{
+    if (m_sessionEstablished && !m_connectionLost) {
+        m_connectionLost = true;
+        emit connectionLost();
+    }
+}
+
+void UdpConnection::handlePayload(const QByteArray &payload)
+{
+    const bool secure{m_state == SecureState::On};
+    if (secure && !payload.isEmpty()) {
+        // Anything decrypted proves the remote and the path alive.
+        m_linkMonitor.remoteActive();
+        if (m_connectionLost) {
+            m_connectionLost = false;
+            emit connectionRestored();
+        }
+    }
+    QByteArray messageData = payload;
+    if (MessageFragmenter::isFragment(payload)) {
+        // Only the authenticated remote gets to use reassembly memory.
+        if (!secure) {
+            qCDebug(lcDatagram) << "Unsecured message fragment ignored.";
+            return;
+        }
+        auto reassembled = m_fragmenter.reassemble(payload);
+        if (!reassembled.has_value())
+            return; // wait for the rest of the fragments
+        messageData = std::move(reassembled.value());
+    }
+    if (MessageCoalescer::isEnvelope(messageData)) {
+        // Packed messages are handled as if each had arrived alone, envelopes are never nested.
+        if (!secure) {
+            qCDebug(lcDatagram) << "Unsecured message envelope ignored.";
+            return;
+        }
+        for (const auto &packed : MessageCoalescer::unpack(messageData)) {
+            if (!MessageCoalescer::isEnvelope(packed))
+                handlePayload(packed);
+        }
+        return;
+    }
+    const qint64 parseStart = Trace::now();
+    UdpMessage receivedMessage{messageData, m_supportedVersion};
+    Trace::complete(Trace::Event::Parse, parseStart, static_cast<quint32>(receivedMessage.type()));
+    switch (receivedMessage.type()) {
+    case UdpMessage::Type::Unknown:
+        s_unknownMessages.add();
+        if (secure)
+            qCDebug(lcDatagram) << "Encrypted message had invalid content, ignored.";
+        else
+            qCDebug(lcDatagram) << "Message had invalid content, ignored.";
+        return;
+    case UdpMessage::Type::Chat:
+    case UdpMessage::Type::FileOffer:
+    case UdpMessage::Type::FileChunk:
+    case UdpMessage::Type::FileAck:
+    case UdpMessage::Type::FileCancel:
+        if (!secure) {
+            qCDebug(lcDatagram) << "Unsecured" << receivedMessage.typeAsString()
+                                << "message ignored.";
+            return;
+        }
+        break;
+    case UdpMessage::Type::MtuProbe:
+        // Probes are answered here, they are of no interest to anyone else.
+        if (secure) {
+            sendMessageToRemote(
+                UdpMessage{UdpMessage::Type::MtuProbeAck, receivedMessage.pathMtu()});
+        }
+        return;
+    case UdpMessage::Type::MtuProbeAck:
+        if (secure && receivedMessage.pathMtu() > m_pathMtu)
+            pathMtuAcknowledged(receivedMessage.pathMtu());
+        return;
+    case UdpMessage::Type::Heartbeat:
+        // Answered right away, the remote measures the round trip from it.
+        if (secure) {
+            sendMessageToRemote(UdpMessage{UdpMessage::Type::HeartbeatAck,
+                                           receivedMessage.heartbeatNumber()});
+        }
+        return;
+    case UdpMessage::Type::HeartbeatAck:
+        if (secure)
+            m_linkMonitor.answerReceived(receivedMessage.heartbeatNumber());
+        return;
+    default:
+        break;
+    }
+    if (reliableDeliveryActive()) {
+        // Acks are consumed here, chat messages are released in sequence order.
+        for (auto &deliverable : m_reliableChannel.receive(std::move(receivedMessage))) {
+            qCDebug(lcDatagram) << "Received encrypted" << deliverable.typeAsString();
+            m_receivedMessages.append(std::move(deliverable));
+        }
+        return;
+    }
+    if (secure)
+        qCDebug(lcDatagram) << "Received encrypted" << receivedMessage.typeAsString();
+    else
+        qCDebug(lcDatagram) << "Received" << receivedMessage.typeAsString();
+    m_receivedMessages.append(std::move(receivedMessage));
+}
+
+bool UdpConnection::reliableDeliveryActive() const
+{
+    // Sequence numbers and acks only exist in the binary encoding.
+    return m_state == SecureState::On && m_encoding == UdpMessage::Encoding::Binary;
+}
+
+bool UdpConnection::heartbeatsActive() const
+{
+    return reliableDeliveryActive() && m_supportedVersion.has_value()
+           && UdpMessage::heartbeatSupported(m_supportedVersion.value());
+}
+
+bool UdpConnection::coalescingActive() const
+{
+    return reliableDeliveryActive() && m_coalescingTimer.interval() > 0
+           && m_supportedVersion.has_value()
+           && UdpMessage::coalescingSupported(m_supportedVersion.value());
+}
+
+void UdpConnection::pathMtuAcknowledged(quint16 pathMtu)
+{
+    m_pathMtu = pathMtu;
+    if (m_dtlsConnection.get())
+        m_dtlsConnection->setMtuHint(pathMtu);
+    if (m_pathMtu >= s_probedPathMtus[0])
+        m_mtuProbeTimer.stop();
+    emit pathMtuChanged(m_pathMtu);
+}
+
+qsizetype UdpConnection::maxRecordSize(quint16 pathMtu) const
+{
+    // IP and UDP headers
+    qsizetype overhead{m_remoteAddress.protocol() == QAbstractSocket::IPv6Protocol ? 48 : 28};
+    if (m_state != SecureState::Off)
+        overhead += s_dtlsRecordOverhead;
+    return pathMtu - overhead;
+}
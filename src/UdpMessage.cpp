@@ -1,12 +1,27 @@
+#include <MessageFragmenter.h>
+#include <PayloadCompressor.h>
 #include <UdpMessage.h>
 
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
+#include <QtEndian>
 
 using namespace dtls_pair_chat;
 
 // Message version
-static constexpr auto s_versionString = QLatin1String{"1.0.0"};
+static constexpr auto s_versionString = QLatin1String{"1.6.0"};
+// First version able to read binary encoded messages
+static constexpr int s_binaryMinorVersion{1};
+// First version able to transfer files
+static constexpr int s_fileTransferMinorVersion{2};
+// First version able to unpack coalesced messages
+static constexpr int s_coalescingMinorVersion{3};
+// First version able to read compressed bodies
+static constexpr int s_compressionMinorVersion{4};
+// First version able to answer heartbeats
+static constexpr int s_heartbeatMinorVersion{5};
+// First version proving passwords with a pre-shared key handshake
+static constexpr int s_preSharedKeyMinorVersion{6};
 
 // XML Elements
 static constexpr auto s_xmlId_payload = QLatin1String{"DTLSCHATPAYLOAD"};
@@ -21,50 +36,152 @@ static constexpr auto s_xmlId_sendPassword = QLatin1String{"SENDPASSWORD"};
 static constexpr auto s_xmlAttrId_version = QLatin1String{"version"};
 static constexpr auto s_xmlAttrId_accepted = QLatin1String{"accepted"};
 
-std::optional<QVersionNumber> UdpMessage::s_supportedVersion;
+/* Binary encoding, all integers are big endian:
+ * offset 0: magic byte (never the first byte of an XML document)
+ * offset 1: type tag (UdpMessage::Type)
+ * offset 2: version major, minor and micro, one byte each
+ * offset 5: flags, each set flag adds an extension field between header and body
+ * offset 6: length of the rest (extensions and body) as quint32
+ * offset 10: extensions, in flag bit order
+ *   sequence number flag:  sequence number as quint32
+ *   acknowledgement flag:  next expected sequence number and selective ack bits, quint32 each
+ *   compressed flag:       no field, the body is a zstd frame (see PayloadCompressor)
+ * after extensions: body
+ *   SendUuid:              sender UUID as 16 raw bytes
+ *   AckUuid:               sender UUID and payload UUID as 16 raw bytes each
+ *   AckPassword:           one byte, non-zero if accepted
+ *   Chat and SendPassword: UTF-8 text
+ *   MtuProbe:              probed path MTU as quint16 followed by zero padding
+ *   MtuProbeAck:           acknowledged path MTU as quint16
+ *   FileOffer:             transfer id as quint32, file size as quint64, chunk size as quint32
+ *                          and the file name as UTF-8 text
+ *   FileChunk:             transfer id and chunk index as quint32 followed by chunk data
+ *   FileAck:               transfer id, next expected chunk index and selective ack bits,
+ *                          quint32 each
+ *   FileCancel:            transfer id as quint32
+ *   Heartbeat:             heartbeat number as quint32
+ *   HeartbeatAck:          answered heartbeat number as quint32
+ */
+static constexpr quint8 s_binaryMagic{0xDC};
+static constexpr qsizetype s_binaryHeaderSize{10};
+static constexpr qsizetype s_binaryUuidSize{16};
+static constexpr quint8 s_binaryFlag_sequenceNumber{0x01};
+static constexpr quint8 s_binaryFlag_acknowledgement{0x02};
+static constexpr quint8 s_binaryFlag_compressed{0x04};
+static constexpr quint8 s_binaryFlags_known{s_binaryFlag_sequenceNumber
+                                            | s_binaryFlag_acknowledgement
+                                            | s_binaryFlag_compressed};
 
 UdpMessage::UdpMessage(const QUuid &uuidToUse)
     : m_senderUuid{uuidToUse}
     , m_type{Type::SendUuid}
-    , m_msgVersion{QVersionNumber::fromString(s_versionString)}
+    , m_msgVersion{localVersion()}
 {}
 
 UdpMessage::UdpMessage(const QUuid &uuidOfSender, const QUuid &receiverUuid)
     : m_payloadUuid{receiverUuid}
     , m_senderUuid{uuidOfSender}
     , m_type{Type::AckUuid}
-    , m_msgVersion{QVersionNumber::fromString(s_versionString)}
+    , m_msgVersion{localVersion()}
 {}
 
 UdpMessage::UdpMessage(PasswordState state)
     : m_type{Type::AckPassword}
     , m_accepted{state == PasswordState::Accepted}
-    , m_msgVersion{QVersionNumber::fromString(s_versionString)}
+    , m_msgVersion{localVersion()}
 {}
 
 UdpMessage::UdpMessage(QStringView payload, Type messageType)
     : m_type{messageType}
     , m_chatMsg{payload.toString()}
-    , m_msgVersion{QVersionNumber::fromString(s_versionString)}
+    , m_msgVersion{localVersion()}
 {
     Q_ASSERT(!payload.isEmpty());
     Q_ASSERT(messageType == Type::Chat || messageType == Type::SendPassword);
 }
 
-UdpMessage::UdpMessage(QByteArrayView receivedMessage)
+UdpMessage::UdpMessage(Type messageType, quint16 pathMtu, qsizetype padding)
+    : m_type{messageType}
+    , m_pathMtu{pathMtu}
+    , m_padding{padding}
+    , m_msgVersion{localVersion()}
+{
+    Q_ASSERT(messageType == Type::MtuProbe || messageType == Type::MtuProbeAck);
+}
+
+UdpMessage::UdpMessage(const Acknowledgement &acknowledgement)
+    : m_type{Type::Ack}
+    , m_acknowledgement{acknowledgement}
+    , m_msgVersion{localVersion()}
+{}
+
+UdpMessage::UdpMessage(quint32 transferId,
+                       quint64 fileSize,
+                       quint32 chunkSize,
+                       QStringView fileName)
+    : m_type{Type::FileOffer}
+    , m_chatMsg{fileName.toString()}
+    , m_transferId{transferId}
+    , m_fileSize{fileSize}
+    , m_chunkSize{chunkSize}
+    , m_msgVersion{localVersion()}
+{
+    Q_ASSERT(!fileName.isEmpty());
+}
+
+UdpMessage::UdpMessage(quint32 transferId, quint32 chunkIndex, const QByteArray &data)
+    : m_type{Type::FileChunk}
+    , m_transferId{transferId}
+    , m_chunkIndex{chunkIndex}
+    , m_fileData{data}
+    , m_msgVersion{localVersion()}
+{
+    Q_ASSERT(!data.isEmpty());
+}
+
+UdpMessage::UdpMessage(quint32 transferId, const Acknowledgement &acknowledgement)
+    : m_type{Type::FileAck}
+    , m_transferId{transferId}
+    , m_fileAcknowledgement{acknowledgement}
+    , m_msgVersion{localVersion()}
+{}
+
+UdpMessage::UdpMessage(quint32 transferId)
+    : m_type{Type::FileCancel}
+    , m_transferId{transferId}
+    , m_msgVersion{localVersion()}
+{}
+
+UdpMessage::UdpMessage(Type messageType, quint32 heartbeatNumber)
+    : m_type{messageType}
+    , m_heartbeatNumber{heartbeatNumber}
+    , m_msgVersion{localVersion()}
 {
-    QXmlStreamReader reader{receivedMessage.toByteArray()};
+    Q_ASSERT(messageType == Type::Heartbeat || messageType == Type::HeartbeatAck);
+}
+
+UdpMessage::UdpMessage(const QByteArray &receivedMessage,
+                       const std::optional<QVersionNumber> &supportedVersion)
+    : m_received{receivedMessage}
+{
+    if (!m_received.isEmpty() && static_cast<quint8>(m_received.front()) == s_binaryMagic)
+        parseBinary(supportedVersion);
+    else
+        parseXml(supportedVersion);
+}
+
+void UdpMessage::parseXml(const std::optional<QVersionNumber> &supportedVersion)
+{
+    QXmlStreamReader reader{m_received};
     if (!reader.atEnd()) {
         reader.readNext();
         if (!reader.atEnd() && reader.isStartDocument()) {
             reader.readNextStartElement();
             if (!reader.atEnd() && reader.name() == s_xmlId_payload) {
-                const auto version = QVersionNumber::fromString(
-                    reader.attributes().value(s_xmlAttrId_version));
-                if (!version.isNull())
-                    m_msgVersion = version;
+                m_msgVersion = parseVersion(reader.attributes().value(s_xmlAttrId_version));
                 // Until handhake is done, we allow versionless messages.
-                if (!s_supportedVersion.has_value() || versionAccepted(m_msgVersion)) {
+                if (!supportedVersion.has_value()
+                    || versionAccepted(m_msgVersion, supportedVersion.value())) {
                     if (!reader.atEnd() && reader.readNextStartElement()) {
                         if (reader.name() == s_xmlId_chatMsg) {
                             m_chatMsg = reader.readElementText();
@@ -74,8 +191,8 @@ UdpMessage::UdpMessage(QByteArrayView receivedMessage)
                             m_type = Type::SendPassword;
                         } else if (reader.name() == s_xmlId_ackPassword) {
                             m_accepted = reader.attributes().value(s_xmlAttrId_accepted)
-                                         == QStringLiteral("true");
-                            m_type = Type::SendPassword;
+                                         == QLatin1String{"true"};
+                            m_type = Type::AckPassword;
                         } else if (reader.name() == s_xmlId_ackUuid) {
                             if (!reader.atEnd()) {
                                 bool elementFound{false};
@@ -102,72 +219,344 @@ UdpMessage::UdpMessage(QByteArrayView receivedMessage)
     }
 }
 
-std::optional<QVersionNumber> UdpMessage::supportedVersion()
+void UdpMessage::parseBinary(const std::optional<QVersionNumber> &supportedVersion)
 {
-    return s_supportedVersion;
+    if (m_received.size() < s_binaryHeaderSize)
+        return;
+    const auto *header = reinterpret_cast<const quint8 *>(m_received.constData());
+    const quint32 bodyLength = qFromBigEndian<quint32>(header + 6);
+    if (bodyLength != static_cast<quint32>(m_received.size() - s_binaryHeaderSize))
+        return;
+    m_msgVersion = QVersionNumber{header[2], header[3], header[4]};
+    // Until handhake is done, we allow any version.
+    if (supportedVersion.has_value() && !versionAccepted(m_msgVersion, supportedVersion.value()))
+        return;
+    const quint8 flags = header[5];
+    if (flags & ~s_binaryFlags_known)
+        return; // extension fields of unknown size
+    qsizetype offset{s_binaryHeaderSize};
+    if (flags & s_binaryFlag_sequenceNumber) {
+        if (m_received.size() < offset + 4)
+            return;
+        m_sequenceNumber = qFromBigEndian<quint32>(header + offset);
+        offset += 4;
+    }
+    if (flags & s_binaryFlag_acknowledgement) {
+        if (m_received.size() < offset + 8)
+            return;
+        m_acknowledgement = Acknowledgement{qFromBigEndian<quint32>(header + offset),
+                                            qFromBigEndian<quint32>(header + offset + 4)};
+        offset += 8;
+    }
+    if (flags & s_binaryFlag_compressed) {
+        // Only once negotiated, before that anyone can send datagrams that look like ours.
+        if (!supportedVersion.has_value() || !compressionSupported(supportedVersion.value()))
+            return;
+        // Body is replaced with the decompressed one, offsets into the buffer stay the same.
+        const auto decompressed = PayloadCompressor::decompress(
+            QByteArrayView{m_received}.sliced(offset), MessageFragmenter::maxMessageSize());
+        if (!decompressed.has_value())
+            return;
+        m_received = m_received.first(offset) + decompressed.value();
+        header = reinterpret_cast<const quint8 *>(m_received.constData());
+    }
+    const QByteArrayView body = QByteArrayView{m_received}.sliced(offset);
+    switch (static_cast<Type>(header[1])) {
+    case Type::SendUuid:
+        if (body.size() == s_binaryUuidSize) {
+            m_senderUuid = QUuid::fromRfc4122(body);
+            if (!m_senderUuid.isNull())
+                m_type = Type::SendUuid;
+        }
+        break;
+    case Type::AckUuid:
+        if (body.size() == 2 * s_binaryUuidSize) {
+            m_senderUuid = QUuid::fromRfc4122(body.first(s_binaryUuidSize));
+            m_payloadUuid = QUuid::fromRfc4122(body.sliced(s_binaryUuidSize));
+            if (!m_payloadUuid.isNull() && !m_senderUuid.isNull())
+                m_type = Type::AckUuid;
+        }
+        break;
+    case Type::AckPassword:
+        if (body.size() == 1) {
+            m_accepted = body.front() != 0;
+            m_type = Type::AckPassword;
+        }
+        break;
+    case Type::SendPassword:
+    case Type::Chat:
+        if (!body.isEmpty()) {
+            // Text stays in the received buffer until someone asks for a QString.
+            m_payloadOffset = offset;
+            m_payloadSize = body.size();
+            m_type = static_cast<Type>(header[1]);
+        }
+        break;
+    case Type::MtuProbe:
+    case Type::MtuProbeAck:
+        if (body.size() >= 2) {
+            m_pathMtu = qFromBigEndian<quint16>(body.data());
+            m_type = static_cast<Type>(header[1]);
+        }
+        break;
+    case Type::Ack:
+        if (m_acknowledgement.has_value())
+            m_type = Type::Ack;
+        break;
+    case Type::FileOffer:
+        if (body.size() > 16) {
+            m_transferId = qFromBigEndian<quint32>(body.data());
+            m_fileSize = qFromBigEndian<quint64>(body.data() + 4);
+            m_chunkSize = qFromBigEndian<quint32>(body.data() + 12);
+            m_payloadOffset = offset + 16;
+            m_payloadSize = body.size() - 16;
+            if (m_chunkSize > 0)
+                m_type = Type::FileOffer;
+        }
+        break;
+    case Type::FileChunk:
+        if (body.size() > 8) {
+            m_transferId = qFromBigEndian<quint32>(body.data());
+            m_chunkIndex = qFromBigEndian<quint32>(body.data() + 4);
+            // Chunk data stays in the received buffer, it is written to file from there.
+            m_payloadOffset = offset + 8;
+            m_payloadSize = body.size() - 8;
+            m_type = Type::FileChunk;
+        }
+        break;
+    case Type::FileAck:
+        if (body.size() == 12) {
+            m_transferId = qFromBigEndian<quint32>(body.data());
+            m_fileAcknowledgement = Acknowledgement{qFromBigEndian<quint32>(body.data() + 4),
+                                                    qFromBigEndian<quint32>(body.data() + 8)};
+            m_type = Type::FileAck;
+        }
+        break;
+    case Type::FileCancel:
+        if (body.size() == 4) {
+            m_transferId = qFromBigEndian<quint32>(body.data());
+            m_type = Type::FileCancel;
+        }
+        break;
+    case Type::Heartbeat:
+    case Type::HeartbeatAck:
+        if (body.size() == 4) {
+            m_heartbeatNumber = qFromBigEndian<quint32>(body.data());
+            m_type = static_cast<Type>(header[1]);
+        }
+        break;
+    default:
+        break;
+    }
 }
 
-void UdpMessage::resetSupportedVersion()
+const QVersionNumber &UdpMessage::localVersion()
 {
-    s_supportedVersion = std::nullopt;
+    static const QVersionNumber version{QVersionNumber::fromString(s_versionString)};
+    return version;
 }
 
-void UdpMessage::setSupportedVersion(const QVersionNumber &version)
+std::optional<QVersionNumber> UdpMessage::msgVersion() const
 {
-    s_supportedVersion = version;
+    return m_msgVersion;
 }
 
-QVersionNumber UdpMessage::localVersion()
+UdpMessage::Encoding UdpMessage::encodingForVersion(const QVersionNumber &version)
 {
-    return QVersionNumber::fromString(s_versionString);
+    if (version.majorVersion() > 1 || version.minorVersion() >= s_binaryMinorVersion)
+        return Encoding::Binary;
+    else
+        return Encoding::Xml;
 }
 
-std::optional<QVersionNumber> UdpMessage::msgVersion() const
+bool UdpMessage::fileTransferSupported(const QVersionNumber &version)
 {
-    return m_msgVersion;
+    return version.majorVersion() > 1 || version.minorVersion() >= s_fileTransferMinorVersion;
+}
+
+bool UdpMessage::coalescingSupported(const QVersionNumber &version)
+{
+    return version.majorVersion() > 1 || version.minorVersion() >= s_coalescingMinorVersion;
 }
 
-QByteArray UdpMessage::toByteArray() const
+bool UdpMessage::compressionSupported(const QVersionNumber &version)
+{
+    return version.majorVersion() > 1 || version.minorVersion() >= s_compressionMinorVersion;
+}
+
+bool UdpMessage::heartbeatSupported(const QVersionNumber &version)
+{
+    return version.majorVersion() > 1 || version.minorVersion() >= s_heartbeatMinorVersion;
+}
+
+bool UdpMessage::preSharedKeySupported(const QVersionNumber &version)
+{
+    return version.majorVersion() > 1 || version.minorVersion() >= s_preSharedKeyMinorVersion;
+}
+
+qsizetype UdpMessage::maxChatTextSize()
+{
+    constexpr qsizetype extensionsSize{4 + 8}; // sequence number and acknowledgement
+    return MessageFragmenter::maxMessageSize() - s_binaryHeaderSize - extensionsSize;
+}
+
+QByteArray UdpMessage::toByteArray(Encoding encoding,
+                                   const std::optional<QVersionNumber> &version) const
+{
+    if (m_type == Type::Unknown)
+        return {};
+    else if (encoding == Encoding::Binary)
+        return toBinary(version);
+    else
+        return toXml(version);
+}
+
+QByteArray UdpMessage::toXml(const std::optional<QVersionNumber> &version) const
 {
     QByteArray returnValue;
-    if (m_type != Type::Unknown) {
-        QXmlStreamWriter writer{&returnValue};
-        writer.setAutoFormatting(true);
-        writer.writeStartDocument();
-        writer.writeStartElement(s_xmlId_payload);
-        if (s_supportedVersion.has_value())
-            writer.writeAttribute(s_xmlAttrId_version, s_supportedVersion->toString());
+    QXmlStreamWriter writer{&returnValue};
+    writer.setAutoFormatting(true);
+    writer.writeStartDocument();
+    writer.writeStartElement(s_xmlId_payload);
+    if (version.has_value() && version.value() != localVersion())
+        writer.writeAttribute(s_xmlAttrId_version, version->toString());
+    else
+        writer.writeAttribute(s_xmlAttrId_version, s_versionString);
+    switch (m_type) {
+    case Type::Chat:
+        writer.writeTextElement(s_xmlId_chatMsg, m_chatMsg);
+        break;
+    case Type::AckUuid:
+        writer.writeStartElement(s_xmlId_ackUuid);
+        writer.writeTextElement(s_xmlId_senderId, m_senderUuid.toString());
+        writer.writeTextElement(s_xmlId_payloadId, m_payloadUuid.toString());
+        writer.writeEndElement(); //s_xml_ackUuid
+        break;
+    case Type::SendUuid:
+        writer.writeTextElement(s_xmlId_sendUuid, m_senderUuid.toString());
+        break;
+    case Type::SendPassword:
+        writer.writeTextElement(s_xmlId_sendPassword, m_chatMsg);
+        break;
+    case Type::AckPassword:
+        writer.writeEmptyElement(s_xmlId_ackPassword);
+        if (m_accepted)
+            writer.writeAttribute(s_xmlAttrId_accepted, QStringLiteral("true"));
         else
-            writer.writeAttribute(s_xmlAttrId_version, s_versionString);
-        switch (m_type) {
-        case Type::Chat:
-            writer.writeTextElement(s_xmlId_chatMsg, m_chatMsg);
-            break;
-        case Type::AckUuid:
-            writer.writeStartElement(s_xmlId_ackUuid);
-            writer.writeTextElement(s_xmlId_senderId, m_senderUuid.toString());
-            writer.writeTextElement(s_xmlId_payloadId, m_payloadUuid.toString());
-            writer.writeEndElement(); //s_xml_ackUuid
-            break;
-        case Type::SendUuid:
-            writer.writeTextElement(s_xmlId_sendUuid, m_senderUuid.toString());
-            break;
-        case Type::SendPassword:
-            writer.writeTextElement(s_xmlId_sendPassword, m_chatMsg);
-            break;
-        case Type::AckPassword:
-            writer.writeEmptyElement(s_xmlId_ackPassword);
-            if (m_accepted)
-                writer.writeAttribute(s_xmlAttrId_accepted, QStringLiteral("true"));
-            else
-                writer.writeAttribute(s_xmlAttrId_accepted, QStringLiteral("false"));
-            break;
-        default:
-            break;
+            writer.writeAttribute(s_xmlAttrId_accepted, QStringLiteral("false"));
+        break;
+    default:
+        break;
+    }
+    writer.writeEndElement(); // s_xml_payloadId
+    writer.writeEndDocument();
+    return returnValue;
+}
+
+QByteArray UdpMessage::toBinary(const std::optional<QVersionNumber> &messageVersion) const
+{
+    const QVersionNumber &version = messageVersion.has_value() ? messageVersion.value()
+                                                               : localVersion();
+    QByteArray body;
+    switch (m_type) {
+    case Type::Chat:
+    case Type::SendPassword:
+        if (m_payloadSize > 0)
+            body = m_received.sliced(m_payloadOffset, m_payloadSize);
+        else
+            body = m_chatMsg.toUtf8();
+        break;
+    case Type::AckUuid:
+        body = m_senderUuid.toRfc4122() + m_payloadUuid.toRfc4122();
+        break;
+    case Type::SendUuid:
+        body = m_senderUuid.toRfc4122();
+        break;
+    case Type::AckPassword:
+        body.append(m_accepted ? '\x01' : '\x00');
+        break;
+    case Type::MtuProbe:
+    case Type::MtuProbeAck:
+        body.resize(2 + m_padding, '\0');
+        qToBigEndian<quint16>(m_pathMtu, body.data());
+        break;
+    case Type::FileOffer: {
+        const QByteArray fileName = m_payloadSize > 0
+                                        ? m_received.sliced(m_payloadOffset, m_payloadSize)
+                                        : m_chatMsg.toUtf8();
+        body.resize(16);
+        qToBigEndian<quint32>(m_transferId, body.data());
+        qToBigEndian<quint64>(m_fileSize, body.data() + 4);
+        qToBigEndian<quint32>(m_chunkSize, body.data() + 12);
+        body.append(fileName);
+    } break;
+    case Type::FileChunk: {
+        const QByteArrayView data = fileData();
+        body.reserve(8 + data.size());
+        body.resize(8);
+        qToBigEndian<quint32>(m_transferId, body.data());
+        qToBigEndian<quint32>(m_chunkIndex, body.data() + 4);
+        body.append(data);
+    } break;
+    case Type::FileAck:
+        body.resize(12);
+        qToBigEndian<quint32>(m_transferId, body.data());
+        qToBigEndian<quint32>(m_fileAcknowledgement.nextExpected, body.data() + 4);
+        qToBigEndian<quint32>(m_fileAcknowledgement.selective, body.data() + 8);
+        break;
+    case Type::FileCancel:
+        body.resize(4);
+        qToBigEndian<quint32>(m_transferId, body.data());
+        break;
+    case Type::Heartbeat:
+    case Type::HeartbeatAck:
+        body.resize(4);
+        qToBigEndian<quint32>(m_heartbeatNumber, body.data());
+        break;
+    default:
+        break;
+    }
+    quint8 flags{0};
+    /* Only once negotiated. Probes are sized exactly, they must not shrink. File data is
+     * mostly compressed already, compressing every chunk would cost more than it saves. */
+    if (messageVersion.has_value() && compressionSupported(version)
+        && m_type != Type::MtuProbe && m_type != Type::MtuProbeAck && m_type != Type::FileChunk
+        && body.size() >= PayloadCompressor::thresholdSize()
+        && body.size() <= MessageFragmenter::maxMessageSize()) { // the receiver's limit
+        auto compressed = PayloadCompressor::compress(body);
+        if (compressed.has_value() && compressed->size() < body.size()) {
+            body = std::move(compressed.value());
+            flags |= s_binaryFlag_compressed;
         }
-        writer.writeEndElement(); // s_xml_payloadId
-        writer.writeEndDocument();
     }
+    qsizetype extensionsSize{0};
+    if (m_sequenceNumber.has_value()) {
+        flags |= s_binaryFlag_sequenceNumber;
+        extensionsSize += 4;
+    }
+    if (m_acknowledgement.has_value()) {
+        flags |= s_binaryFlag_acknowledgement;
+        extensionsSize += 8;
+    }
+    QByteArray returnValue{s_binaryHeaderSize + extensionsSize, Qt::Uninitialized};
+    auto *header = reinterpret_cast<quint8 *>(returnValue.data());
+    header[0] = s_binaryMagic;
+    header[1] = static_cast<quint8>(m_type);
+    header[2] = static_cast<quint8>(version.majorVersion());
+    header[3] = static_cast<quint8>(version.minorVersion());
+    header[4] = static_cast<quint8>(version.microVersion());
+    header[5] = flags;
+    qToBigEndian<quint32>(static_cast<quint32>(extensionsSize + body.size()), header + 6);
+    auto *extension = header + s_binaryHeaderSize;
+    if (m_sequenceNumber.has_value()) {
+        qToBigEndian<quint32>(m_sequenceNumber.value(), extension);
+        extension += 4;
+    }
+    if (m_acknowledgement.has_value()) {
+        qToBigEndian<quint32>(m_acknowledgement->nextExpected, extension);
+        qToBigEndian<quint32>(m_acknowledgement->selective, extension + 4);
+    }
+    returnValue.append(body);
     return returnValue;
 }
 
@@ -186,9 +575,17 @@ UdpMessage::Type UdpMessage::type() const
     return m_type;
 }
 
+QAnyStringView UdpMessage::chatText() const
+{
+    if (m_payloadSize > 0)
+        return QUtf8StringView{m_received.constData() + m_payloadOffset, m_payloadSize};
+    else
+        return m_chatMsg;
+}
+
 QString UdpMessage::chatMsg() const
 {
-    return m_chatMsg;
+    return chatText().toString();
 }
 
 bool UdpMessage::accepted() const
@@ -196,6 +593,74 @@ bool UdpMessage::accepted() const
     return m_accepted;
 }
 
+quint16 UdpMessage::pathMtu() const
+{
+    return m_pathMtu;
+}
+
+quint32 UdpMessage::heartbeatNumber() const
+{
+    return m_heartbeatNumber;
+}
+
+quint32 UdpMessage::transferId() const
+{
+    return m_transferId;
+}
+
+quint64 UdpMessage::fileSize() const
+{
+    return m_fileSize;
+}
+
+quint32 UdpMessage::chunkSize() const
+{
+    return m_chunkSize;
+}
+
+quint32 UdpMessage::chunkIndex() const
+{
+    return m_chunkIndex;
+}
+
+QString UdpMessage::fileName() const
+{
+    return chatMsg();
+}
+
+QByteArrayView UdpMessage::fileData() const
+{
+    if (m_payloadSize > 0)
+        return QByteArrayView{m_received}.sliced(m_payloadOffset, m_payloadSize);
+    else
+        return m_fileData;
+}
+
+UdpMessage::Acknowledgement UdpMessage::fileAcknowledgement() const
+{
+    return m_fileAcknowledgement;
+}
+
+std::optional<quint32> UdpMessage::sequenceNumber() const
+{
+    return m_sequenceNumber;
+}
+
+void UdpMessage::setSequenceNumber(quint32 sequenceNumber)
+{
+    m_sequenceNumber = sequenceNumber;
+}
+
+std::optional<UdpMessage::Acknowledgement> UdpMessage::acknowledgement() const
+{
+    return m_acknowledgement;
+}
+
+void UdpMessage::setAcknowledgement(const Acknowledgement &acknowledgement)
+{
+    m_acknowledgement = acknowledgement;
+}
+
 QString UdpMessage::typeAsString() const
 {
     switch (type()) {
@@ -209,6 +674,24 @@ QString UdpMessage::typeAsString() const
         return QStringLiteral("AckPassword");
     case Type::Chat:
         return QStringLiteral("Chat");
+    case Type::MtuProbe:
+        return QStringLiteral("MtuProbe");
+    case Type::MtuProbeAck:
+        return QStringLiteral("MtuProbeAck");
+    case Type::Ack:
+        return QStringLiteral("Ack");
+    case Type::FileOffer:
+        return QStringLiteral("FileOffer");
+    case Type::FileChunk:
+        return QStringLiteral("FileChunk");
+    case Type::FileAck:
+        return QStringLiteral("FileAck");
+    case Type::FileCancel:
+        return QStringLiteral("FileCancel");
+    case Type::Heartbeat:
+        return QStringLiteral("Heartbeat");
+    case Type::HeartbeatAck:
+        return QStringLiteral("HeartbeatAck");
     case Type::Unknown:
         return QStringLiteral("Unknown");
     default:
@@ -216,9 +699,22 @@ QString UdpMessage::typeAsString() const
     }
 }
 
-bool UdpMessage::versionAccepted(const std::optional<QVersionNumber> &receivedVersion)
+bool UdpMessage::versionAccepted(const std::optional<QVersionNumber> &receivedVersion,
+                                 const QVersionNumber &supportedVersion)
+{
+    return receivedVersion.has_value()
+           && receivedVersion->majorVersion() == supportedVersion.majorVersion()
+           && receivedVersion->minorVersion() <= supportedVersion.minorVersion();
+}
+
+std::optional<QVersionNumber> UdpMessage::parseVersion(QStringView versionString)
 {
-    return receivedVersion.has_value() && s_supportedVersion.has_value()
-           && receivedVersion->majorVersion() == s_supportedVersion->majorVersion()
-           && receivedVersion->minorVersion() <= s_supportedVersion->minorVersion();
+    // Nearly every message carries the local version, avoid parsing it.
+    if (versionString == s_versionString)
+        return localVersion();
+    const auto version = QVersionNumber::fromString(versionString);
+    if (version.isNull())
+        return std::nullopt;
+    else
+        return version;
 }
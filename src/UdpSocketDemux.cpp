@@ -0,0 +1,278 @@
+#include <Logging.h>
+#include <Metrics.h>
+#include <Trace.h>
+#include <UdpConnection.h>
+#include <UdpSocketDemux.h>
+
+#include <QPointer>
+#include <QSet>
+#include <QUdpSocket>
+
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+using namespace dtls_pair_chat;
+
+// All sockets together
+static Metrics::Counter &s_datagramsReceived{
+    Metrics::counter("dtls_pair_chat_datagrams_received_total", "Datagrams read from sockets.")};
+static Metrics::Counter &s_bytesReceived{
+    Metrics::counter("dtls_pair_chat_received_bytes_total", "Bytes of datagrams read.")};
+static Metrics::Counter &s_unexpectedSenders{
+    Metrics::counter("dtls_pair_chat_unexpected_sender_datagrams_total",
+                     "Datagrams ignored because no session exists with the sender.")};
+static Metrics::Counter &s_receiveQueueDrops{
+    Metrics::counter("dtls_pair_chat_receive_queue_drops_total",
+                     "Datagrams dropped by the kernel because a receive queue was full.")};
+
+/* Without fragmentation the don't fragment bit is set, datagrams larger than the path MTU fail
+ * or get dropped instead of being fragmented on IP level. With it, the kernel default, they
+ * are fragmented where needed. */
+static void setIpFragmentation(QUdpSocket *socket, bool allowed)
+{
+#ifdef Q_OS_LINUX
+    const int descriptor = static_cast<int>(socket->socketDescriptor());
+    const int value{allowed ? IP_PMTUDISC_WANT : IP_PMTUDISC_DO};
+    if (socket->localAddress().protocol() == QAbstractSocket::IPv6Protocol)
+        ::setsockopt(descriptor, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value, sizeof(value));
+    else
+        ::setsockopt(descriptor, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+#else
+    Q_UNUSED(socket)
+    Q_UNUSED(allowed)
+#endif
+}
+
+// Kernel counts datagrams dropped for a full receive queue and reports it with every datagram.
+static void enableDropCounter(QUdpSocket *socket)
+{
+#ifdef Q_OS_LINUX
+    const int value{1};
+    ::setsockopt(static_cast<int>(socket->socketDescriptor()),
+                 SOL_SOCKET,
+                 SO_RXQ_OVFL,
+                 &value,
+                 sizeof(value));
+#else
+    Q_UNUSED(socket)
+#endif
+}
+
+// Sockets in use, by local end. Connections are created and used in the network thread only.
+static QHash<UdpSocketDemux::Peer, std::weak_ptr<UdpSocketDemux>> &openSockets()
+{
+    static QHash<UdpSocketDemux::Peer, std::weak_ptr<UdpSocketDemux>> sockets;
+    return sockets;
+}
+
+std::shared_ptr<UdpSocketDemux> UdpSocketDemux::forLocalEnd(const QHostAddress &address,
+                                                            quint16 port)
+{
+    const Peer localEnd{address, port};
+    auto demux = openSockets().value(localEnd).lock();
+    if (!demux.get()) {
+        demux = std::shared_ptr<UdpSocketDemux>{new UdpSocketDemux{address, port}};
+        openSockets().insert(localEnd, demux);
+    }
+    return demux;
+}
+
+UdpSocketDemux::UdpSocketDemux(const QHostAddress &address, quint16 port)
+    : QObject{nullptr}
+    , m_socket{new QUdpSocket()}
+    , m_localEnd{address, port}
+{
+    if (!m_socket->bind(address, port))
+        qWarning() << "Binding" << address << port << "failed:" << m_socket->errorString();
+    enableDropCounter(m_socket);
+    connect(m_socket, &QUdpSocket::readyRead, this, &UdpSocketDemux::readPendingDatagrams);
+}
+
+UdpSocketDemux::~UdpSocketDemux()
+{
+    auto &sockets = openSockets();
+    const auto registered = sockets.constFind(m_localEnd);
+    if (registered != sockets.cend() && registered->expired())
+        sockets.erase(registered);
+    disconnect(m_socket, &QUdpSocket::readyRead, this, &UdpSocketDemux::readPendingDatagrams);
+    // We may have unsent data, so use deleteLater()
+    m_socket->deleteLater();
+    m_socket = nullptr;
+}
+
+QUdpSocket *UdpSocketDemux::socket() const
+{
+    return m_socket;
+}
+
+void UdpSocketDemux::addConnection(const Peer &peer, UdpConnection *connection)
+{
+    if (m_connections.contains(peer))
+        qWarning() << "Replacing connection to" << peer.address << peer.port;
+    m_connections.insert(peer, connection);
+}
+
+void UdpSocketDemux::removeConnection(const Peer &peer, UdpConnection *connection)
+{
+    const auto registered = m_connections.constFind(peer);
+    if (registered != m_connections.cend() && registered.value() == connection)
+        m_connections.erase(registered);
+}
+
+qsizetype UdpSocketDemux::connectionCount() const
+{
+    return m_connections.size();
+}
+
+bool UdpSocketDemux::verifyClient(const QByteArray &clientHello, const Peer &peer)
+{
+    if (m_clientVerifier.verifyClient(m_socket, clientHello, peer.address, peer.port))
+        return true;
+    if (m_clientVerifier.dtlsError() != QDtlsError::NoError)
+        qWarning() << "Client verification failed:" << m_clientVerifier.dtlsErrorString();
+    return false;
+}
+
+void UdpSocketDemux::setIpFragmentationAllowed(bool allowed)
+{
+    setIpFragmentation(m_socket, allowed);
+}
+
+quint32 UdpSocketDemux::receiveQueueDrops() const
+{
+    return m_receiveQueueDrops;
+}
+
+void UdpSocketDemux::readPendingDatagrams()
+{
+    // Slots of the connections may close them, keep the socket alive until done.
+    const auto self = shared_from_this();
+    QList<QPointer<UdpConnection>> receivers;
+    QSet<UdpConnection *> seenReceivers;
+    const auto receive = [&](const QByteArray &datagram, const Peer &sender) {
+        Trace::instant(Trace::Event::DatagramReceived, static_cast<quint32>(datagram.size()));
+        s_datagramsReceived.add();
+        s_bytesReceived.add(datagram.size());
+        UdpConnection *connection = m_connections.value(sender);
+        if (!connection) {
+            s_unexpectedSenders.add();
+            qCDebug(lcDatagram) << "Message from unexpected sender ignored.";
+            return;
+        }
+        connection->datagramReceived(datagram);
+        if (!seenReceivers.contains(connection)) {
+            seenReceivers.insert(connection);
+            receivers.append(connection);
+        }
+    };
+    while (m_socket->hasPendingDatagrams()) {
+        /* Read straight into a buffer owned by the message, received messages share it
+         * instead of copying the payload out of a QNetworkDatagram. */
+        QByteArray datagram{m_socket->pendingDatagramSize(), Qt::Uninitialized};
+        Peer sender;
+        const qint64 datagramSize = m_socket->readDatagram(datagram.data(),
+                                                           datagram.size(),
+                                                           &sender.address,
+                                                           &sender.port);
+        if (datagramSize < 0)
+            break;
+        datagram.truncate(datagramSize);
+        receive(datagram, sender);
+        /* QUdpSocket only re-arms its read notification when it reads a datagram itself, so
+         * the first one of a burst is read above and the rest in batches. */
+        if (readBatches(receive))
+            break;
+    }
+    // Wait until all datagrams have been processed before emitting signals.
+    for (const auto &connection : std::as_const(receivers)) {
+        if (!connection.isNull())
+            connection->emitReceived();
+    }
+}
+
+bool UdpSocketDemux::readBatches(
+    const std::function<void(const QByteArray &, const Peer &)> &receive)
+{
+#ifdef Q_OS_LINUX
+    if (m_batchBuffers.isEmpty())
+        m_batchBuffers.resize(s_batchSize * s_maxDatagramSize);
+    struct Entry
+    {
+        sockaddr_storage address;
+        iovec vector;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(quint32))];
+    };
+    Entry entries[s_batchSize];
+    mmsghdr headers[s_batchSize];
+    const int descriptor = static_cast<int>(m_socket->socketDescriptor());
+    forever {
+        for (int i = 0; i < s_batchSize; ++i) {
+            entries[i].vector = {m_batchBuffers.data() + i * s_maxDatagramSize, s_maxDatagramSize};
+            std::memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = &entries[i].address;
+            headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            headers[i].msg_hdr.msg_iov = &entries[i].vector;
+            headers[i].msg_hdr.msg_iovlen = 1;
+            headers[i].msg_hdr.msg_control = entries[i].control;
+            headers[i].msg_hdr.msg_controllen = sizeof(entries[i].control);
+        }
+        const int count = ::recvmmsg(descriptor, headers, s_batchSize, MSG_DONTWAIT, nullptr);
+        if (count < 0)
+            return errno != ENOSYS; // otherwise nothing is queued or the socket failed
+        for (int i = 0; i < count; ++i) {
+            const msghdr &header = headers[i].msg_hdr;
+            for (cmsghdr *control = CMSG_FIRSTHDR(&header); control;
+                 control = CMSG_NXTHDR(const_cast<msghdr *>(&header), control)) {
+                if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SO_RXQ_OVFL)
+                    continue;
+                quint32 drops{0};
+                std::memcpy(&drops, CMSG_DATA(control), sizeof(drops));
+                if (drops != m_receiveQueueDrops) {
+                    // Wraps like the kernel's count does
+                    const quint32 dropped = drops - m_receiveQueueDrops;
+                    s_receiveQueueDrops.add(dropped);
+                    qCDebug(lcDatagram) << "Receive queue overflowed," << dropped
+                                        << "datagrams dropped";
+                    m_receiveQueueDrops = drops;
+                    emit receiveQueueDropsChanged(drops);
+                }
+            }
+            if (header.msg_flags & MSG_TRUNC) {
+                qCDebug(lcDatagram) << "Oversized datagram ignored.";
+                continue;
+            }
+            Peer sender;
+            const auto *address = reinterpret_cast<const sockaddr *>(&entries[i].address);
+            sender.address.setAddress(address);
+            if (address->sa_family == AF_INET6)
+                sender.port = ntohs(reinterpret_cast<const sockaddr_in6 *>(address)->sin6_port);
+            else
+                sender.port = ntohs(reinterpret_cast<const sockaddr_in *>(address)->sin_port);
+            receive(QByteArray{static_cast<const char *>(entries[i].vector.iov_base),
+                               static_cast<qsizetype>(headers[i].msg_len)},
+                    sender);
+        }
+        if (count < s_batchSize)
+            return true;
+    }
+#else
+    Q_UNUSED(receive)
+    return false;
+#endif
+}
+
+bool dtls_pair_chat::operator==(const UdpSocketDemux::Peer &first,
+                                const UdpSocketDemux::Peer &second)
+{
+    return first.port == second.port && first.address == second.address;
+}
+
+size_t dtls_pair_chat::qHash(const UdpSocketDemux::Peer &peer, size_t seed)
+{
+    return qHashMulti(seed, peer.address, peer.port);
+}
@@ -1,3 +1,5 @@
+#include <MetricsServer.h>
+
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
 
@@ -5,6 +7,12 @@ int main(int argc, char *argv[])
 {
     QGuiApplication app(argc, argv);
 
+    // Optional scrape endpoint for monitoring, see README.
+    dtls_pair_chat::MetricsServer metricsServer;
+    const int metricsPort = qEnvironmentVariableIntValue("DTLS_PAIR_CHAT_METRICS_PORT");
+    if (metricsPort > 0 && metricsPort <= 0xFFFF)
+        metricsServer.listen(static_cast<quint16>(metricsPort));
+
     QQmlApplicationEngine engine;
     QObject::connect(
         &engine,